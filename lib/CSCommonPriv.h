@@ -104,6 +104,7 @@ enum {
 	kSecCodeSignatureNoHash							=  0,	/* null value */
 	kSecCodeSignatureHashSHA1						=  1,	/* SHA-1 */
 	kSecCodeSignatureHashSHA256						=  2,	/* SHA-256 */
+	kSecCodeSignatureHashSHA256Tree					= 16,	/* SHA-256 Merkle tree over 64KiB chunks */
 	kSecCodeSignatureHashPrestandardSkein160x256	= 32,	/* Skein, 160 bits, 256 bit pool */
 	kSecCodeSignatureHashPrestandardSkein256x512	= 33,	/* Skein, 256 bits, 512 bit pool */
 	
@@ -29,6 +29,7 @@
 #include "reqparser.h"
 #include "renum.h"
 #include "csdatabase.h"
+#include "catalog.h"
 #include "drmaker.h"
 #include "csutilities.h"
 #include <security_utilities/unix++.h>
@@ -101,7 +102,7 @@ bool SecCodeSigner::valid() const
 {
 	if (mOpFlags & kSecCSRemoveSignature)
 		return true;
-	return mSigner;
+	return mSigner || mSigningService;
 }
 
 
@@ -144,6 +145,60 @@ void SecCodeSigner::returnDetachedSignature(BlobCore *blob, Signer &signer)
 		assert(false);
 }
 
+//
+// A detached signature file gets the SuperBlob written in place from its pieces.
+// Other destinations need it in one piece.
+//
+void SecCodeSigner::returnDetachedSignature(const DetachedSignatureMaker &maker, Signer &signer)
+{
+	assert(mDetached);
+	if (CFGetTypeID(mDetached) == CFURLGetTypeID()) {
+		AutoFileDesc fd(cfString(CFURLRef(mDetached.get())), O_WRONLY | O_CREAT | O_TRUNC);
+		maker.write(fd);
+	} else {
+		DetachedSignatureBlob *blob = maker.make();
+		returnDetachedSignature(blob, signer);
+		::free(blob);
+	}
+}
+
+
+//
+// When making a catalog, each signed piece of code contributes an entry
+// (keyed by its identification) instead of being written anywhere.
+//
+void SecCodeSigner::addCatalogEntry(const EmbeddedSignatureBlob *sig, Signer &signer)
+{
+	assert(mCatalog);
+	SHA1::Digest key;
+	if (!CatalogTable::key(signer.code->diskRep()->base(), key))
+		MacOSError::throwMe(errSecCSNotSupported);
+	CFDictionarySetValue(mCatalog, CFTempData(key, sizeof(key)), CFTempData(sig, sig->length()));
+}
+
+
+//
+// Make a signature catalog of the entries collected so far, and sign it (as a whole).
+//
+CFDataRef SecCodeSigner::copyCatalog()
+{
+	if (!mCatalog || !valid())
+		MacOSError::throwMe(errSecCSInvalidObjectRef);
+	CatalogTable::Maker table;
+	table.add(mCatalog);
+	CatalogBlob::Maker catalog;
+	CatalogTable *tableBlob = table.make();
+	catalog.add(cdCodeDirectorySlot, tableBlob);	// takes ownership
+	Signer signer(*this, NULL);
+	CFRef<CFDataRef> signature = signer.signCatalog(tableBlob);
+	catalog.add(cdSignatureSlot, BlobWrapper::alloc(
+		CFDataGetBytePtr(signature), CFDataGetLength(signature)));
+	CatalogBlob *blob = catalog.make();
+	CFDataRef result = makeCFData(*blob);
+	::free(blob);
+	return result;
+}
+
 
 //
 // Our DiskRep::signingContext methods communicate with the signing subsystem
@@ -241,20 +296,36 @@ SecCodeSigner::Parser::Parser(SecCodeSigner &state, CFDictionaryRef parameters)
 	
 	state.mSDKRoot = get<CFURLRef>(kSecCodeSignerSDKRoot);
     
+	// the CMS signature may be made by a signing service that holds the key;
+	// then only CodeDirectories leave this process, and the service tells us its certificates
+	state.mSigningService = get<CFURLRef>(CFSTR("signing-service"));
+	if (state.mSigningService)
+		state.mCMSSigner = new SocketCMSSigner(cfString(state.mSigningService));
+	else if (state.mSigner && state.mSigner != SecIdentityRef(kCFNull))
+		state.mCMSSigner = new LocalCMSSigner(state.mSigner);
+	else
+		state.mCMSSigner = NULL;
+    
 	if (CFBooleanRef timestampRequest = get<CFBooleanRef>(kSecCodeSignerRequireTimestamp)) {
 		state.mWantTimeStamp = timestampRequest == kCFBooleanTrue;
 	} else {	// pick default
 		state.mWantTimeStamp = false;
-		if (state.mSigner && state.mSigner != SecIdentityRef(kCFNull)) {
-			CFRef<SecCertificateRef> signerCert;
-			MacOSError::check(SecIdentityCopyCertificate(state.mSigner, &signerCert.aref()));
-			if (certificateHasField(signerCert, devIdLeafMarkerOID))
-				state.mWantTimeStamp = true;
-		}
+		if (state.mCMSSigner && certificateHasField(state.mCMSSigner->leaf(), devIdLeafMarkerOID))
+			state.mWantTimeStamp = true;
 	}
 	state.mTimestampAuthentication = get<SecIdentityRef>(kSecCodeSignerTimestampAuthentication);
 	state.mTimestampService = get<CFURLRef>(kSecCodeSignerTimestampServer);
 	state.mNoTimeStampCerts = getBool(kSecCodeSignerTimestampOmitCertificates);
+	
+	state.mCache = get<CFURLRef>(CFSTR("signing-cache"));
+	
+	// code patched since it was signed may say what changed (in the form
+	// SecStaticCodeCopyDifferences gives its pages), and only that is re-hashed
+	state.mDirtyRanges = get<CFDictionaryRef>(CFSTR("dirty-ranges"));
+	
+	// signatures may be collected into a catalog rather than written
+	if (getBool(CFSTR("catalog")))
+		state.mCatalog.take(makeCFMutableDictionary());
 }
 
 
@@ -30,6 +30,8 @@
 #include "cs.h"
 #include "StaticCode.h"
 #include "cdbuilder.h"
+#include "sigblob.h"
+#include "cmssigner.h"
 #include <Security/SecIdentity.h>
 #include <security_utilities/utilities.h>
 
@@ -60,6 +62,9 @@ public:
 	void remove(SecStaticCode *code, SecCSFlags flags);
 	
 	void returnDetachedSignature(BlobCore *blob, Signer &signer);
+	void returnDetachedSignature(const DetachedSignatureMaker &maker, Signer &signer);
+	void addCatalogEntry(const EmbeddedSignatureBlob *sig, Signer &signer);
+	CFDataRef copyCatalog();		// signed catalog of all entries so far
 	
 protected:
 	std::string sdkPath(const std::string &path) const;
@@ -89,6 +94,11 @@ private:
 	CFRef<CFURLRef> mTimestampService;		// URL for Timestamp server
     bool mWantTimeStamp;          // use a Timestamp server
     bool mNoTimeStampCerts;       // don't request certificates with timestamping request
+	CFRef<CFURLRef> mCache;			// signing cache directory (NULL => no cache)
+	CFRef<CFMutableDictionaryRef> mCatalog; // catalog entries collected (NULL => not making a catalog)
+	CFRef<CFURLRef> mSigningService; // remote signing service socket (NULL => sign locally)
+	RefPointer<CMSSigner> mCMSSigner; // makes our CMS signatures (NULL if ad-hoc)
+	CFRef<CFDictionaryRef> mDirtyRanges; // changes since existing signature, per architecture (NULL => sign in full)
 };
 
 
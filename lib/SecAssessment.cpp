@@ -23,6 +23,7 @@
 #include "cs.h"
 #include "SecAssessment.h"
 #include "policydb.h"
+#include "policysnapshot.h"
 #include "policyengine.h"
 #include "xpcengine.h"
 #include "csutilities.h"
@@ -30,7 +31,10 @@
 #include <security_utilities/globalizer.h>
 #include <security_utilities/unix++.h>
 #include <security_utilities/cfmunge.h>
+#include <security_utilities/threading.h>
+#include <dispatch/dispatch.h>
 #include <notify.h>
+#include <deque>
 
 using namespace CodeSigning;
 
@@ -109,6 +113,18 @@ public:
 ModuleNexus<ReadPolicy> gDatabase;
 
 
+//
+// Quick-check the object cache. A current policy snapshot can answer without
+// the database (which we then never open); failing that, we ask the database.
+//
+static bool checkCache(CFURLRef path, AuthorityType type, CFMutableDictionaryRef result)
+{
+	if (RefPointer<PolicySnapshot> snapshot = PolicySnapshot::current())
+		return snapshot->checkCache(path, type, result);
+	return gDatabase().checkCache(path, type, result);
+}
+
+
 //
 // An on-demand instance of the policy engine
 //
@@ -125,6 +141,7 @@ const CFStringRef kSecAssessmentAssessmentSource = CFSTR("assessment:authority:s
 const CFStringRef kSecAssessmentAssessmentAuthorityRow = CFSTR("assessment:authority:row");
 const CFStringRef kSecAssessmentAssessmentAuthorityOverride = CFSTR("assessment:authority:override");
 const CFStringRef kSecAssessmentAssessmentFromCache = CFSTR("assessment:authority:cached");
+const CFStringRef kSecAssessmentAssessmentIdentifier = CFSTR("assessment:identifier");
 
 const CFStringRef kDisabledOverride = CFSTR("security disabled");
 
@@ -148,7 +165,7 @@ SecAssessmentRef SecAssessmentCreate(CFURLRef path,
 	try {
 		// check the object cache first unless caller denied that or we need extended processing
 		if (!(flags & (kSecAssessmentFlagRequestOrigin | kSecAssessmentFlagIgnoreCache))) {
-			if (gDatabase().checkCache(path, type, result))
+			if (checkCache(path, type, result))
 				return new SecAssessment(path, result.yield());
 		}
 		
@@ -184,13 +201,117 @@ SecAssessmentRef SecAssessmentCreate(CFURLRef path,
 }
 
 
-static void traceResult(SecAssessment &assessment, CFDictionaryRef result)
+//
+// Assessment outcome tracing.
+// This is kept off the assessment path. Each outcome is boiled down to a small record
+// (made from what the assessment already knows) and handed to a serial background queue,
+// which sends the MessageTraces. The backlog is bounded; if the queue falls that far behind,
+// further records are dropped. Identical outcomes in a row are coalesced into one trace.
+//
+class OutcomeTracer {
+public:
+	OutcomeTracer();
+	
+	enum Verdict { granted, denied, overridden };
+	struct Record {
+		Record() : verdict(granted), count(1) { }
+		string path;			// assessed path
+		string identifier;		// signing identifier ("" if unknown)
+		string authority;		// authority source label
+		Verdict verdict;
+		unsigned count;			// number of identical outcomes
+		
+		bool operator == (const Record &other) const
+		{
+			return verdict == other.verdict && path == other.path
+				&& identifier == other.identifier && authority == other.authority;
+		}
+	};
+	
+	void operator () (const Record &record);	// enqueue
+	void flush();								// send what's pending, waiting (a bit) for it
+	
+	static const size_t maxBacklog = 100;
+	static const unsigned flushLimit = 1;		// seconds to hold up exit for pending traces
+
+private:
+	void drain();
+	static void flushAtExit();
+	static void send(const Record &record);
+
+private:
+	Mutex mLock;
+	std::deque<Record> mBacklog;
+	unsigned mDropped;					// records dropped since last drain
+	bool mScheduled;					// drain is pending on mQueue
+	dispatch_queue_t mQueue;
+};
+
+static ModuleNexus<OutcomeTracer> outcomeTracer;
+
+
+OutcomeTracer::OutcomeTracer()
+	: mDropped(0), mScheduled(false)
 {
-	if (CFDictionaryGetValue(result, CFSTR("assessment:remote")))
-		return;		// just traced in syspolicyd
+	mQueue = dispatch_queue_create("com.apple.SecAssessment.trace", NULL);
+	dispatch_set_target_queue(mQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+	atexit(flushAtExit);	// short-lived clients (spctl) would otherwise exit with traces pending
+}
+
+void OutcomeTracer::operator () (const Record &record)
+{
+	StLock<Mutex> _(mLock);
+	if (!mBacklog.empty() && mBacklog.back() == record)
+		mBacklog.back().count++;
+	else if (mBacklog.size() < maxBacklog)
+		mBacklog.push_back(record);
+	else
+		mDropped++;
+	if (!mScheduled) {
+		mScheduled = true;
+		dispatch_async(mQueue, ^{ drain(); });
+	}
+}
+
+void OutcomeTracer::flush()
+{
+	{
+		StLock<Mutex> _(mLock);
+		if (!mScheduled)
+			return;		// nothing pending
+	}
+	dispatch_semaphore_t done = dispatch_semaphore_create(0);
+	dispatch_async(mQueue, ^{ drain(); dispatch_semaphore_signal(done); });
+	if (dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, flushLimit * NSEC_PER_SEC)) == 0)
+		dispatch_release(done);
+	// else the block still needs it; we're on our way out, so let it be
+}
+
+void OutcomeTracer::flushAtExit()
+{
+	outcomeTracer().flush();
+}
 
-	CFRef<CFURLRef> url = CFURLCopyAbsoluteURL(assessment.path);
-	string sanitized = cfString(url);
+void OutcomeTracer::drain()
+{
+	std::deque<Record> records;
+	unsigned dropped;
+	{
+		StLock<Mutex> _(mLock);
+		records.swap(mBacklog);
+		dropped = mDropped;
+		mDropped = 0;
+		mScheduled = false;
+	}
+	if (dropped)
+		secdebug("assessment", "%u outcome traces dropped", dropped);
+	for (std::deque<Record>::const_iterator it = records.begin(); it != records.end(); ++it)
+		send(*it);
+}
+
+void OutcomeTracer::send(const Record &record)
+{
+	string sanitized = record.path;
 	string::size_type rslash = sanitized.rfind('/');
 	if (rslash != string::npos)
 		sanitized = sanitized.substr(rslash+1);
@@ -199,39 +320,63 @@ static void traceResult(SecAssessment &assessment, CFDictionaryRef result)
 		sanitized = sanitized.substr(dot+1);
 	else
 		sanitized = "(none)";
+	
+	const char *identifier = record.identifier.empty() ? "UNBUNDLED" : record.identifier.c_str();
+	const char *authority = record.authority.c_str();
 
-	string identifier = "UNBUNDLED";
-	if (CFRef<CFBundleRef> bundle = CFBundleCreate(NULL, assessment.path))
-		if (CFStringRef ident = CFBundleGetIdentifier(bundle))
-			identifier = cfString(ident);
+	MessageTrace trace("com.apple.security.assessment.outcome", NULL);
+	trace.add("signature2", "bundle:%s", identifier);
+	if (record.count > 1)
+		trace.add("count", "%u", record.count);
+	switch (record.verdict) {
+	case denied:
+		trace.add("signature", "denied:%s", authority);
+		trace.add("signature3", sanitized.c_str());
+		trace.send("assessment denied for %s", sanitized.c_str());
+		break;
+	case overridden:
+		trace.add("signature", "override:%s", authority);
+		trace.add("signature3", sanitized.c_str());
+		trace.send("assessment denied for %s but overridden", sanitized.c_str());
+		break;
+	case granted:
+		trace.add("signature", "granted:%s", authority);
+		trace.add("signature3", sanitized.c_str());
+		trace.send("assessment granted for %s by %s", sanitized.c_str(), authority);
+		break;
+	}
+}
+
+
+static void traceResult(SecAssessment &assessment, CFDictionaryRef result)
+{
+	if (CFDictionaryGetValue(result, CFSTR("assessment:remote")))
+		return;		// just traced in syspolicyd
+
+	OutcomeTracer::Record record;
+	record.path = cfString(assessment.path);
+	if (CFStringRef identifier = CFStringRef(CFDictionaryGetValue(result, kSecAssessmentAssessmentIdentifier)))
+		record.identifier = cfString(identifier);
 	
-	string authority = "UNSPECIFIED";
+	record.authority = "UNSPECIFIED";
 	bool overridden = false;
 	if (CFDictionaryRef authdict = CFDictionaryRef(CFDictionaryGetValue(result, kSecAssessmentAssessmentAuthority))) {
 		if (CFStringRef auth = CFStringRef(CFDictionaryGetValue(authdict, kSecAssessmentAssessmentSource)))
-			authority = cfString(auth);
+			record.authority = cfString(auth);
 		else
-			authority = "no authority";
+			record.authority = "no authority";
 		if (CFTypeRef override = CFDictionaryGetValue(authdict, kSecAssessmentAssessmentAuthorityOverride))
 			if (CFEqual(override, kDisabledOverride))
 				overridden = true;
 	}
 	
-	MessageTrace trace("com.apple.security.assessment.outcome", NULL);
-	trace.add("signature2", "bundle:%s", identifier.c_str());
-	if (CFDictionaryGetValue(result, kSecAssessmentAssessmentVerdict) == kCFBooleanFalse) {
-		trace.add("signature", "denied:%s", authority.c_str());
-		trace.add("signature3", sanitized.c_str());
-		trace.send("assessment denied for %s", sanitized.c_str());
-	} else if (overridden) {
-		trace.add("signature", "override:%s", authority.c_str());
-		trace.add("signature3", sanitized.c_str());
-		trace.send("assessment denied for %s but overridden", sanitized.c_str());
-	} else {
-		trace.add("signature", "granted:%s", authority.c_str());
-		trace.add("signature3", sanitized.c_str());
-		trace.send("assessment granted for %s by %s", sanitized.c_str(), authority.c_str());
-	}
+	if (CFDictionaryGetValue(result, kSecAssessmentAssessmentVerdict) == kCFBooleanFalse)
+		record.verdict = OutcomeTracer::denied;
+	else if (overridden)
+		record.verdict = OutcomeTracer::overridden;
+	else
+		record.verdict = OutcomeTracer::granted;
+	outcomeTracer()(record);
 }
 
 
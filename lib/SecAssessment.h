@@ -131,6 +131,7 @@ extern const CFStringRef kSecAssessmentAssessmentSource;		// CFStringRef: primar
 extern const CFStringRef kSecAssessmentAssessmentFromCache;	// present if result is from cache
 extern const CFStringRef kSecAssessmentAssessmentAuthorityRow; // (internal)
 extern const CFStringRef kSecAssessmentAssessmentAuthorityOverride; // (internal)
+extern const CFStringRef kSecAssessmentAssessmentIdentifier;	// (internal) signing identifier of assessed code
 
 extern const CFStringRef kDisabledOverride;					// AuthorityOverride value for "Gatekeeper is disabled"
 
@@ -43,6 +43,7 @@ extern "C" {
 extern const CFStringRef kSecCodeInfoCodeDirectory;			/* Internal */
 extern const CFStringRef kSecCodeInfoCodeOffset;			/* Internal */
 extern const CFStringRef kSecCodeInfoResourceDirectory;		/* Internal */
+extern const CFStringRef kSecCodeInfoValidationTimes;		/* generic; needs kSecCSRecordValidationTimes */
 
 
 /*!
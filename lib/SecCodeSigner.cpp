@@ -108,3 +108,18 @@ OSStatus SecCodeSignerAddSignatureWithErrors(SecCodeSignerRef signerRef,
 	SecCodeSigner::required(signerRef)->sign(SecStaticCode::required(codeRef), flags);
     END_CSAPI_ERRORS
 }
+
+
+//
+// Produce a signature catalog
+//
+OSStatus SecCodeSignerCopyCatalog(SecCodeSignerRef signerRef, SecCSFlags flags,
+	CFDataRef *catalog)
+{
+	BEGIN_CSAPI
+	
+	checkFlags(flags);
+	CodeSigning::Required(catalog) = SecCodeSigner::required(signerRef)->copyCatalog();
+	
+	END_CSAPI
+}
@@ -211,6 +211,29 @@ OSStatus SecCodeSignerAddSignatureWithErrors(SecCodeSignerRef signer,
 	SecStaticCodeRef code, SecCSFlags flags, CFErrorRef *errors);
 
 
+/*!
+	@function SecCodeSignerCopyCatalog
+	Produce a signature catalog of the code signed so far with a SecCodeSigner.
+	
+	If a SecCodeSigner is created with the (private) "catalog" parameter set to
+	kCFBooleanTrue, SecCodeSignerAddSignature does not write signatures anywhere, nor
+	does it make a CMS signature for each piece of code. Instead, each signature is
+	added to a catalog, indexed by the identity of the code it belongs to. This function
+	returns that catalog, signed as a whole (once) with the signer's identity.
+	Write it to a file and pass that to SecStaticCodeCreateWithPathAndAttributes
+	(as kSecCodeAttributeCatalog) to validate code against it.
+	Only code without architectures (that is, not Mach-O) can be cataloged.
+
+	@param signer A SecCodeSigner object created for making a catalog.
+	@param flags Optional flags. Pass kSecCSDefaultFlags for standard behavior.
+	@param catalog On successful return, the catalog data. The caller owns it.
+	@result Upon success, noErr. Upon error, an OSStatus value documented in
+	CSCommon.h or certain other Security framework headers.
+*/
+OSStatus SecCodeSignerCopyCatalog(SecCodeSignerRef signer, SecCSFlags flags,
+	CFDataRef *catalog);
+
+
 #ifdef __cplusplus
 }
 #endif
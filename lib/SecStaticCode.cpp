@@ -26,9 +26,15 @@
 //
 #include "cs.h"
 #include "StaticCode.h"
+#include "catalog.h"
+#include "sigdiff.h"
 #include <security_utilities/cfmunge.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <dispatch/dispatch.h>
+#include <algorithm>
+#include <set>
 
 using namespace CodeSigning;
 
@@ -60,6 +66,8 @@ OSStatus SecStaticCodeCreateWithPath(CFURLRef path, SecCSFlags flags, SecStaticC
 const CFStringRef kSecCodeAttributeArchitecture =	CFSTR("architecture");
 const CFStringRef kSecCodeAttributeSubarchitecture =CFSTR("subarchitecture");
 const CFStringRef kSecCodeAttributeBundleVersion =	CFSTR("bundleversion");
+const CFStringRef kSecCodeAttributeArchive =		CFSTR("archive");
+const CFStringRef kSecCodeAttributeCatalog =		CFSTR("catalog");
 
 OSStatus SecStaticCodeCreateWithPathAndAttributes(CFURLRef path, SecCSFlags flags, CFDictionaryRef attributes,
 	SecStaticCodeRef *staticCodeRef)
@@ -69,6 +77,7 @@ OSStatus SecStaticCodeCreateWithPathAndAttributes(CFURLRef path, SecCSFlags flag
 	checkFlags(flags);
 	DiskRep::Context ctx;
 	std::string version; // holds memory placed into ctx
+	RefPointer<SignatureCatalog> catalog;
 	if (attributes) {
 		std::string archName;
 		int archNumber, subarchNumber;
@@ -81,9 +90,19 @@ OSStatus SecStaticCodeCreateWithPathAndAttributes(CFURLRef path, SecCSFlags flag
 			ctx.arch = Architecture(archNumber);
 		if (cfscan(attributes, "{%O=%s}", kSecCodeAttributeBundleVersion, &version))
 			ctx.version = version.c_str();
+		if (CFDictionaryGetValue(attributes, kSecCodeAttributeArchive) == kCFBooleanTrue)
+			ctx.archive = true;
+		if (CFTypeRef catalogURL = CFDictionaryGetValue(attributes, kSecCodeAttributeCatalog)) {
+			if (CFGetTypeID(catalogURL) != CFURLGetTypeID())
+				MacOSError::throwMe(errSecCSInvalidAttributeValues);
+			catalog = SignatureCatalog::open(cfString(CFURLRef(catalogURL)));
+		}
 	}
 	
-	CodeSigning::Required(staticCodeRef) = (new SecStaticCode(DiskRep::bestGuess(cfString(path).c_str(), &ctx)))->handle();
+	SecPointer<SecStaticCode> code = new SecStaticCode(DiskRep::bestGuess(cfString(path).c_str(), &ctx));
+	if (catalog)
+		code->catalogSignature(catalog);
+	CodeSigning::Required(staticCodeRef) = code->handle();
 
 	END_CSAPI
 }
@@ -92,37 +111,67 @@ OSStatus SecStaticCodeCreateWithPathAndAttributes(CFURLRef path, SecCSFlags flag
 //
 // Check static validity of a StaticCode
 //
-static void validate(SecStaticCode *code, const SecRequirement *req, SecCSFlags flags);
-static void validateNested(string location, const SecRequirement *req, SecCSFlags flags, string exclude = "/");
+static void validate(SecStaticCode *code, const SecRequirement *req, SecCSFlags flags, DigestMemo *memo = NULL);
+static void augmentArchitecture(SecStaticCode *code, CSError &err);
+
 
-static void validate(SecStaticCode *code, const SecRequirement *req, SecCSFlags flags)
+//
+// Nested code validation.
+// All nested code is discovered up front (recursively), deduplicated by file identity,
+// and then validated concurrently. Each distinct piece of nested code is validated once,
+// no matter how often it is reachable through symlinks or different containers.
+// If anything fails, we report the failure that a sequential walk (in name order) would
+// have run into first, annotated just as that walk would have done it.
+//
+class NestedValidation {
+public:
+	NestedValidation(SecStaticCode *host, const SecRequirement *req, SecCSFlags flags);
+	void operator () ();
+	
+private:
+	struct Item {
+		Item(const string &p, ssize_t up) : path(p), parent(up), status(noErr) { }
+		string path;							// where we found it
+		ssize_t parent;							// index of containing Item (-1 if host)
+		SecPointer<SecStaticCode> code;			// the code (if we got that far)
+		OSStatus status;						// outcome
+		CFRef<CFDictionaryRef> info;			// error info dictionary (if it failed with a CSError)
+		
+		void fail(const CommonError &err);
+	};
+	
+	void discover(SecStaticCode *code, ssize_t parent);
+	void discover(string location, ssize_t parent, string exclude = "/");
+	bool firstSighting(const string &path);
+	void report(size_t index) __attribute__((noreturn));
+
+private:
+	SecPointer<SecStaticCode> mHost;
+	const SecRequirement *mRequirement;
+	SecCSFlags mFlags;
+	std::vector<Item> mItems;				// in sequential (depth-first) order
+	std::set<std::pair<dev_t, ino_t> > mSeen; // file identities already listed
+};
+
+static void validate(SecStaticCode *code, const SecRequirement *req, SecCSFlags flags, DigestMemo *memo)
 {
 	try {
+		if (flags & kSecCSRecordValidationTimes)
+			code->recordPhases(true);
+		code->digestMemo(memo);				// shared with the rest of this validation (if any)
 		code->validateNonResourceComponents();	// also validates the CodeDirectory
 		if (!(flags & kSecCSDoNotValidateExecutable))
 			code->validateExecutable();
 		if (!(flags & kSecCSDoNotValidateResources))
-			code->validateResources();
+			code->validateResources(flags);
 		if (req)
 			code->validateRequirement(req->requirement(), errSecCSReqFailed);
-		if (flags & kSecCSCheckNestedCode)
-			if (CFURLRef baseUrl = code->resourceBase()) {
-				// CFBundle has no orderly enumerator of these things, so this is somewhat ad-hoc.
-				// (It should be augmented by information in ResourceDirectory.)
-				string base = cfString(baseUrl) + "/";
-				validateNested(base + "Frameworks", req, flags);
-				validateNested(base + "SharedFrameworks", req, flags);
-				validateNested(base + "PlugIns", req, flags);
-				validateNested(base + "Plug-ins", req, flags);
-				validateNested(base + "XPCServices", req, flags);
-				validateNested(base + "MacOS", req, flags, code->mainExecutablePath());	// helpers
-			}
+		if (flags & kSecCSCheckNestedCode) {
+			NestedValidation nested(code, req, flags);
+			nested();
+		}
 	} catch (CSError &err) {
-		if (Universal *fat = code->diskRep()->mainExecutableImage())	// Mach-O
-			if (MachO *mach = fat->architecture()) {
-				err.augment(kSecCFErrorArchitecture, CFTempString(mach->architecture().displayName()));
-				delete mach;
-			}
+		augmentArchitecture(code, err);
 		throw;
 	} catch (const MacOSError &err) {
 		// add architecture information if we can get it
@@ -137,7 +186,71 @@ static void validate(SecStaticCode *code, const SecRequirement *req, SecCSFlags
 	}
 }
 
-static void validateNested(string location, const SecRequirement *req, SecCSFlags flags, string exclude)
+static void augmentArchitecture(SecStaticCode *code, CSError &err)
+{
+	if (Universal *fat = code->diskRep()->mainExecutableImage())	// Mach-O
+		if (MachO *mach = fat->architecture()) {
+			err.augment(kSecCFErrorArchitecture, CFTempString(mach->architecture().displayName()));
+			delete mach;
+		}
+}
+
+
+NestedValidation::NestedValidation(SecStaticCode *host, const SecRequirement *req, SecCSFlags flags)
+	: mHost(host), mRequirement(req), mFlags(flags & ~kSecCSCheckNestedCode)
+{
+	firstSighting(cfString(host->canonicalPath(), true));	// don't go around in circles
+}
+
+void NestedValidation::operator () ()
+{
+	discover(mHost, -1);
+	if (mItems.empty())
+		return;
+	
+	Item *items = &mItems[0];
+	const SecRequirement *req = mRequirement;
+	SecCSFlags flags = mFlags;
+	DigestMemo *memo = mHost->digestMemo();
+	dispatch_apply(mItems.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t n) {
+		Item &item = items[n];
+		if (item.code)		// not if discovery already failed
+			try {
+				validate(item.code, req, flags, memo);
+			} catch (const CommonError &err) {
+				item.fail(err);
+			} catch (...) {
+				item.status = errSecCSInternalError;
+			}
+	});
+	
+	for (size_t n = 0; n < mItems.size(); n++)
+		if (mItems[n].status != noErr)
+			report(n);
+}
+
+
+//
+// Find the nested code of some code, and (recursively) of that nested code.
+// CFBundle has no orderly enumerator of these things, so this is somewhat ad-hoc.
+// (It should be augmented by information in ResourceDirectory.)
+//
+void NestedValidation::discover(SecStaticCode *code, ssize_t parent)
+{
+	if (code->diskRep()->resourceStore())		// nested code isn't in the file system
+		MacOSError::throwMe(errSecCSUnimplemented);
+	if (CFURLRef baseUrl = code->resourceBase()) {
+		string base = cfString(baseUrl) + "/";
+		discover(base + "Frameworks", parent);
+		discover(base + "SharedFrameworks", parent);
+		discover(base + "PlugIns", parent);
+		discover(base + "Plug-ins", parent);
+		discover(base + "XPCServices", parent);
+		discover(base + "MacOS", parent, code->mainExecutablePath());	// helpers
+	}
+}
+
+void NestedValidation::discover(string location, ssize_t parent, string exclude)
 {
 	DIR *dir = opendir(location.c_str());
 	if (dir == 0) {
@@ -145,6 +258,7 @@ static void validateNested(string location, const SecRequirement *req, SecCSFlag
 			return;
 		UnixError::throwMe();
 	}
+	std::vector<string> names;
 	while (struct dirent *dp = readdir(dir)) {
 		switch (dp->d_type) {
 		case DT_REG:
@@ -156,18 +270,66 @@ static void validateNested(string location, const SecRequirement *req, SecCSFlag
 		}
 		if (dp->d_name[0] == '.')
 			continue;
-		string path = location + "/" + dp->d_name;
+		names.push_back(dp->d_name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());	// readdir order is arbitrary
+	
+	for (std::vector<string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+		string path = location + "/" + *it;
 		if (path == exclude)	// main executable; skip
 			continue;
+		if (!firstSighting(path))
+			continue;
+		ssize_t index = mItems.size();
+		mItems.push_back(Item(path, parent));
 		try {
 			SecPointer<SecStaticCode> code = new SecStaticCode(DiskRep::bestGuess(path));
-			validate(code, req, flags);
-		} catch (CSError &err) {
-			err.augment(kSecCFErrorPath, CFTempURL(path));
-			throw;
+			mItems[index].code = code;
+			discover(code, index);
+		} catch (const CommonError &err) {
+			mItems[index].fail(err);
 		}
 	}
-	closedir(dir);
+}
+
+
+//
+// Returns true the first time it sees a given file (following symlinks).
+//
+bool NestedValidation::firstSighting(const string &path)
+{
+	struct stat st;
+	if (::stat(path.c_str(), &st))
+		return true;		// can't tell; let validation complain about it
+	return mSeen.insert(std::make_pair(st.st_dev, st.st_ino)).second;
+}
+
+
+void NestedValidation::Item::fail(const CommonError &err)
+{
+	status = err.osStatus();
+	if (const CSError *cserr = dynamic_cast<const CSError *>(&err))
+		info = cserr->infoDict();
+}
+
+
+//
+// Throw the error of an Item, annotated as if we had gotten there by recursion:
+// each enclosing level adds its path and (if it is Mach-O) architecture.
+// Other kinds of errors are turned into CSErrors, so they get the same annotation.
+//
+void NestedValidation::report(size_t index)
+{
+	const Item &failed = mItems[index];
+	CSError err(failed.status, failed.info ? CFDictionaryRef(CFRetain(failed.info)) : NULL);
+	for (ssize_t n = index; n >= 0; n = mItems[n].parent) {
+		const Item &item = mItems[n];
+		if (item.code && n != ssize_t(index))
+			augmentArchitecture(item.code, err);
+		err.augment(kSecCFErrorPath, CFTempURL(item.path));
+	}
+	throw err;
 }
 
 
@@ -188,17 +350,24 @@ OSStatus SecStaticCodeCheckValidityWithErrors(SecStaticCodeRef staticCodeRef, Se
 		| kSecCSDoNotValidateResources
 		| kSecCSConsiderExpiration
 		| kSecCSEnforceRevocationChecks
-		| kSecCSCheckNestedCode);
+		| kSecCSCheckNestedCode
+		| kSecCSRecordValidationTimes
+		| kSecCSFailFast);
 
 	SecPointer<SecStaticCode> code = SecStaticCode::requiredStatic(staticCodeRef);
 	const SecRequirement *req = SecRequirement::optional(requirementRef);
 	DTRACK(CODESIGN_EVAL_STATIC, code, (char*)code->mainExecutablePath().c_str());
+	
+	// nested code means files covered by several seals; hash each of them just once
+	RefPointer<DigestMemo> memo;
+	if (flags & kSecCSCheckNestedCode)
+		memo = new DigestMemo;
 	if (flags & kSecCSCheckAllArchitectures) {
 		SecStaticCode::AllArchitectures archs(code);
 		while (SecPointer<SecStaticCode> scode = archs())
-			validate(scode, req, flags);
+			validate(scode, req, flags, memo);
 	} else
-		validate(code, req, flags);
+		validate(code, req, flags, memo);
 
 	END_CSAPI_ERRORS
 }
@@ -299,3 +468,26 @@ OSStatus SecCodeMapMemory(SecStaticCodeRef codeRef, SecCSFlags flags)
 
 	END_CSAPI
 }
+
+
+//
+// Compare the signatures of two versions of code
+//
+const CFStringRef kSecCodeDifferencePages =				CFSTR("pages");
+const CFStringRef kSecCodeDifferenceOffset =			CFSTR("offset");
+const CFStringRef kSecCodeDifferenceLength =			CFSTR("length");
+const CFStringRef kSecCodeDifferenceResourcesAdded =	CFSTR("resources-added");
+const CFStringRef kSecCodeDifferenceResourcesRemoved =	CFSTR("resources-removed");
+const CFStringRef kSecCodeDifferenceResourcesChanged =	CFSTR("resources-changed");
+
+OSStatus SecStaticCodeCopyDifferences(SecStaticCodeRef olderRef, SecStaticCodeRef newerRef,
+	SecCSFlags flags, CFDictionaryRef *differences)
+{
+	BEGIN_CSAPI
+	
+	checkFlags(flags);
+	SignatureDiff diff(SecStaticCode::requiredStatic(olderRef), SecStaticCode::requiredStatic(newerRef));
+	CodeSigning::Required(differences) = diff.differences();
+
+	END_CSAPI
+}
@@ -36,9 +36,89 @@ extern "C" {
 #endif
 
 
-/*
- * Currently empty
+/*!
+	Private flags for SecStaticCodeCheckValidity.
+	
+	@constant kSecCSRecordValidationTimes
+	Keep performance accounts for this validation. The time (wall clock and CPU)
+	and number of bytes processed is recorded separately for signature verification,
+	executable page hashing, resource enumeration, resource hashing, and requirement
+	evaluation. The results are returned by SecCodeCopySigningInformation under the
+	kSecCodeInfoValidationTimes key. Accounts are kept until validity is reset.
+	Work already done (and cached) by an earlier validation is not counted again.
+	
+	@constant kSecCSFailFast
+	Stop at the first problem found instead of collecting all of them. Cheap checks
+	(files added to or missing from the resource seal) are made before any resource
+	is hashed. The error returned describes only that first problem. A failure found
+	this way is not remembered, so a later validation without this flag does the full
+	work and reports all problems.
+ */
+enum {
+	kSecCSRecordValidationTimes = 1 << 4,
+	kSecCSFailFast = 1 << 5,
+};
+
+
+/*!
+	Private attributes for SecStaticCodeCreateWithPathAndAttributes.
+	
+	@constant kSecCodeAttributeArchive
+	If present and kCFBooleanTrue, the path names a zip or (uncompressed) tar archive
+	containing a bundle, and the resulting StaticCode object represents that bundle.
+	Signing data, sealed resources, and the main executable are read directly out of
+	the archive; nothing is extracted into the file system. The bundle is the archive
+	root or the top-level directory (or Payload/ entry) holding an Info.plist.
+	Such code can be validated but not signed, and kSecCSCheckNestedCode is not supported.
+	
+	@constant kSecCodeAttributeCatalog
+	A CFURL naming a signature catalog file. If the catalog holds a signature for the
+	code, that signature is used in preference to any other. The catalog's own CMS
+	signature is verified once for all code validated against it (per set of validation
+	flags), so validating many small files sealed by one catalog costs one signature
+	verification, plus a table lookup and the usual hashing for each file.
  */
+extern const CFStringRef kSecCodeAttributeArchive;
+extern const CFStringRef kSecCodeAttributeCatalog;
+
+
+/*!
+	@function SecStaticCodeCopyDifferences
+	Describe how one version of code differs from another, judging only by their
+	signatures. No file contents are read, and neither signature is validated; validate
+	both versions first if the answer must be trusted. This is meant for making updates
+	that carry only what changed.
+	
+	@param olderCode A static code object for the old version.
+	@param newerCode A static code object for the new version. It must be signed.
+	@param flags Optional flags. Pass kSecCSDefaultFlags for standard behavior.
+	@param differences On successful return, a dictionary with these keys:
+	
+	@constant kSecCodeDifferencePages
+	A dictionary keyed by architecture name (the empty string for code that has no
+	architectures), covering each architecture of the new version. Each value is an
+	array of byte ranges in that architecture's main executable image whose page hashes
+	changed, in ascending order with adjacent pages coalesced. A range is a dictionary
+	with kSecCodeDifferenceOffset and kSecCodeDifferenceLength (CFNumbers). If the old
+	version lacks the architecture or hashes its pages differently, the one range is
+	everything the new version signs.
+	@constant kSecCodeDifferenceResourcesAdded
+	@constant kSecCodeDifferenceResourcesRemoved
+	@constant kSecCodeDifferenceResourcesChanged
+	Sorted arrays of resource paths (relative to the resource root) that are sealed only
+	by the new version, only by the old version, or by both with different hashes.
+	@result Upon success, noErr. Upon error, an OSStatus value documented in
+	CSCommon.h or certain other Security framework headers.
+ */
+extern const CFStringRef kSecCodeDifferencePages;
+extern const CFStringRef kSecCodeDifferenceOffset;
+extern const CFStringRef kSecCodeDifferenceLength;
+extern const CFStringRef kSecCodeDifferenceResourcesAdded;
+extern const CFStringRef kSecCodeDifferenceResourcesRemoved;
+extern const CFStringRef kSecCodeDifferenceResourcesChanged;
+
+OSStatus SecStaticCodeCopyDifferences(SecStaticCodeRef olderCode, SecStaticCodeRef newerCode,
+	SecCSFlags flags, CFDictionaryRef *differences);
 
 
 #ifdef __cplusplus
@@ -33,8 +33,10 @@
 #include "resources.h"
 #include "renum.h"
 #include "detachedrep.h"
+#include "catalog.h"
 #include "csdatabase.h"
 #include "csutilities.h"
+#include "hwhash.h"
 #include "SecCode.h"
 #include <CoreFoundation/CFURLAccess.h>
 #include <Security/SecPolicyPriv.h>
@@ -48,6 +50,7 @@
 #include <security_utilities/unix++.h>
 #include <security_utilities/cfmunge.h>
 #include <Security/CMSDecoder.h>
+#include <algorithm>
 
 
 namespace Security {
@@ -62,7 +65,7 @@ using namespace UnixPlusPlus;
 SecStaticCode::SecStaticCode(DiskRep *rep)
 	: mRep(rep),
 	  mValidated(false), mExecutableValidated(false), mResourcesValidated(false), mResourcesValidContext(NULL),
-	  mDesignatedReq(NULL), mGotResourceBase(false), mEvalDetails(NULL)
+	  mDesignatedReq(NULL), mGotResourceBase(false), mEvalDetails(NULL), mRecordPhases(false)
 {
 	CODESIGN_STATIC_CREATE(this, rep);
 	checkForSystemSignature();
@@ -139,6 +142,19 @@ void SecStaticCode::checkForSystemSignature()
 }
 
 
+//
+// Attach the signature a signature catalog has for this StaticCode, if any.
+// A catalog signature takes the place of an embedded or system signature.
+//
+void SecStaticCode::catalogSignature(SignatureCatalog *catalog)
+{
+	if (RefPointer<DiskRep> crep = CatalogRep::find(catalog, mRep->base())) {
+		CODESIGN_STATIC_ATTACH_EXPLICIT(this, crep);
+		mRep = crep;
+	}
+}
+
+
 //
 // Return a descriptive string identifying the source of the code signature
 //
@@ -148,6 +164,8 @@ string SecStaticCode::signatureSource()
 		return "unsigned";
 	if (DetachedRep *rep = dynamic_cast<DetachedRep *>(mRep.get()))
 		return rep->source();
+	if (CatalogRep *rep = dynamic_cast<CatalogRep *>(mRep.get()))
+		return rep->source();
 	return "embedded";
 }
 
@@ -208,6 +226,11 @@ void SecStaticCode::resetValidity()
 	mTrust = NULL;
 	mCertChain = NULL;
 	mEvalDetails = NULL;
+	for (unsigned n = 0; n < phaseCount; n++)
+		mPhases[n] = PhaseRecord();
+	mDigestMemo = NULL;
+	if (mResourceBaseFd)
+		mResourceBaseFd.close();
 	mRep->flush();
 	
 	// we may just have updated the system database, so check again
@@ -274,7 +297,7 @@ CFDataRef SecStaticCode::cdHash()
 {
 	if (!mCDHash) {
 		if (const CodeDirectory *cd = codeDirectory(false)) {
-			SHA1 hash;
+			FastSHA1 hash;
 			hash(cd, cd->length());
 			SHA1::Digest digest;
 			hash.finish(digest);
@@ -394,14 +417,53 @@ bool SecStaticCode::verifySignature()
 	}
 	
 	DTRACK(CODESIGN_EVAL_STATIC_SIGNATURE, this, (char*)this->mainExecutablePath().c_str());
+	PhaseTimer timer(this, phaseSignature);
+	
+	// a catalog's signature seals its whole table, and is verified once for all its members
+	if (CatalogRep *rep = dynamic_cast<CatalogRep *>(mRep.get())) {
+		SignatureCatalog *catalog = rep->catalog();
+		StLock<Mutex> _(*catalog);
+		SignatureCatalog::Verdict &verdict = catalog->verdict;
+		if (verdict.valid && verdict.flags == apiFlags()) {
+			mTrust = verdict.trust.get();
+			mCertChain = verdict.certChain.get();
+			mEvalDetails = verdict.evalDetails;
+			mSigningTime = verdict.signingTime;
+			mSigningTimestamp = verdict.signingTimestamp;
+			return verdict.expired;
+		}
+		timer.bytes(CFDataGetLength(catalog->signature()) + CFDataGetLength(catalog->table()));
+		verdict.valid = false;
+		verdict.expired = verifySignature(catalog->signature(), catalog->table());
+		verdict.flags = apiFlags();
+		verdict.trust = mTrust.get();
+		verdict.certChain = mCertChain.get();
+		verdict.evalDetails = mEvalDetails;
+		verdict.signingTime = mSigningTime;
+		verdict.signingTimestamp = mSigningTimestamp;
+		verdict.valid = true;
+		return verdict.expired;
+	}
+	
+	CFDataRef sig = this->signature();
+	timer.bytes(CFDataGetLength(sig) + this->codeDirectory()->length());
+	this->codeDirectory();	// load CodeDirectory (sets mDir)
+	return verifySignature(sig, mDir);
+}
+
 
+//
+// Verify a CMS signature over the given (detached) content, and evaluate trust in its signer.
+// This sets our signature verification outcome (mTrust and friends).
+// Returns true if the signature is only valid if we tolerate expired certificates.
+//
+bool SecStaticCode::verifySignature(CFDataRef sig, CFDataRef content)
+{
 	// decode CMS and extract SecTrust for verification
 	CFRef<CMSDecoderRef> cms;
 	MacOSError::check(CMSDecoderCreate(&cms.aref())); // create decoder
-	CFDataRef sig = this->signature();
 	MacOSError::check(CMSDecoderUpdateMessage(cms, CFDataGetBytePtr(sig), CFDataGetLength(sig)));
-	this->codeDirectory();	// load CodeDirectory (sets mDir)
-	MacOSError::check(CMSDecoderSetDetachedContent(cms, mDir));
+	MacOSError::check(CMSDecoderSetDetachedContent(cms, content));
 	MacOSError::check(CMSDecoderFinalizeMessage(cms));
 	MacOSError::check(CMSDecoderSetSearchKeychain(cms, cfEmptyArray()));
 	CFRef<CFTypeRef> policy = verificationPolicy(apiFlags());
@@ -560,15 +622,18 @@ void SecStaticCode::validateExecutable()
 			const CodeDirectory *cd = this->codeDirectory();
 			if (!cd) 
 				MacOSError::throwMe(errSecCSUnsigned);
-			AutoFileDesc fd(mainExecutablePath(), O_RDONLY);
+			PhaseTimer timer(this, phaseExecutable);
+			timer.bytes(cd->codeLimit);
+			AutoFileDesc fd(mRep->openExecutable());
 			fd.fcntl(F_NOCACHE, true);		// turn off page caching (one-pass)
 			if (Universal *fat = mRep->mainExecutableImage())
 				fd.seek(fat->archOffset());
+			HoleFinder holes(fd);
 			size_t pageSize = cd->pageSize ? (1 << cd->pageSize) : 0;
 			size_t remaining = cd->codeLimit;
 			for (size_t slot = 0; slot < cd->nCodeSlots; ++slot) {
 				size_t size = min(remaining, pageSize);
-				if (!cd->validateSlot(fd, size, slot)) {
+				if (!cd->validateSlot(fd, size, slot, &holes)) {
 					CODESIGN_EVAL_STATIC_EXECUTABLE_FAIL(this, slot);
 					MacOSError::throwMe(errSecCSSignatureFailed);
 				}
@@ -600,9 +665,15 @@ void SecStaticCode::validateExecutable()
 // computes a concordance between what's on disk and what's in the ResourceDirectory.
 // Any unsanctioned difference causes an error.
 //
-void SecStaticCode::validateResources()
+// Normally, we look at everything and report all problems found. With kSecCSFailFast,
+// we stop at the first problem, and we look for added and missing files (which is cheap)
+// before hashing anything. Since a fail-fast error reports only one problem, it is not
+// cached; a later full validation will do the work again and report everything.
+//
+void SecStaticCode::validateResources(SecCSFlags flags)
 {
 	if (!validatedResources()) {
+		bool failFast = flags & kSecCSFailFast;
 		try {
 			// sanity first
 			CFDictionaryRef sealedResources = resourceDictionary();
@@ -625,22 +696,49 @@ void SecStaticCode::validateResources()
 		
 			// make a shallow copy of the ResourceDirectory so we can "check off" what we find
 			CFRef<CFMutableDictionaryRef> resourceMap = makeCFMutableDictionary(files);
-		
-			// scan through the resources on disk, checking each against the resourceDirectory
-			mResourcesValidContext = new CollectingContext(*this);		// collect all failures in here
-			ResourceBuilder resources(cfString(this->resourceBase()), rules, codeDirectory()->hashType);
-			mRep->adjustResources(resources);
-			string path;
-			ResourceBuilder::Rule *rule;
-		
-			while (resources.next(path, rule)) {
-				validateResource(path, *mResourcesValidContext);
-				CFDictionaryRemoveValue(resourceMap, CFTempString(path));
-			}
 			
-			if (CFDictionaryGetCount(resourceMap) > 0) {
-				secdebug("staticCode", "%p sealed resource(s) not found in code", this);
+			// hash hard-linked files just once (unless someone already set this up for us)
+			if (!mDigestMemo)
+				mDigestMemo = new DigestMemo;
+		
+			// find the resources on disk
+			std::vector<string> paths;
+			scanResources(rules, paths);
+
+			// check each against the resourceDirectory
+			if (mResourcesValidContext)		// left over from an uncached (fail-fast) attempt
+				delete mResourcesValidContext;
+			mResourcesValidContext = new CollectingContext(*this, failFast);	// collect failures in here
+			if (failFast) {
+				// cheap checks first: added and missing files, then sizes
+				for (std::vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+					CFTempString path(*it);
+					if (!CFDictionaryContainsKey(files, path))
+						mResourcesValidContext->reportProblem(errSecCSBadResource, kSecCFErrorResourceAdded,
+							CFTempURL(*it, false, resourceBase()));
+					CFDictionaryRemoveValue(resourceMap, path);
+				}
 				CFDictionaryApplyFunction(resourceMap, SecStaticCode::checkOptionalResource, mResourcesValidContext);
+				if (!mRep->resourceStore())		// then sizes, where the seals record them
+					for (std::vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+						ResourceSeal seal = CFDictionaryGetValue(files, CFTempString(*it));
+						struct stat st;
+						if (seal.hasSize() && ::fstatat(resourceBaseDirectory(), it->c_str(), &st, 0) == 0
+								&& st.st_size != seal.size())
+							mResourcesValidContext->reportProblem(errSecCSBadResource, kSecCFErrorResourceAltered,
+								CFTempURL(*it, false, resourceBase()));
+					}
+				for (std::vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+					validateResource(*it, *mResourcesValidContext);
+			} else {
+				for (std::vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+					validateResource(*it, *mResourcesValidContext);
+					CFDictionaryRemoveValue(resourceMap, CFTempString(*it));
+				}
+				if (CFDictionaryGetCount(resourceMap) > 0) {
+					secdebug("staticCode", "%p sealed resource(s) not found in code", this);
+					CFDictionaryApplyFunction(resourceMap, SecStaticCode::checkOptionalResource, mResourcesValidContext);
+				}
 			}
 			
 			// now check for any errors found in the reporting context
@@ -649,6 +747,8 @@ void SecStaticCode::validateResources()
 				mResourcesValidContext->throwMe();
 
 		} catch (const CommonError &err) {
+			if (failFast)
+				throw;			// abbreviated verdict; don't cache
 			mResourcesValidated = true;
 			mResourcesValidResult = err.osStatus();
 			throw;
@@ -667,6 +767,39 @@ void SecStaticCode::validateResources()
 }
 
 
+//
+// Enumerate the resources present in the code that the resource rules
+// would seal (that is, that are neither excluded nor omitted), in the
+// order in which they should be read.
+//
+void SecStaticCode::scanResources(CFDictionaryRef rules, std::vector<string> &paths)
+{
+	PhaseTimer scan(this, phaseResourceEnumeration);
+	if (ResourceStore *store = mRep->resourceStore()) {
+		// resources are not in the file system; let the DiskRep enumerate them
+		ResourceRules resources(rules);
+		mRep->adjustResources(resources);
+		std::vector<string> all;
+		store->resourcePaths(all);
+		for (std::vector<string>::const_iterator it = all.begin(); it != all.end(); ++it)
+			if (resources.findRule(*it))
+				paths.push_back(*it);
+	} else {
+		// return them in inode order; reading them that way takes less seeking
+		ResourceBuilder resources(cfString(this->resourceBase()), rules, codeDirectory()->hashType);
+		mRep->adjustResources(resources);
+		string path;
+		ResourceBuilder::Rule *rule;
+		std::vector<std::pair<ino_t, string> > found;
+		while (FTSENT *ent = resources.next(path, rule))
+			found.push_back(std::make_pair(ent->fts_statp->st_ino, path));
+		std::sort(found.begin(), found.end());
+		for (std::vector<std::pair<ino_t, string> >::const_iterator it = found.begin(); it != found.end(); ++it)
+			paths.push_back(it->second);
+	}
+}
+
+
 void SecStaticCode::checkOptionalResource(CFTypeRef key, CFTypeRef value, void *context)
 {
 	CollectingContext *ctx = static_cast<CollectingContext *>(context);
@@ -785,7 +918,10 @@ CFDataRef SecStaticCode::resource(string path, ValidationContext &ctx)
 			if (!resourceBase())	// no resources in DiskRep
 				MacOSError::throwMe(errSecCSResourcesNotFound);
 			CFRef<CFURLRef> fullpath = makeCFURL(path, false, resourceBase());
-			if (CFRef<CFDataRef> data = cfLoadFile(fullpath)) {
+			PhaseTimer timer(this, phaseResourceHashing);
+			ResourceStore *store = mRep->resourceStore();
+			if (CFRef<CFDataRef> data = store ? store->loadResource(path) : cfLoadFile(fullpath)) {
+				timer.bytes(CFDataGetLength(data));
 				MakeHash<CodeDirectory> hasher(this->codeDirectory());
 				hasher->update(CFDataGetBytePtr(data), CFDataGetLength(data));
 				if (hasher->verify(seal.hash()))
@@ -819,18 +955,47 @@ void SecStaticCode::validateResource(string path, ValidationContext &ctx)
 			ResourceSeal seal = file;
 			if (!resourceBase())	// no resources in DiskRep
 				MacOSError::throwMe(errSecCSResourcesNotFound);
-			CFRef<CFURLRef> fullpath = makeCFURL(path, false, resourceBase());
-			AutoFileDesc fd(cfString(fullpath), O_RDONLY, FileDesc::modeMissingOk);	// open optional filee
-			if (fd) {
-				MakeHash<CodeDirectory> hasher(this->codeDirectory());
-				hashFileData(fd, hasher.get());
-				if (hasher->verify(seal.hash()))
+			PhaseTimer timer(this, phaseResourceHashing);
+			MakeHash<CodeDirectory> hasher(this->codeDirectory());
+			bool present;
+			std::string digest;		// already finished (from mDigestMemo), if not empty
+			if (ResourceStore *store = mRep->resourceStore()) {
+				size_t size;
+				if ((present = store->hashResource(path, hasher.get(), size)))
+					timer.bytes(size);
+			} else {
+				AutoFileDesc fd(openResource(path));	// open optional file
+				if ((present = fd)) {
+					struct stat st;
+					if (seal.hasSize() || mDigestMemo)
+						UnixError::check(::fstat(fd, &st));
+					if (seal.hasSize() && st.st_size != seal.size()) {
+						// no need to read it; it can't possibly match
+						ctx.reportProblem(errSecCSBadResource, kSecCFErrorResourceAltered, CFTempURL(path, false, resourceBase()));
+						return;
+					}
+					if (mDigestMemo) {
+						// this file (or a hard link to it) may already have been hashed in this validation
+						uint32_t hashType = codeDirectory()->hashType;
+						if (!mDigestMemo->find(fd, st, hashType, digest)) {
+							timer.bytes(hashFileData(fd, hasher.get()));
+							digest.resize(hasher->digestLength());
+							hasher->finish((Byte *)&digest[0]);
+							mDigestMemo->add(st, hashType, digest.data(), digest.size());
+						}
+					} else
+						timer.bytes(hashFileData(fd, hasher.get()));
+				}
+			}
+			if (present) {
+				if (digest.empty() ? hasher->verify(seal.hash())
+						: !memcmp(digest.data(), seal.hash(), digest.size()))
 					return;			// verify good
 				else
-					ctx.reportProblem(errSecCSBadResource, kSecCFErrorResourceAltered, fullpath); // altered
+					ctx.reportProblem(errSecCSBadResource, kSecCFErrorResourceAltered, CFTempURL(path, false, resourceBase())); // altered
 			} else {
 				if (!seal.optional())
-					ctx.reportProblem(errSecCSBadResource, kSecCFErrorResourceMissing, fullpath); // was sealed but is now missing
+					ctx.reportProblem(errSecCSBadResource, kSecCFErrorResourceMissing, CFTempURL(path, false, resourceBase())); // was sealed but is now missing
 				else
 					return;			// validly missing
 			}
@@ -841,6 +1006,28 @@ void SecStaticCode::validateResource(string path, ValidationContext &ctx)
 }
 
 
+//
+// Resource files are opened relative to the resource base directory, which we
+// keep open for the purpose. That's cheaper than having the kernel look up the
+// full path each time, and it keeps us in the same directory even if something
+// above it is renamed while we work.
+//
+FileDesc &SecStaticCode::resourceBaseDirectory()
+{
+	if (!mResourceBaseFd)
+		mResourceBaseFd.open(cfString(resourceBase()).c_str(), O_RDONLY | O_DIRECTORY);
+	return mResourceBaseFd;
+}
+
+int SecStaticCode::openResource(const string &path)
+{
+	int fd = ::openat(resourceBaseDirectory(), path.c_str(), O_RDONLY);
+	if (fd < 0 && errno != ENOENT)
+		UnixError::throwMe();
+	return fd;				// -1 if missing
+}
+
+
 //
 // Test a CodeDirectory flag.
 // Returns false if there is no CodeDirectory.
@@ -906,7 +1093,7 @@ const Requirement *SecStaticCode::defaultDesignatedRequirement()
 	if (flag(kSecCodeSignatureAdhoc)) {
 		// adhoc signature: return a plain cdhash requirement
 		Requirement::Maker maker;
-		SHA1 hash;
+		FastSHA1 hash;
 		hash(codeDirectory(), codeDirectory()->length());
 		SHA1::Digest digest;
 		hash.finish(digest);
@@ -949,6 +1136,7 @@ bool SecStaticCode::satisfiesRequirement(const Requirement *req, OSStatus failur
 {
 	assert(req);
 	validateDirectory();
+	PhaseTimer timer(this, phaseRequirements);
 	return req->validates(Requirement::Context(mCertChain, infoDictionary(), entitlements(), codeDirectory()->identifier(), codeDirectory()), failure);
 }
 
@@ -1095,10 +1283,86 @@ CFDictionaryRef SecStaticCode::signingInformation(SecCSFlags flags)
 		if (CFRef<CFArrayRef> files = mRep->modifiedFiles())
 			CFDictionaryAddValue(dict, kSecCodeInfoChangedFiles, files);
 	
+	//
+	// If validation was asked to keep performance accounts, deliver them
+	//
+	if (CFRef<CFDictionaryRef> times = this->phaseTimes())
+		CFDictionaryAddValue(dict, kSecCodeInfoValidationTimes, times);
+	
 	return dict.yield();
 }
 
 
+//
+// Produce the performance accounting collected during validation.
+// Returns NULL if accounting was never turned on.
+// The result is a dictionary keyed by phase name, with each value
+// a dictionary of wall and CPU seconds, bytes digested, and entry count.
+//
+static const char * const phaseNames[] = {
+	"signature",
+	"executable",
+	"resource-enumeration",
+	"resource-hashing",
+	"requirements",
+};
+
+CFDictionaryRef SecStaticCode::phaseTimes()
+{
+	if (!mRecordPhases)
+		return NULL;
+	CFRef<CFMutableDictionaryRef> result = makeCFMutableDictionary();
+	for (unsigned n = 0; n < phaseCount; n++) {
+		const PhaseRecord &rec = mPhases[n];
+		if (rec.count == 0)
+			continue;		// phase never entered
+		CFRef<CFNumberRef> wall = CFNumberCreate(NULL, kCFNumberDoubleType, &rec.wall);
+		CFRef<CFNumberRef> cpu = CFNumberCreate(NULL, kCFNumberDoubleType, &rec.cpu);
+		CFRef<CFNumberRef> bytes = CFNumberCreate(NULL, kCFNumberLongLongType, &rec.bytes);
+		CFRef<CFDictionaryRef> phase = cfmake<CFDictionaryRef>("{wall=%O,cpu=%O,bytes=%O,count=%d}",
+			wall.get(), cpu.get(), bytes.get(), rec.count);
+		CFDictionaryAddValue(result, CFTempString(phaseNames[n]), phase);
+	}
+	return result.yield();
+}
+
+
+//
+// PhaseTimers
+//
+SecStaticCode::PhaseTimer::PhaseTimer(SecStaticCode *code, ValidationPhase phase)
+	: mRecord(code->mRecordPhases ? &code->mPhases[phase] : NULL), mRunning(false)
+{
+	if (mRecord) {
+		mRecord->count++;
+		resume();
+	}
+}
+
+SecStaticCode::PhaseTimer::~PhaseTimer()
+{
+	pause();
+}
+
+void SecStaticCode::PhaseTimer::pause()
+{
+	if (mRecord && mRunning) {
+		mRecord->wall += wallClockSeconds() - mWallStart;
+		mRecord->cpu += cpuSeconds() - mCpuStart;
+		mRunning = false;
+	}
+}
+
+void SecStaticCode::PhaseTimer::resume()
+{
+	if (mRecord && !mRunning) {
+		mWallStart = wallClockSeconds();
+		mCpuStart = cpuSeconds();
+		mRunning = true;
+	}
+}
+
+
 //
 // Resource validation contexts.
 // The default context simply throws a CSError, rudely terminating the operation.
@@ -1128,6 +1392,8 @@ void SecStaticCode::CollectingContext::reportProblem(OSStatus rc, CFStringRef ty
 		}
 		CFArrayAppendValue(element, value);
 	}
+	if (mFailFast)
+		throwMe();
 }
 
 void SecStaticCode::CollectingContext::throwMe()
@@ -32,6 +32,7 @@
 #include "requirement.h"
 #include "diskrep.h"
 #include "codedirectory.h"
+#include "digestmemo.h"
 #include <Security/SecTrust.h>
 #include <CoreFoundation/CFData.h>
 
@@ -40,6 +41,7 @@ namespace CodeSigning {
 
 
 class SecCode;
+class SignatureCatalog;
 
 
 //
@@ -74,10 +76,12 @@ protected:
 	
 	//
 	// A CollectingContext collects all error details and throws an annotated final error.
+	// In failFast mode, it throws (the same way) as soon as the first problem is reported.
 	//
 	class CollectingContext : public ValidationContext {
 	public:
-		CollectingContext(SecStaticCode &c) : code(c), mStatus(noErr) { }
+		CollectingContext(SecStaticCode &c, bool failFast = false)
+			: code(c), mFailFast(failFast), mStatus(noErr) { }
 		void reportProblem(OSStatus rc, CFStringRef type, CFTypeRef value);
 		
 		OSStatus osStatus()		{ return mStatus; }
@@ -87,10 +91,54 @@ protected:
 		SecStaticCode &code;
 
 	private:
+		bool mFailFast;
 		CFRef<CFMutableDictionaryRef> mCollection;
 		OSStatus mStatus;
 	};
 	
+public:
+	//
+	// Validation work is divided into phases for performance accounting.
+	// Accounting is off unless turned on with recordPhases(); see kSecCSRecordValidationTimes.
+	//
+	enum ValidationPhase {
+		phaseSignature,					// CMS decoding and trust evaluation
+		phaseExecutable,				// main executable page hashing
+		phaseResourceEnumeration,		// resource tree scan and rule matching
+		phaseResourceHashing,			// reading and hashing sealed resources
+		phaseRequirements,				// requirement evaluation
+		phaseCount
+	};
+	
+protected:
+	struct PhaseRecord {
+		PhaseRecord() : wall(0), cpu(0), bytes(0), count(0) { }
+		double wall;					// elapsed seconds
+		double cpu;						// process CPU seconds
+		uint64_t bytes;					// bytes digested
+		unsigned count;					// number of times entered
+	};
+	
+	//
+	// A PhaseTimer accounts its (running) lifetime against one phase of its SecStaticCode.
+	// It does nothing if accounting is off for that code.
+	//
+	class PhaseTimer {
+	public:
+		PhaseTimer(SecStaticCode *code, ValidationPhase phase);
+		~PhaseTimer();
+		
+		void pause();
+		void resume();
+		void bytes(uint64_t count) { if (mRecord) mRecord->bytes += count; }
+		
+	private:
+		PhaseRecord *mRecord;
+		bool mRunning;
+		double mWallStart;
+		double mCpuStart;
+	};
+	
 public:
 	SECCFFUNCTIONS(SecStaticCode, SecStaticCodeRef,
 		errSecCSInvalidObjectRef, gCFObjects().StaticCode)
@@ -107,6 +155,7 @@ public:
 	
 	void detachedSignature(CFDataRef sig);		// attach an explicitly given detached signature
 	void checkForSystemSignature();				// check for and attach system-supplied detached signature
+	void catalogSignature(SignatureCatalog *catalog); // attach signature from a catalog (if it has one for us)
 
 	const CodeDirectory *codeDirectory(bool check = true);
 	CFDataRef cdHash();
@@ -134,6 +183,11 @@ public:
 	
 	void resetValidity();						// clear validation caches (if something may have changed)
 	
+	void recordPhases(bool on) { mRecordPhases = on; } // turn performance accounting on/off
+	void digestMemo(DigestMemo *memo) { mDigestMemo = memo; } // share resource digests (NULL to stop)
+	DigestMemo *digestMemo() const { return mDigestMemo; }
+	CFDictionaryRef phaseTimes();				// accounting so far (creates new dictionary; NULL if none)
+	
 	bool validated() const	{ return mValidated; }
 	bool valid() const
 		{ assert(validated()); return mValidated && (mValidationResult == noErr); }
@@ -143,7 +197,7 @@ public:
 	void validateDirectory();
 	void validateComponent(CodeDirectory::SpecialSlot slot, OSStatus fail = errSecCSSignatureFailed);
 	void validateNonResourceComponents();
-	void validateResources();
+	void validateResources(SecCSFlags flags = kSecCSDefaultFlags); // honors kSecCSFailFast
 	void validateExecutable();
 	
 	const Requirements *internalRequirements();
@@ -168,8 +222,12 @@ public:
 protected:
 	CFDictionaryRef getDictionary(CodeDirectory::SpecialSlot slot, OSStatus fail); // component value as a dictionary
 	bool verifySignature();
+	bool verifySignature(CFDataRef sig, CFDataRef content);
 	CFTypeRef verificationPolicy(SecCSFlags flags);
 
+	void scanResources(CFDictionaryRef rules, std::vector<std::string> &paths); // sealable resources present
+	UnixPlusPlus::FileDesc &resourceBaseDirectory();	// open resource base directory
+	int openResource(const std::string &path);	// open resource file (-1 if missing)
 	static void checkOptionalResource(CFTypeRef key, CFTypeRef value, void *context);
 
 private:
@@ -205,11 +263,19 @@ private:
 	
 	bool mGotResourceBase;				// asked mRep for resourceBasePath
 	CFRef<CFURLRef> mResourceBase;		// URL form of resource base directory
+	UnixPlusPlus::AutoFileDesc mResourceBaseFd; // resource base directory (opened on demand)
 	
 	// signature verification outcome (mTrust == NULL => not done yet)
 	CFRef<SecTrustRef> mTrust;			// outcome of crypto validation (valid or not)
 	CFRef<CFArrayRef> mCertChain;
 	CSSM_TP_APPLE_EVIDENCE_INFO *mEvalDetails;
+	
+	// resource digests shared with other code validated along with us (optional)
+	RefPointer<DigestMemo> mDigestMemo;
+	
+	// performance accounting (only if mRecordPhases)
+	bool mRecordPhases;					// accounting enabled
+	PhaseRecord mPhases[phaseCount];	// accumulated per phase
 };
 
 
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// archive - read-only access to the members of zip and tar archives
+//
+#include "archive.h"
+#include "cs.h"
+#include <security_utilities/debugging.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+//
+// Little-endian field access (zip)
+//
+static inline uint16_t get16(const unsigned char *p)
+{ return p[0] | (p[1] << 8); }
+
+static inline uint32_t get32(const unsigned char *p)
+{ return get16(p) | (uint32_t(get16(p + 2)) << 16); }
+
+static inline uint64_t get64(const unsigned char *p)
+{ return get32(p) | (uint64_t(get32(p + 4)) << 32); }
+
+
+//
+// Read exactly length bytes at offset, or fail.
+// Short reads mean the archive is truncated (or lying about its layout).
+//
+static void readAt(FileDesc fd, void *buffer, size_t length, uint64_t offset)
+{
+	if (fd.read(buffer, length, offset) != length)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+}
+
+
+//
+// Archive - the generic part
+//
+Archive::Archive(const char *path)
+	: mPath(path), mFd(path, O_RDONLY)
+{
+	mSize = mFd.fileSize();
+}
+
+Archive::~Archive()
+{ }
+
+Archive::Sink::~Sink()
+{ }
+
+
+Archive *Archive::open(const char *path)
+{
+	AutoFileDesc fd(path, O_RDONLY);
+	if (ZipArchive::candidate(fd))
+		return new ZipArchive(path);
+	if (TarArchive::candidate(fd))
+		return new TarArchive(path);
+	MacOSError::throwMe(errSecCSBadObjectFormat);
+}
+
+bool Archive::candidate(FileDesc &fd)
+{
+	return ZipArchive::candidate(fd) || TarArchive::candidate(fd);
+}
+
+
+//
+// Add a member to the index.
+// Names are canonicalized to plain relative paths. Members that would land outside
+// the archive root are dropped (nothing could ever match them). Two members of the
+// same name make the archive ambiguous, and we reject it.
+//
+void Archive::add(Entry &entry)
+{
+	std::string &name = entry.name;
+	while (name.compare(0, 2, "./") == 0)
+		name.erase(0, 2);
+	while (!name.empty() && name[name.size() - 1] == '/')
+		name.erase(name.size() - 1);
+	if (name.empty() || name == ".")
+		return;		// the root itself
+	if (name[0] == '/' || name == ".." || name.compare(0, 3, "../") == 0
+			|| name.find("/../") != std::string::npos
+			|| (name.size() >= 3 && name.compare(name.size() - 3, 3, "/..") == 0)) {
+		secdebug("archive", "%s: ignoring member %s", mPath.c_str(), name.c_str());
+		return;
+	}
+	if (mIndex.find(name) != mIndex.end()) {
+		secdebug("archive", "%s: duplicate member %s", mPath.c_str(), name.c_str());
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	}
+	mIndex[name] = mEntries.size();
+	mEntries.push_back(entry);
+}
+
+const Archive::Entry *Archive::find(const std::string &name) const
+{
+	Index::const_iterator it = mIndex.find(name);
+	return (it == mIndex.end()) ? NULL : &mEntries[it->second];
+}
+
+
+//
+// Locate the contents of a member.
+// Formats whose member headers have variable size find out lazily (see ZipArchive).
+//
+uint64_t Archive::dataOffset(const Entry &entry) const
+{
+	if (entry.data == 0) {
+		entry.data = locate(entry);
+		if (entry.data > mSize || entry.packedSize > mSize - entry.data)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+	}
+	return entry.data;
+}
+
+uint64_t Archive::locate(const Entry &entry) const
+{
+	return entry.header;
+}
+
+
+//
+// Stream the contents of a member through a Sink.
+// The declared size is enforced; a member that unpacks to any other size is bad.
+//
+void Archive::read(const Entry &entry, Sink &sink) const
+{
+	if (entry.kind != kindFile)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	uint64_t offset = dataOffset(entry);
+	std::vector<unsigned char> input(bufferSize);
+
+	switch (entry.method) {
+	case methodStored:
+		{
+			if (entry.packedSize != entry.size)
+				MacOSError::throwMe(errSecCSBadObjectFormat);
+			for (uint64_t done = 0; done < entry.size; ) {
+				size_t length = size_t(std::min(uint64_t(bufferSize), entry.size - done));
+				readAt(mFd, &input[0], length, offset + done);
+				sink(&input[0], length);
+				done += length;
+			}
+		}
+		break;
+	case methodDeflated:
+		{
+			std::vector<unsigned char> output(bufferSize);
+			z_stream z;
+			memset(&z, 0, sizeof(z));
+			if (inflateInit2(&z, -MAX_WBITS) != Z_OK)		// raw deflate data
+				MacOSError::throwMe(errSecCSInternalError);
+			try {
+				uint64_t consumed = 0, produced = 0;
+				int rc = Z_OK;
+				while (rc != Z_STREAM_END) {
+					if (z.avail_in == 0) {
+						if (consumed == entry.packedSize)
+							MacOSError::throwMe(errSecCSBadObjectFormat);	// ran out of input
+						size_t length = size_t(std::min(uint64_t(bufferSize), entry.packedSize - consumed));
+						readAt(mFd, &input[0], length, offset + consumed);
+						consumed += length;
+						z.next_in = &input[0];
+						z.avail_in = length;
+					}
+					z.next_out = &output[0];
+					z.avail_out = output.size();
+					rc = inflate(&z, Z_NO_FLUSH);
+					if (rc != Z_OK && rc != Z_STREAM_END)
+						MacOSError::throwMe(errSecCSBadObjectFormat);
+					size_t length = output.size() - z.avail_out;
+					produced += length;
+					if (produced > entry.size)
+						MacOSError::throwMe(errSecCSBadObjectFormat);
+					if (length)
+						sink(&output[0], length);
+				}
+				if (produced != entry.size)
+					MacOSError::throwMe(errSecCSBadObjectFormat);
+			} catch (...) {
+				inflateEnd(&z);
+				throw;
+			}
+			inflateEnd(&z);
+		}
+		break;
+	default:
+		MacOSError::throwMe(errSecCSUnimplemented);
+	}
+}
+
+
+//
+// Canned Sinks for the common uses
+//
+namespace {
+
+class HashSink : public Archive::Sink {
+public:
+	HashSink(DynamicHash *h) : hasher(h), total(0) { }
+	void operator () (const void *data, size_t length) { hasher->update(data, length); total += length; }
+
+	DynamicHash *hasher;
+	size_t total;
+};
+
+class DataSink : public Archive::Sink {
+public:
+	DataSink() : data(CFDataCreateMutable(NULL, 0)) { }
+	void operator () (const void *bytes, size_t length) { CFDataAppendBytes(data, (const UInt8 *)bytes, length); }
+
+	CFRef<CFMutableDataRef> data;
+};
+
+class FileSink : public Archive::Sink {
+public:
+	FileSink(FileDesc f) : fd(f) { }
+	void operator () (const void *data, size_t length) { fd.writeAll(data, length); }
+
+	FileDesc fd;
+};
+
+}	// end anonymous namespace
+
+
+size_t Archive::hash(const Entry &entry, DynamicHash *hasher) const
+{
+	HashSink sink(hasher);
+	read(entry, sink);
+	return sink.total;
+}
+
+CFDataRef Archive::load(const Entry &entry) const
+{
+	DataSink sink;
+	read(entry, sink);
+	return sink.data.yield();
+}
+
+void Archive::copy(const Entry &entry, FileDesc to) const
+{
+	FileSink sink(to);
+	read(entry, sink);
+}
+
+
+//
+// Zip archives.
+// We trust only the central directory; local headers are consulted solely to find
+// where each member's contents begin.
+//
+enum {
+	zipLocalMagic = 0x04034b50,
+	zipCentralMagic = 0x02014b50,
+	zipEndMagic = 0x06054b50,
+	zip64EndMagic = 0x06064b50,
+	zip64LocatorMagic = 0x07064b50,
+
+	zipLocalSize = 30,
+	zipCentralSize = 46,
+	zipEndSize = 22,
+	zip64EndSize = 56,
+	zip64LocatorSize = 20,
+
+	zipMaxComment = 0xFFFF,
+	zipMaxDirectory = 256 * 1024 * 1024	// sanity limit on central directory size
+};
+
+bool ZipArchive::candidate(FileDesc &fd)
+{
+	unsigned char magic[4];
+	if (fd.read(magic, sizeof(magic), 0) != sizeof(magic))
+		return false;
+	uint32_t value = get32(magic);
+	return value == zipLocalMagic || value == zipEndMagic;	// (the latter is an empty archive)
+}
+
+ZipArchive::ZipArchive(const char *path)
+	: Archive(path)
+{
+	// find the end-of-central-directory record, searching back over any comment
+	if (mSize < zipEndSize)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	size_t tail = size_t(std::min(mSize, uint64_t(zipEndSize + zipMaxComment + zip64LocatorSize)));
+	std::vector<unsigned char> buffer(tail);
+	readAt(mFd, &buffer[0], tail, mSize - tail);
+	size_t end = tail - zipEndSize;
+	while (get32(&buffer[end]) != zipEndMagic)
+		if (end-- == 0)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+	const unsigned char *eocd = &buffer[end];
+	uint64_t count = get16(eocd + 10);
+	uint64_t size = get32(eocd + 12);
+	uint64_t offset = get32(eocd + 16);
+
+	// Zip64 archives keep the real values in a separate record, pointed to by a locator
+	if (end >= zip64LocatorSize && get32(eocd - zip64LocatorSize) == zip64LocatorMagic) {
+		unsigned char record[zip64EndSize];
+		readAt(mFd, record, sizeof(record), get64(eocd - zip64LocatorSize + 8));
+		if (get32(record) != zip64EndMagic)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+		count = get64(record + 32);
+		size = get64(record + 40);
+		offset = get64(record + 48);
+	}
+
+	readDirectory(offset, size, count);
+	secdebug("archive", "%s: zip archive, %d member(s)", path, int(entries().size()));
+}
+
+void ZipArchive::readDirectory(uint64_t offset, uint64_t size, uint64_t count)
+{
+	if (size > zipMaxDirectory || offset > mSize || size > mSize - offset)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	std::vector<unsigned char> directory(size_t(size) + 1);	// (never empty)
+	readAt(mFd, &directory[0], size_t(size), offset);
+	const unsigned char *p = &directory[0];
+	const unsigned char *limit = p + size;
+
+	for (uint64_t n = 0; n < count; n++) {
+		if (limit - p < zipCentralSize || get32(p) != zipCentralMagic)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+		uint16_t madeBy = get16(p + 4);
+		uint16_t flags = get16(p + 8);
+		uint16_t method = get16(p + 10);
+		uint16_t nameLength = get16(p + 28);
+		uint16_t extraLength = get16(p + 30);
+		uint16_t commentLength = get16(p + 32);
+		uint32_t attributes = get32(p + 38);
+		if (limit - p < zipCentralSize + nameLength + extraLength + commentLength)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+
+		Entry entry;
+		entry.name.assign((const char *)p + zipCentralSize, nameLength);
+		entry.packedSize = get32(p + 20);
+		entry.size = get32(p + 24);
+		entry.header = get32(p + 42);
+		entry.data = 0;
+
+		// Zip64 extra field: present values replace the saturated 32-bit ones, in this order
+		const unsigned char *extra = p + zipCentralSize + nameLength;
+		const unsigned char *extraEnd = extra + extraLength;
+		while (extraEnd - extra >= 4) {
+			uint16_t tag = get16(extra), length = get16(extra + 2);
+			const unsigned char *field = extra + 4, *fieldEnd = field + length;
+			if (fieldEnd > extraEnd)
+				break;
+			if (tag == 0x0001) {
+				if (entry.size == 0xFFFFFFFF && fieldEnd - field >= 8)
+					{ entry.size = get64(field); field += 8; }
+				if (entry.packedSize == 0xFFFFFFFF && fieldEnd - field >= 8)
+					{ entry.packedSize = get64(field); field += 8; }
+				if (entry.header == 0xFFFFFFFF && fieldEnd - field >= 8)
+					{ entry.header = get64(field); field += 8; }
+			}
+			extra = fieldEnd;
+		}
+
+		// member type: Unix-made archives carry the mode in the high half of the attributes
+		mode_t mode = ((madeBy >> 8) == 3) ? mode_t(attributes >> 16) : 0;
+		if (!entry.name.empty() && entry.name[entry.name.size() - 1] == '/')
+			entry.kind = kindDirectory;
+		else switch (mode & S_IFMT) {
+		case 0:
+		case S_IFREG:	entry.kind = kindFile; break;
+		case S_IFDIR:	entry.kind = kindDirectory; break;
+		case S_IFLNK:	entry.kind = kindSymlink; break;
+		default:		entry.kind = kindOther; break;
+		}
+
+		switch (method) {
+		case 0:		entry.method = methodStored; break;
+		case 8:		entry.method = methodDeflated; break;
+		default:
+			if (entry.kind == kindFile)
+				MacOSError::throwMe(errSecCSUnimplemented);	// can't read it
+			entry.method = methodStored;
+			break;
+		}
+		if ((flags & 0x0001) && entry.kind == kindFile)	// encrypted
+			MacOSError::throwMe(errSecCSUnimplemented);
+
+		add(entry);
+		p += zipCentralSize + nameLength + extraLength + commentLength;
+	}
+}
+
+uint64_t ZipArchive::locate(const Entry &entry) const
+{
+	unsigned char header[zipLocalSize];
+	readAt(mFd, header, sizeof(header), entry.header);
+	if (get32(header) != zipLocalMagic)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	return entry.header + zipLocalSize + get16(header + 26) + get16(header + 28);
+}
+
+
+//
+// Tar archives.
+// Tar has no index, so we make one by hopping from header to header.
+//
+enum {
+	tarBlock = 512,
+	tarMaxLongName = 64 * 1024
+};
+
+bool TarArchive::candidate(FileDesc &fd)
+{
+	unsigned char header[tarBlock];
+	if (fd.read(header, sizeof(header), 0) != sizeof(header))
+		return false;
+	return checksumOK(header);
+}
+
+bool TarArchive::checksumOK(const unsigned char *header)
+{
+	uint64_t sum = 0;
+	for (unsigned n = 0; n < tarBlock; n++)
+		sum += (n >= 148 && n < 156) ? ' ' : header[n];	// checksum field counts as blanks
+	return sum == number((const char *)header + 148, 8);
+}
+
+uint64_t TarArchive::number(const char *field, size_t length)
+{
+	uint64_t value = 0;
+	if (field[0] & 0x80) {		// GNU base-256 encoding
+		value = field[0] & 0x7F;
+		for (size_t n = 1; n < length; n++)
+			value = (value << 8) | (unsigned char)field[n];
+	} else {					// octal, padded with blanks or NULs
+		for (size_t n = 0; n < length && field[n]; n++)
+			if (field[n] >= '0' && field[n] <= '7')
+				value = (value << 3) | (field[n] - '0');
+	}
+	return value;
+}
+
+static std::string tarString(const char *field, size_t length)
+{
+	return std::string(field, strnlen(field, length));
+}
+
+TarArchive::TarArchive(const char *path)
+	: Archive(path)
+{
+	std::string pendingName;			// from GNU long name or pax header
+	uint64_t pendingSize = 0;			// from pax header (0 = none)
+	char header[tarBlock];
+	for (uint64_t offset = 0; offset + tarBlock <= mSize; ) {
+		readAt(mFd, header, sizeof(header), offset);
+		if (header[0] == 0)				// end-of-archive marker
+			break;
+		if (!checksumOK((const unsigned char *)header))
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+		uint64_t size = pendingSize ? pendingSize : number(header + 124, 12);
+		uint64_t data = offset + tarBlock;
+		if (data > mSize || size > mSize - data)
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+		uint64_t next = data + (size + tarBlock - 1) / tarBlock * tarBlock;
+
+		char type = header[156];
+		switch (type) {
+		case 'L':						// GNU: name of next member
+			pendingName = longName(data, size);
+			offset = next;
+			continue;
+		case 'x':						// pax: attributes of next member
+			{
+				if (size > tarMaxLongName)
+					MacOSError::throwMe(errSecCSBadObjectFormat);
+				std::string records(size_t(size), '\0');
+				readAt(mFd, &records[0], records.size(), data);
+				paxRecords(records, pendingName, pendingSize);
+			}
+			offset = next;
+			continue;
+		case 'g':						// pax: global attributes (nothing we care about)
+			offset = next;
+			continue;
+		}
+
+		Entry entry;
+		if (!pendingName.empty())
+			entry.name = pendingName;
+		else if (memcmp(header + 257, "ustar", 5) == 0 && header[345])
+			entry.name = tarString(header + 345, 155) + "/" + tarString(header, 100);
+		else
+			entry.name = tarString(header, 100);
+		entry.method = methodStored;
+		entry.size = entry.packedSize = size;
+		entry.header = offset;
+		entry.data = data;
+		switch (type) {
+		case '0':
+		case '\0':
+		case '7':
+			entry.kind = kindFile;
+			break;
+		case '1':						// hard link: share contents of earlier member
+			{
+				entry.kind = kindOther;
+				std::string link = tarString(header + 157, 100);
+				while (link.compare(0, 2, "./") == 0)
+					link.erase(0, 2);
+				if (const Entry *target = find(link))
+					if (target->kind == kindFile) {
+						entry.kind = kindFile;
+						entry.size = entry.packedSize = target->size;
+						entry.data = target->data;
+					}
+			}
+			break;
+		case '5':
+			entry.kind = kindDirectory;
+			break;
+		case '2':
+			entry.kind = kindSymlink;
+			break;
+		default:
+			entry.kind = kindOther;
+			break;
+		}
+		add(entry);
+		pendingName.clear();
+		pendingSize = 0;
+		offset = next;
+	}
+	secdebug("archive", "%s: tar archive, %d member(s)", path, int(entries().size()));
+}
+
+std::string TarArchive::longName(uint64_t offset, uint64_t size) const
+{
+	if (size > tarMaxLongName)
+		MacOSError::throwMe(errSecCSBadObjectFormat);
+	std::string name(size_t(size), '\0');
+	readAt(mFd, &name[0], name.size(), offset);
+	return name.c_str();	// drop trailing NUL(s)
+}
+
+//
+// Parse pax extended header records ("length key=value\n") for the ones we use
+//
+void TarArchive::paxRecords(const std::string &data, std::string &path, uint64_t &size)
+{
+	for (size_t pos = 0; pos < data.size(); ) {
+		size_t length = strtoul(data.c_str() + pos, NULL, 10);
+		size_t space = data.find(' ', pos);
+		if (length == 0 || space == std::string::npos || pos + length > data.size())
+			MacOSError::throwMe(errSecCSBadObjectFormat);
+		std::string record = data.substr(space + 1, pos + length - space - 2);	// (without newline)
+		size_t equal = record.find('=');
+		if (equal != std::string::npos) {
+			std::string key = record.substr(0, equal);
+			if (key == "path")
+				path = record.substr(equal + 1);
+			else if (key == "size")
+				size = strtoull(record.c_str() + equal + 1, NULL, 10);
+		}
+		pos += length;
+	}
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// archive - read-only access to the members of zip and tar archives
+//
+// An Archive indexes the members of an archive file once (from the zip central
+// directory, or by walking the tar headers) and then reads member contents on demand,
+// straight out of the archive file. Nothing is ever extracted to the file system.
+// Member contents can be fed to a hash, loaded into memory, or copied to a file.
+//
+// Only seekable (uncompressed) tar files are supported. Zip members may be stored
+// or deflated; encrypted members are rejected.
+//
+#ifndef _H_ARCHIVE
+#define _H_ARCHIVE
+
+#include <security_utilities/refcount.h>
+#include <security_utilities/unix++.h>
+#include <security_utilities/hashing.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace Security {
+namespace CodeSigning {
+
+
+class Archive : public RefCount {
+public:
+	virtual ~Archive();
+
+	enum Kind {
+		kindFile,						// regular file
+		kindDirectory,					// directory
+		kindSymlink,					// symbolic link
+		kindOther						// anything else (ignored)
+	};
+
+	enum Method {
+		methodStored,					// contents stored as-is
+		methodDeflated					// contents deflated (RFC 1951)
+	};
+
+	struct Entry {
+		std::string name;				// path within archive (no trailing slash)
+		Kind kind;						// type of member
+		Method method;					// storage method
+		uint64_t size;					// size of contents
+		uint64_t packedSize;			// size as stored in the archive
+		uint64_t header;				// offset of (local) member header
+		mutable uint64_t data;			// offset of contents (0 = not yet located)
+	};
+	typedef std::vector<Entry> Entries;
+
+	static Archive *open(const char *path);		// sniff format and index; throws if neither
+	static bool candidate(UnixPlusPlus::FileDesc &fd); // plausibly a zip or tar archive
+
+	const std::string &path() const { return mPath; }
+	virtual std::string format() const = 0;		// human-readable format name
+
+	const Entries &entries() const { return mEntries; }	// in archive order
+	const Entry *find(const std::string &name) const;	// NULL if absent
+
+	// contents of a member
+	uint64_t dataOffset(const Entry &entry) const;		// where the (packed) contents start
+	size_t hash(const Entry &entry, DynamicHash *hasher) const;
+	CFDataRef load(const Entry &entry) const;
+	void copy(const Entry &entry, UnixPlusPlus::FileDesc to) const;
+
+	class Sink {
+	public:
+		virtual ~Sink();
+		virtual void operator () (const void *data, size_t length) = 0;
+	};
+	void read(const Entry &entry, Sink &sink) const;	// stream the contents to sink
+
+protected:
+	Archive(const char *path);
+
+	void add(Entry &entry);								// add member to the index
+	virtual uint64_t locate(const Entry &entry) const;	// find start of contents [header]
+
+	static const size_t bufferSize = 64 * 1024;
+
+protected:
+	std::string mPath;
+	UnixPlusPlus::AutoFileDesc mFd;
+	uint64_t mSize;						// size of archive file
+
+private:
+	Entries mEntries;
+	typedef std::map<std::string, size_t> Index;
+	Index mIndex;						// name -> position in mEntries
+};
+
+
+//
+// A zip archive, indexed from its central directory.
+// Zip64 extensions are understood.
+//
+class ZipArchive : public Archive {
+public:
+	ZipArchive(const char *path);
+
+	std::string format() const { return "zip archive"; }
+	static bool candidate(UnixPlusPlus::FileDesc &fd);
+
+protected:
+	uint64_t locate(const Entry &entry) const;
+
+private:
+	void readDirectory(uint64_t offset, uint64_t size, uint64_t count);
+};
+
+
+//
+// A (ustar, GNU, or pax) tar archive, indexed by walking its headers.
+//
+class TarArchive : public Archive {
+public:
+	TarArchive(const char *path);
+
+	std::string format() const { return "tar archive"; }
+	static bool candidate(UnixPlusPlus::FileDesc &fd);
+
+private:
+	static uint64_t number(const char *field, size_t length);
+	static bool checksumOK(const unsigned char *header);
+	std::string longName(uint64_t offset, uint64_t size) const;
+	static void paxRecords(const std::string &data, std::string &path, uint64_t &size);
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_ARCHIVE
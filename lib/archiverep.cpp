@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// archiverep - DiskRep for a bundle inside a zip or tar archive
+//
+#include "archiverep.h"
+#include "bundlediskrep.h"		// for meta directory names
+#include "machorep.h"
+#include <security_utilities/debugging.h>
+#include <security_utilities/hashing.h>
+#include <mach-o/loader.h>
+#include <mach-o/fat.h>
+#include <unistd.h>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+//
+// Index the archive and find the bundle in it.
+// The main executable is set up right away, since we need to know its format.
+//
+ArchiveDiskRep::ArchiveDiskRep(const char *path, const Context *ctx)
+	: mArchive(Archive::open(path)), mExecEntry(NULL), mExecUnpacked(false)
+{
+	findBundle();
+
+	// conventional executable bundle
+	if (CFStringRef exec = CFStringRef(CFDictionaryGetValue(mInfoDict, kCFBundleExecutableKey))) {
+		if (CFGetTypeID(exec) != CFStringGetTypeID())
+			MacOSError::throwMe(errSecCSBadBundleFormat);
+		string name = cfString(exec);
+		if (name.empty() || name.find('/') != string::npos)
+			MacOSError::throwMe(errSecCSBadBundleFormat);
+		mExecutable = mExecDir + name;
+	} else {
+		// no executable; the Info.plist stands in for it (as in BundleDiskRep)
+		mExecutable = mInfoPlist;
+	}
+	const Archive::Entry *exec = member(mExecutable);
+	if (!exec)
+		MacOSError::throwMe(errSecCSNoMainExecutable);
+	setupExecutable(*exec, ctx);
+	mFormat = "bundle in " + mArchive->format() + " with "
+		+ (plainExecutable() ? string("generic") : mExecRep->format());
+	secdebug("archiverep", "%p %s: bundle root \"%s\", executable %s",
+		this, path, mRoot.c_str(), mExecutable.c_str());
+}
+
+ArchiveDiskRep::~ArchiveDiskRep()
+{ }
+
+
+//
+// Find the bundle in the archive.
+// We accept the archive root itself, any top-level directory, and the iOS
+// Payload/<name> layout. Deep (Contents/Info.plist) bundles win over shallow
+// ones at the same place. More than one candidate bundle is an error.
+//
+void ArchiveDiskRep::findBundle()
+{
+	bool found = false;
+	const Archive::Entries &entries = mArchive->entries();
+	for (Archive::Entries::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+		if (it->kind != Archive::kindFile)
+			continue;
+		const string &name = it->name;
+		static const string info = "Info.plist", deepInfo = "Contents/Info.plist";
+		string root;
+		bool deep;
+		if (name == deepInfo) {
+			root = ""; deep = true;
+		} else if (name == info) {
+			root = ""; deep = false;
+		} else if (name.size() > deepInfo.size() + 1
+				&& name.compare(name.size() - deepInfo.size() - 1, string::npos, "/" + deepInfo) == 0) {
+			root = name.substr(0, name.size() - deepInfo.size() - 1); deep = true;
+		} else if (name.size() > info.size() + 1
+				&& name.compare(name.size() - info.size() - 1, string::npos, "/" + info) == 0) {
+			root = name.substr(0, name.size() - info.size() - 1); deep = false;
+		} else
+			continue;
+		size_t slash = root.find('/');
+		if (slash != string::npos && !(root.compare(0, 8, "Payload/") == 0 && slash == 7
+				&& root.find('/', 8) == string::npos))
+			continue;		// too deep; that's nested code, not us
+
+		string support = root.empty() ? "" : root + "/";
+		if (deep)
+			support += "Contents/";
+		if (found) {
+			if (root != mRoot)
+				MacOSError::throwMe(errSecCSBadBundleFormat);	// ambiguous
+			if (!deep)
+				continue;	// keep the deep one
+		}
+		mRoot = root;
+		mSupport = support;
+		mExecDir = deep ? support + "MacOS/" : support;
+		mInfoPlist = name;
+		found = true;
+	}
+	if (!found)
+		MacOSError::throwMe(errSecCSBadBundleFormat);
+
+	CFRef<CFDataRef> infoData = loadMember(mInfoPlist);
+	mInfoDict.take(makeCFDictionaryFrom(infoData));
+	if (!mInfoDict)
+		MacOSError::throwMe(errSecCSBadBundleFormat);
+
+	// signing files go into a meta directory if there is one, else into the support directory
+	string meta = mSupport + BUNDLEDISKREP_DIRECTORY "/";
+	mMeta = mSupport;
+	for (Archive::Entries::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		if (it->name.compare(0, meta.size(), meta) == 0 || it->name + "/" == meta) {
+			mMeta = meta;
+			break;
+		}
+}
+
+
+//
+// Set up the main executable.
+// A stored member is used right where it sits in the archive: a (thin or fat) Mach-O
+// image through a MachORep at its offset, anything else directly by us (plainExecutable()).
+// A compressed member can't be read at random, so it gets unpacked into a temporary
+// file, which is unlinked as soon as it's open; nothing is left visible in the file system.
+//
+void ArchiveDiskRep::setupExecutable(const Archive::Entry &entry, const Context *ctx)
+{
+	Context ectx;
+	if (ctx)
+		ectx.arch = ctx->arch;
+	ectx.fileOnly = true;
+	mExecEntry = &entry;
+
+	if (entry.method == Archive::methodStored) {
+		uint32_t magic = 0;
+		uint64_t offset = mArchive->dataOffset(entry);
+		AutoFileDesc fd(mArchive->path(), O_RDONLY);
+		if (entry.size >= sizeof(magic))
+			fd.read(&magic, sizeof(magic), offset);
+		switch (magic) {
+		case MH_MAGIC:
+		case MH_CIGAM:
+		case MH_MAGIC_64:
+		case MH_CIGAM_64:
+			ectx.offset = offset;
+			break;
+		case FAT_MAGIC:
+		case FAT_CIGAM:
+			if (ectx.arch) {		// pick the slice, as MachORep would
+				Universal full(fd, offset);
+				ectx.offset = full.archOffset(ectx.arch);
+			} else
+				ectx.offset = offset;
+			break;
+		default:
+			return;				// plain file; we'll handle it ourselves
+		}
+		mExecRep = new MachORep(mArchive->path().c_str(), &ectx);
+		return;
+	}
+
+	char tempDir[PATH_MAX];
+	if (::confstr(_CS_DARWIN_USER_TEMP_DIR, tempDir, sizeof(tempDir)) == 0)
+		strcpy(tempDir, "/tmp");
+	string tempPath = string(tempDir) + "/codesign.XXXXXX";
+	int fd = ::mkstemp(&tempPath[0]);
+	if (fd < 0)
+		UnixError::throwMe();
+	try {
+		AutoFileDesc temp(fd);
+		mArchive->copy(entry, temp);
+		mExecRep = DiskRep::bestFileGuess(tempPath, &ectx);
+		mExecRep->fd();		// open it now; it's about to lose its name
+		mExecUnpacked = true;
+	} catch (...) {
+		::unlink(tempPath.c_str());
+		throw;
+	}
+	::unlink(tempPath.c_str());
+}
+
+
+//
+// Member access helpers
+//
+const Archive::Entry *ArchiveDiskRep::member(const string &name)
+{
+	const Archive::Entry *entry = mArchive->find(name);
+	return (entry && entry->kind == Archive::kindFile) ? entry : NULL;
+}
+
+CFDataRef ArchiveDiskRep::loadMember(const string &name)
+{
+	if (const Archive::Entry *entry = member(name))
+		return mArchive->load(*entry);
+	return NULL;
+}
+
+string ArchiveDiskRep::displayPath(const string &name)
+{
+	return name.empty() ? mArchive->path() : mArchive->path() + "/" + name;
+}
+
+
+//
+// Load and return a component, by slot number.
+// This follows BundleDiskRep: the Info.plist is the bundle's, and everything else
+// comes from the main executable's embedded signature or from the meta directory.
+//
+CFDataRef ArchiveDiskRep::component(CodeDirectory::SpecialSlot slot)
+{
+	switch (slot) {
+	case cdInfoSlot:
+		return loadMember(mInfoPlist);
+	default:
+		if (!plainExecutable())
+			if (CFDataRef data = mExecRep->component(slot))
+				return data;
+		// falling through
+	case cdResourceDirSlot:
+		if (const char *name = CodeDirectory::canonicalSlotName(slot))
+			return loadMember(mMeta + name);
+		else
+			return NULL;
+	}
+}
+
+
+//
+// Various aspects of our DiskRep personality.
+//
+CFDataRef ArchiveDiskRep::identification()
+{
+	if (plainExecutable()) {		// hash of the whole file, as SingleDiskRep
+		FastSHA1 hash;
+		mArchive->hash(*mExecEntry, &hash);
+		SHA1::Digest digest;
+		hash.finish(digest);
+		return makeCFData(digest, sizeof(digest));
+	}
+	return mExecRep->identification();
+}
+
+string ArchiveDiskRep::mainExecutablePath()
+{
+	return displayPath(mExecutable);
+}
+
+CFURLRef ArchiveDiskRep::canonicalPath()
+{
+	return makeCFURL(displayPath(mRoot));
+}
+
+string ArchiveDiskRep::resourcesRootPath()
+{
+	string support = mSupport.empty() ? "" : mSupport.substr(0, mSupport.size() - 1);
+	return displayPath(support);
+}
+
+void ArchiveDiskRep::adjustResources(ResourceRules &rules)
+{
+	// same exclusions as BundleDiskRep
+	rules.addExclusion("^" BUNDLEDISKREP_DIRECTORY "/");
+	rules.addExclusion("^" STORE_RECEIPT_DIRECTORY "/");
+	if (mExecutable.compare(0, mSupport.size(), mSupport) == 0)
+		rules.addExclusion(string("^")
+			+ ResourceRules::escapeRE(mExecutable.substr(mSupport.size())) + "$");
+}
+
+ResourceStore *ArchiveDiskRep::resourceStore()
+{
+	return this;
+}
+
+Universal *ArchiveDiskRep::mainExecutableImage()
+{
+	return plainExecutable() ? NULL : mExecRep->mainExecutableImage();
+}
+
+size_t ArchiveDiskRep::signingBase()
+{
+	return plainExecutable() ? 0 : mExecRep->signingBase();
+}
+
+size_t ArchiveDiskRep::signingLimit()
+{
+	return plainExecutable() ? size_t(mExecEntry->size) : mExecRep->signingLimit();
+}
+
+string ArchiveDiskRep::format()
+{
+	return mFormat;
+}
+
+FileDesc &ArchiveDiskRep::fd()
+{
+	if (plainExecutable()) {
+		if (!mFd)
+			mFd.open(mArchive->path(), O_RDONLY);
+		return mFd;
+	}
+	return mExecRep->fd();
+}
+
+
+//
+// Our main executable path is for show, so hand out a descriptor for where the
+// bytes really are. Mach-O callers seek to the image's (absolute) offset themselves;
+// a plain executable is positioned at its start here.
+//
+int ArchiveDiskRep::openExecutable()
+{
+	if (mExecUnpacked) {
+		// the temporary file has no name left, so share its descriptor (and file position;
+		// the MachORep reads at explicit offsets, and we seek before use anyway)
+		int fd = ::dup(mExecRep->fd());
+		if (fd < 0)
+			UnixError::throwMe();
+		::lseek(fd, 0, SEEK_SET);
+		return fd;
+	}
+	int fd = ::open(mArchive->path().c_str(), O_RDONLY);
+	if (fd < 0)
+		UnixError::throwMe();
+	if (plainExecutable())
+		::lseek(fd, mArchive->dataOffset(*mExecEntry), SEEK_SET);
+	return fd;
+}
+
+void ArchiveDiskRep::flush()
+{
+	// an unpacked executable can't be reopened, so only our own descriptor goes
+	mFd.close();
+}
+
+
+//
+// Defaults for signing operations.
+// We can't be signed, but these make for useful diagnostics.
+//
+string ArchiveDiskRep::recommendedIdentifier(const SigningContext &)
+{
+	if (CFStringRef identifier = CFStringRef(CFDictionaryGetValue(mInfoDict, kCFBundleIdentifierKey)))
+		if (CFGetTypeID(identifier) == CFStringGetTypeID())
+			return cfString(identifier);
+	return canonicalIdentifier(displayPath(mRoot));
+}
+
+const Requirements *ArchiveDiskRep::defaultRequirements(const Architecture *arch, const SigningContext &ctx)
+{
+	return plainExecutable() ? NULL : mExecRep->defaultRequirements(arch, ctx);
+}
+
+size_t ArchiveDiskRep::pageSize(const SigningContext &ctx)
+{
+	return plainExecutable() ? monolithicPageSize : mExecRep->pageSize(ctx);
+}
+
+
+//
+// ResourceStore personality: resources are the plain file members below the support directory.
+//
+void ArchiveDiskRep::resourcePaths(std::vector<std::string> &paths)
+{
+	const Archive::Entries &entries = mArchive->entries();
+	for (Archive::Entries::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		if (it->kind == Archive::kindFile && it->name.size() > mSupport.size()
+				&& it->name.compare(0, mSupport.size(), mSupport) == 0)
+			paths.push_back(it->name.substr(mSupport.size()));
+}
+
+bool ArchiveDiskRep::hashResource(const std::string &path, DynamicHash *hasher, size_t &size)
+{
+	if (const Archive::Entry *entry = member(mSupport + path)) {
+		size = mArchive->hash(*entry, hasher);
+		return true;
+	}
+	return false;
+}
+
+CFDataRef ArchiveDiskRep::loadResource(const std::string &path)
+{
+	return loadMember(mSupport + path);
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// archiverep - DiskRep for a bundle inside a zip or tar archive
+//
+#ifndef _H_ARCHIVEREP
+#define _H_ARCHIVEREP
+
+#include "diskrep.h"
+#include "archive.h"
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// An ArchiveDiskRep represents a bundle that sits, unextracted, inside an archive file.
+// The bundle is located by its Info.plist: it is the shallowest directory of the archive
+// (or the archive root itself) that holds Info.plist or Contents/Info.plist.
+//
+// Signing components and resources are read directly out of the archive. The
+// main executable is used in place if it is stored uncompressed, whatever its format
+// (thin or fat Mach-O, or anything else). Only a compressed main executable is unpacked,
+// into an anonymous (already unlinked) temporary file: page hashing and the Mach-O
+// machinery need random access, which a deflate stream can't give.
+//
+// The paths reported by an ArchiveDiskRep are formed by appending member names to the
+// path of the archive. They are meant for display and diagnostics; they do not exist.
+// This DiskRep is read-only; it cannot be signed.
+//
+class ArchiveDiskRep : public DiskRep, public ResourceStore {
+public:
+	ArchiveDiskRep(const char *path, const Context *ctx = NULL);
+	~ArchiveDiskRep();
+
+	CFDataRef component(CodeDirectory::SpecialSlot slot);
+	CFDataRef identification();
+	std::string mainExecutablePath();
+	CFURLRef canonicalPath();
+	std::string resourcesRootPath();
+	void adjustResources(ResourceRules &rules);
+	ResourceStore *resourceStore();
+	Universal *mainExecutableImage();
+	size_t signingBase();
+	size_t signingLimit();
+	std::string format();
+	UnixPlusPlus::FileDesc &fd();
+	int openExecutable();
+	void flush();
+
+	std::string recommendedIdentifier(const SigningContext &ctx);
+	const Requirements *defaultRequirements(const Architecture *arch, const SigningContext &ctx);
+	size_t pageSize(const SigningContext &ctx);
+
+	Archive *archive() const { return mArchive; }
+
+public:
+	// ResourceStore
+	void resourcePaths(std::vector<std::string> &paths);
+	bool hashResource(const std::string &path, DynamicHash *hasher, size_t &size);
+	CFDataRef loadResource(const std::string &path);
+
+private:
+	void findBundle();
+	const Archive::Entry *member(const std::string &name);	// plain file member, or NULL
+	CFDataRef loadMember(const std::string &name);			// contents of member, or NULL
+	void setupExecutable(const Archive::Entry &entry, const Context *ctx);
+	bool plainExecutable() const { return !mExecRep; }		// stored non-Mach-O, used in place
+	std::string displayPath(const std::string &name);		// path for the outside world
+
+private:
+	RefPointer<Archive> mArchive;		// the archive
+	std::string mRoot;					// bundle directory in archive ("" if archive root)
+	std::string mSupport;				// support directory prefix ("Foo.app/Contents/")
+	std::string mMeta;					// signing files prefix ("Foo.app/Contents/_CodeSignature/")
+	std::string mExecDir;				// executables prefix ("Foo.app/Contents/MacOS/")
+	std::string mInfoPlist;				// Info.plist member name
+	std::string mExecutable;			// main executable member name
+	CFRef<CFDictionaryRef> mInfoDict;	// parsed Info.plist
+	std::string mFormat;				// format description string
+	RefPointer<DiskRep> mExecRep;		// DiskRep for main executable (NULL if plainExecutable())
+	const Archive::Entry *mExecEntry;	// main executable member
+	bool mExecUnpacked;					// main executable was unpacked into a temporary file
+	UnixPlusPlus::AutoFileDesc mFd;		// archive file (for a plain executable)
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_ARCHIVEREP
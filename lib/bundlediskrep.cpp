@@ -270,20 +270,20 @@ string BundleDiskRep::resourcesRootPath()
 	return cfStringRelease(CFBundleCopySupportFilesDirectoryURL(mBundle));
 }
 
-void BundleDiskRep::adjustResources(ResourceBuilder &builder)
+void BundleDiskRep::adjustResources(ResourceRules &rules)
 {
 	// exclude entire contents of meta directory
-	builder.addExclusion("^" BUNDLEDISKREP_DIRECTORY "/");
+	rules.addExclusion("^" BUNDLEDISKREP_DIRECTORY "/");
 
 	// exclude the store manifest directory
-	builder.addExclusion("^" STORE_RECEIPT_DIRECTORY "/");
+	rules.addExclusion("^" STORE_RECEIPT_DIRECTORY "/");
 	
 	// exclude the main executable file
 	string resources = resourcesRootPath();
 	string executable = mainExecutablePath();
 	if (!executable.compare(0, resources.length(), resources, 0, resources.length()))	// is prefix
-		builder.addExclusion(string("^")
-			+ ResourceBuilder::escapeRE(executable.substr(resources.length() + 1)) + "$");
+		rules.addExclusion(string("^")
+			+ ResourceRules::escapeRE(executable.substr(resources.length() + 1)) + "$");
 }
 
 
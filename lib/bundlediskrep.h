@@ -56,7 +56,7 @@ public:
 	std::string mainExecutablePath();
 	CFURLRef canonicalPath();
 	std::string resourcesRootPath();
-	void adjustResources(ResourceBuilder &builder);
+	void adjustResources(ResourceRules &rules);
 	Universal *mainExecutableImage();
 	size_t signingBase();
 	size_t signingLimit();
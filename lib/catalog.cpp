@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// catalog - signature catalogs sealing many pieces of code under one CMS signature
+//
+#include "catalog.h"
+#include "csutilities.h"
+#include <security_utilities/unix++.h>
+#include <security_utilities/globalizer.h>
+#include <security_utilities/debugging.h>
+#include <vector>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+//
+// The catalog key of a piece of code is the SHA-1 of its identification.
+// This is a fixed-size stand-in for identifications of any length.
+//
+bool CatalogTable::key(DiskRep *rep, SHA1::Digest key)
+{
+	CFRef<CFDataRef> identification = rep->identification();
+	if (!identification)
+		return false;
+	SHA1 hash;
+	hash.update(CFDataGetBytePtr(identification), CFDataGetLength(identification));
+	hash.finish(key);
+	return true;
+}
+
+
+//
+// Check a CatalogTable thoroughly, so that lookups can trust what they find:
+// the index fits, is strictly sorted, and every entry is a valid
+// EmbeddedSignatureBlob lying past the index and inside the table.
+//
+bool CatalogTable::validateTable(size_t length) const
+{
+	if (!validateBlob(length) || this->length() < sizeof(CatalogTable))
+		return false;
+	if (version >> 16 != currentVersion >> 16)	// incompatible format
+		return false;
+	size_t total = this->length();
+	uint32_t n = count;
+	if (n > (total - sizeof(CatalogTable)) / sizeof(Entry))
+		return false;
+	size_t start = sizeof(CatalogTable) + n * sizeof(Entry);
+	const Entry *entry = entries();
+	for (uint32_t ix = 0; ix < n; ix++) {
+		if (ix > 0 && memcmp(entry[ix-1].key, entry[ix].key, sizeof(SHA1::Digest)) >= 0)
+			return false;
+		size_t offset = entry[ix].offset;
+		if (offset < start || offset > total - sizeof(BlobCore))
+			return false;
+		const EmbeddedSignatureBlob *sig = EmbeddedSignatureBlob::specific(at<const BlobCore>(offset));
+		if (!sig || !sig->validateBlob(total - offset))
+			return false;
+	}
+	return true;
+}
+
+
+//
+// Binary search for a key. Only call this on a validated table.
+//
+const EmbeddedSignatureBlob *CatalogTable::find(const SHA1::Digest key) const
+{
+	const Entry *entry = entries();
+	uint32_t low = 0, high = count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		int cmp = memcmp(entry[mid].key, key, sizeof(SHA1::Digest));
+		if (cmp == 0)
+			return EmbeddedSignatureBlob::specific(at<const BlobCore>(entry[mid].offset));
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+
+//
+// Table construction.
+// The map orders keys bytewise, which is the order the table is searched in.
+//
+void CatalogTable::Maker::add(const SHA1::Digest key, const EmbeddedSignatureBlob *sig)
+{
+	mEntries[std::string((const char *)key, sizeof(SHA1::Digest))] =
+		CFTempData(sig, sig->length()).get();
+}
+
+void CatalogTable::Maker::add(CFDictionaryRef entries)
+{
+	CFIndex count = CFDictionaryGetCount(entries);
+	std::vector<const void *> keys(count), values(count);
+	CFDictionaryGetKeysAndValues(entries, &keys[0], &values[0]);
+	for (CFIndex n = 0; n < count; n++) {
+		CFDataRef key = CFDataRef(keys[n]), sig = CFDataRef(values[n]);
+		if (CFGetTypeID(key) != CFDataGetTypeID() || CFDataGetLength(key) != sizeof(SHA1::Digest)
+				|| CFGetTypeID(sig) != CFDataGetTypeID())
+			MacOSError::throwMe(errSecCSInternalError);
+		mEntries[std::string((const char *)CFDataGetBytePtr(key), sizeof(SHA1::Digest))] = sig;
+	}
+}
+
+CatalogTable *CatalogTable::Maker::make() const
+{
+	size_t offset = sizeof(CatalogTable) + mEntries.size() * sizeof(Entry);
+	size_t total = offset;
+	for (Entries::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+		total += CFDataGetLength(it->second);
+	CatalogTable *table = (CatalogTable *)::malloc(total);
+	if (!table)
+		UnixError::throwMe(ENOMEM);
+	table->initialize(total);
+	table->version = currentVersion;
+	table->count = uint32_t(mEntries.size());
+	Entry *entry = table->at<Entry>(sizeof(CatalogTable));
+	for (Entries::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it, ++entry) {
+		memcpy(entry->key, it->first.data(), sizeof(SHA1::Digest));
+		entry->offset = uint32_t(offset);
+		memcpy(table->at<char>(offset), CFDataGetBytePtr(it->second), CFDataGetLength(it->second));
+		offset += CFDataGetLength(it->second);
+	}
+	return table;
+}
+
+
+//
+// Open catalogs are shared by path, so that everyone validating against a catalog
+// benefits from its (one) signature verification. A catalog file that has changed
+// since we mapped it is opened anew.
+//
+class CatalogMap : public Mutex {
+public:
+	typedef std::map<std::string, RefPointer<SignatureCatalog> > Map;
+	Map catalogs;
+};
+static ModuleNexus<CatalogMap> catalogMap;
+
+SignatureCatalog *SignatureCatalog::open(const std::string &path)
+{
+	struct stat st;
+	UnixError::check(::stat(path.c_str(), &st));
+	CatalogMap &map = catalogMap();
+	StLock<Mutex> _(map);
+	RefPointer<SignatureCatalog> &catalog = map.catalogs[path];
+	if (!catalog || !catalog->current(st))
+		catalog = new SignatureCatalog(path);
+	return catalog;
+}
+
+
+//
+// Read a catalog file and check its structure.
+// Nothing is verified cryptographically here; see SecStaticCode::verifySignature.
+// We don't map the file: someone could rewrite (or truncate) it under us after
+// the table has been checked and its signature verified.
+//
+SignatureCatalog::SignatureCatalog(const std::string &path)
+	: mPath(path), mBase(NULL), mLength(0)
+{
+	AutoFileDesc fd(path, O_RDONLY);
+	struct stat st;
+	UnixError::check(::fstat(fd, &st));
+	mDev = st.st_dev;
+	mIno = st.st_ino;
+	mMTime = st.st_mtimespec;
+	if (st.st_size < off_t(sizeof(CatalogBlob)) || st.st_size > off_t(UINT32_MAX))
+		MacOSError::throwMe(errSecCSSignatureInvalid);
+	mLength = size_t(st.st_size);
+	if (!(mBase = ::malloc(mLength)))
+		UnixError::throwMe(ENOMEM);
+	
+	try {
+		if (fd.read(mBase, mLength, 0) != mLength)
+			MacOSError::throwMe(errSecCSSignatureInvalid);	// changed while we read it
+		const CatalogBlob *catalog = CatalogBlob::specific((const BlobCore *)mBase);
+		if (!catalog || !catalog->validateBlob(mLength))
+			MacOSError::throwMe(errSecCSSignatureInvalid);
+		const BlobCore *table = catalog->find(cdCodeDirectorySlot);
+		const BlobCore *cms = catalog->find(cdSignatureSlot);
+		if (!table || !cms)
+			MacOSError::throwMe(errSecCSSignatureInvalid);
+		size_t end = (const char *)mBase + catalog->length() - (const char *)table;
+		mTableBlob = CatalogTable::specific(table);
+		if (!mTableBlob || !mTableBlob->validateTable(end))
+			MacOSError::throwMe(errSecCSSignatureInvalid);
+		end = (const char *)mBase + catalog->length() - (const char *)cms;
+		const BlobWrapper *wrapper = BlobWrapper::specific(cms);
+		if (!wrapper || !wrapper->validateBlob(end))
+			MacOSError::throwMe(errSecCSSignatureInvalid);
+		
+		// the table stays in our copy; the (small) signature gets its own
+		mTable.take(CFDataCreateWithBytesNoCopy(NULL,
+			(const UInt8 *)mTableBlob, mTableBlob->length(), kCFAllocatorNull));
+		mSignature.take(makeCFData(wrapper->data(), wrapper->length()));
+	} catch (...) {
+		::free(mBase);
+		throw;
+	}
+	secdebug("catalog", "%p opened %s (%d entries)", this, path.c_str(), int(mTableBlob->count));
+}
+
+SignatureCatalog::~SignatureCatalog()
+{
+	mTable = NULL;		// must not outlive our copy
+	::free(mBase);
+}
+
+
+bool SignatureCatalog::current(const struct stat &st) const
+{
+	return st.st_dev == mDev && st.st_ino == mIno && st.st_size == off_t(mLength)
+		&& st.st_mtimespec.tv_sec == mMTime.tv_sec && st.st_mtimespec.tv_nsec == mMTime.tv_nsec;
+}
+
+
+const EmbeddedSignatureBlob *SignatureCatalog::find(DiskRep *rep) const
+{
+	SHA1::Digest key;
+	if (CatalogTable::key(rep, key))
+		return mTableBlob->find(key);
+	return NULL;
+}
+
+
+//
+// CatalogRep
+//
+CatalogRep *CatalogRep::find(SignatureCatalog *catalog, DiskRep *orig)
+{
+	if (const EmbeddedSignatureBlob *sig = catalog->find(orig))
+		return new CatalogRep(catalog, sig, orig);
+	return NULL;
+}
+
+CatalogRep::CatalogRep(SignatureCatalog *catalog, const EmbeddedSignatureBlob *sig, DiskRep *orig)
+	: FilterRep(orig), mCatalog(catalog), mSig(sig)
+{
+	CODESIGN_DISKREP_CREATE_DETACHED(this, orig, (char*)catalog->path().c_str(), NULL);
+}
+
+
+//
+// Components come from our catalog entry, then from the original DiskRep.
+// The CMS signature is the catalog's.
+//
+CFDataRef CatalogRep::component(CodeDirectory::SpecialSlot slot)
+{
+	if (slot == cdSignatureSlot)
+		return CFDataRef(CFRetain(mCatalog->signature()));
+	if (CFDataRef result = mSig->component(slot))
+		return result;
+	return this->base()->component(slot);
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
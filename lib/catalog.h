@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// catalog - signature catalogs sealing many pieces of code under one CMS signature
+//
+#ifndef _H_CATALOG
+#define _H_CATALOG
+
+#include "diskrep.h"
+#include "sigblob.h"
+#include <security_utilities/hashing.h>
+#include <security_utilities/refcount.h>
+#include <security_utilities/threading.h>
+#include <security_utilities/utilities.h>
+#include <security_utilities/cfutilities.h>
+#include <Security/SecTrust.h>
+#include <Security/cssmapple.h>
+#include <sys/stat.h>
+#include <map>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A CatalogTable is a table of signatures, indexed by the SHA-1 of the identification
+// (DiskRep::identification()) of the code they belong to. The index is sorted by key,
+// so it can be binary-searched where it lies. Each entry is an EmbeddedSignatureBlob
+// holding the CodeDirectory and its components, but no CMS signature of its own;
+// the table as a whole is signed instead.
+//
+//	header	CatalogTable
+//	index	Entry[count], in key order
+//	blobs	EmbeddedSignatureBlob at each Entry's offset (from start of table)
+//
+class CatalogTable : public Blob<CatalogTable, 0xfade0c03> {
+public:
+	struct Entry {
+		SHA1::Digest key;				// SHA-1 of code identification
+		Endian<uint32_t> offset;		// offset of signature blob from start of table
+	};
+	
+	Endian<uint32_t> version;			// format version
+	Endian<uint32_t> count;				// number of entries
+	
+	static const uint32_t currentVersion = 0x10000;
+	
+	const Entry *entries() const { return at<const Entry>(sizeof(CatalogTable)); }
+	
+	bool validateTable(size_t length) const;	// full structural check
+	const EmbeddedSignatureBlob *find(const SHA1::Digest key) const;
+	
+	static bool key(DiskRep *rep, SHA1::Digest key);	// catalog key for code (false if none)
+	
+	class Maker;
+};
+
+
+//
+// Assemble a CatalogTable
+//
+class CatalogTable::Maker {
+public:
+	void add(const SHA1::Digest key, const EmbeddedSignatureBlob *sig);	// copies sig
+	void add(CFDictionaryRef entries);	// { key data = signature data }
+	CatalogTable *make() const;			// malloc'ed
+	
+private:
+	typedef std::map<std::string, CFCopyRef<CFDataRef> > Entries;	// raw key => signature
+	Entries mEntries;
+};
+
+
+//
+// A catalog on disk is a SuperBlob holding the table (in cdCodeDirectorySlot)
+// and a CMS signature over the table (wrapped, in cdSignatureSlot).
+//
+typedef SuperBlob<0xfade0cc2> CatalogBlob;
+
+
+//
+// An open signature catalog. The file is read into memory once and shared by everyone
+// who asks for the same path (while the file stays the same). Working from our own copy
+// means the bytes we check and verify are the bytes we use, whatever happens to the file.
+// The CMS signature over the table is verified (at most) once per set of validation
+// flags; SecStaticCode memoizes the outcome in our Verdict.
+//
+class SignatureCatalog : public RefCount, public Mutex {
+	NOCOPY(SignatureCatalog)
+public:
+	static SignatureCatalog *open(const std::string &path);
+	~SignatureCatalog();
+	
+	const std::string &path() const { return mPath; }
+	const EmbeddedSignatureBlob *find(DiskRep *rep) const;	// signature for code, or NULL
+	CFDataRef signature() const { return mSignature; }		// CMS signature over table
+	CFDataRef table() const { return mTable; }				// the signed table
+	
+	struct Verdict {
+		Verdict() : valid(false), evalDetails(NULL) { }
+		bool valid;						// verification succeeded with...
+		SecCSFlags flags;				// ... these validation flags
+		bool expired;					// verified allowing expired certificates
+		CFRef<SecTrustRef> trust;
+		CFRef<CFArrayRef> certChain;
+		CSSM_TP_APPLE_EVIDENCE_INFO *evalDetails; // owned by trust
+		CFAbsoluteTime signingTime;
+		CFAbsoluteTime signingTimestamp;
+	};
+	Verdict verdict;					// protected by our Mutex
+
+private:
+	SignatureCatalog(const std::string &path);
+	bool current(const struct stat &st) const;	// still the file we read?
+
+private:
+	std::string mPath;					// catalog file
+	dev_t mDev;							// identity of the file we read
+	ino_t mIno;
+	struct timespec mMTime;
+	void *mBase;						// file contents (malloc'ed copy)
+	size_t mLength;						// length of file
+	const CatalogTable *mTableBlob;		// table (in mBase)
+	CFRef<CFDataRef> mTable;			// table (in mBase, as CFData)
+	CFRef<CFDataRef> mSignature;		// CMS signature (copied)
+};
+
+
+//
+// A CatalogRep interposes (filters) the genuine DiskRep of code that was found
+// in a signature catalog, much like a DetachedRep does for a detached signature.
+// Signing components come out of the catalog entry; the CMS signature is the
+// catalog's, and it signs the catalog table rather than the CodeDirectory.
+//
+class CatalogRep : public FilterRep {
+public:
+	static CatalogRep *find(SignatureCatalog *catalog, DiskRep *orig);	// NULL if not in catalog
+	
+	CFDataRef component(CodeDirectory::SpecialSlot slot);
+	
+	SignatureCatalog *catalog() const { return mCatalog; }
+	std::string source() const { return "catalog " + mCatalog->path(); }
+
+private:
+	CatalogRep(SignatureCatalog *catalog, const EmbeddedSignatureBlob *sig, DiskRep *orig);
+
+private:
+	RefPointer<SignatureCatalog> mCatalog;
+	const EmbeddedSignatureBlob *mSig;	// our entry; points into mCatalog's copy
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_CATALOG
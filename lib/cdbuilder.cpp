@@ -25,6 +25,7 @@
 // cdbuilder - constructor for CodeDirectories
 //
 #include "cdbuilder.h"
+#include "csutilities.h"
 #include <security_utilities/memutils.h>
 #include <cmath>
 
@@ -46,6 +47,7 @@ CodeDirectory::Builder::Builder(HashAlgorithm digestAlgorithm)
 	  mCodeSlots(0),
 	  mScatter(NULL),
 	  mScatterSize(0),
+	  mOriginal(NULL),
 	  mDir(NULL)
 {
 	mDigestLength = MakeHash<Builder>(this)->digestLength();
@@ -56,6 +58,7 @@ CodeDirectory::Builder::~Builder()
 {
 	::free(mSpecial);
 	::free(mScatter);
+	::free(mOriginal);
 }
 
 
@@ -82,6 +85,55 @@ void CodeDirectory::Builder::reopen(string path, size_t offset, size_t length)
 }
 
 
+//
+// Seed page hashes from an earlier CodeDirectory, given what has changed since.
+// We keep our own copy, so the original need not outlive us.
+//
+void CodeDirectory::Builder::reuse(const CodeDirectory *original, const Ranges &dirty)
+{
+	size_t length = original->length();
+	if (!(mOriginal = (CodeDirectory *)::realloc(mOriginal, length)))
+		UnixError::throwMe(ENOMEM);
+	memcpy(mOriginal, original, length);
+	mDirty = dirty;
+}
+
+
+//
+// Can we copy the hash of a page from the original, rather than computing it?
+// Only if both versions hash pages the same way, the page exists in the
+// original with the same extent (which catches a changed trailing partial page),
+// and no dirty range touches it.
+//
+bool CodeDirectory::Builder::reusable(unsigned int slot) const
+{
+	if (!mOriginal || mScatter || mOriginal->scatterVector())
+		return false;
+	if (mOriginal->hashType != mHashType || mOriginal->hashSize != mDigestLength
+			|| mOriginal->pageSize != mDir->pageSize)
+		return false;
+	if (slot >= mOriginal->nCodeSlots)
+		return false;
+	
+	size_t start, extent;
+	if (mPageSize) {
+		start = slot * mPageSize;
+		extent = min(mPageSize, mExecLength - start);
+		if (min(mPageSize, size_t(mOriginal->codeLimit) - start) != extent)
+			return false;
+	} else {
+		start = 0;
+		extent = mExecLength;
+		if (mOriginal->codeLimit != extent)
+			return false;
+	}
+	for (Ranges::const_iterator it = mDirty.begin(); it != mDirty.end(); ++it)
+		if (it->length && it->offset < start + extent && start < it->offset + it->length)
+			return false;
+	return true;
+}
+
+
 //
 // Set the source for one special slot
 //
@@ -133,6 +185,18 @@ size_t CodeDirectory::Builder::size()
 }
 
 
+//
+// Does an existing (intact) CodeDirectory describe the code this Builder will describe?
+// That takes the same identifier, the same extent of code, and the same digests.
+//
+bool CodeDirectory::Builder::matches(const CodeDirectory *cd) const
+{
+	return cd->hashType == mHashType && cd->hashSize == mDigestLength
+		&& cd->codeLimit == mExecLength
+		&& mIdentifier == cd->identifier();
+}
+
+
 //
 // Take everything added to date and wrap it up in a shiny new CodeDirectory.
 //
@@ -198,13 +262,23 @@ CodeDirectory *CodeDirectory::Builder::build()
 	for (size_t slot = 1; slot <= mSpecialSlots; ++slot)
 		memcpy((*mDir)[-slot], specialSlot(slot), mDigestLength);
 	
-	// fill code slots
-	mExec.seek(mExecOffset);
+	// fill code slots, copying what we can from an original
+	HoleFinder holes(mExec);
+	size_t position = mExecOffset;
+	mExec.seek(position);
 	size_t remaining = mExecLength;
 	for (unsigned int slot = 0; slot < mCodeSlots; ++slot) {
 		size_t thisPage = min(mPageSize, remaining);
-		MakeHash<Builder> hasher(this);
-		generateHash(hasher, mExec, (*mDir)[slot], thisPage);
+		if (reusable(slot)) {
+			memcpy((*mDir)[slot], (*mOriginal)[slot], mDigestLength);
+		} else {
+			size_t offset = mExecOffset + (mExecLength - remaining);
+			if (offset != position)
+				mExec.seek(offset);
+			MakeHash<Builder> hasher(this);
+			generatePageHash(mHashType, hasher, mExec, (*mDir)[slot], thisPage, &holes);
+			position = offset + thisPage;
+		}
 		remaining -= thisPage;
 	}
 	
@@ -28,6 +28,7 @@
 #define _H_CDBUILDER
 
 #include "codedirectory.h"
+#include <vector>
 
 
 namespace Security {
@@ -41,13 +42,29 @@ namespace CodeSigning {
 //  CodeDirectory *result = builder.build();
 // Builder is not reusable.
 //
+// A Builder may be seeded with an earlier CodeDirectory for the same code and
+// the byte ranges (relative to the start of the code) that have changed since.
+// Only pages touching those ranges, and pages whose extent changed, are hashed;
+// all other page hashes are copied from the earlier CodeDirectory. Validating
+// that CodeDirectory (and the honesty of the ranges) is up to the caller.
+//
 class CodeDirectory::Builder {
 public:
 	Builder(HashAlgorithm digestAlgorithm);
 	~Builder();
 	
+	struct Range {
+		Range(size_t o, size_t l) : offset(o), length(l) { }
+		size_t offset;
+		size_t length;
+	};
+	typedef std::vector<Range> Ranges;
+	
 	void executable(string path, size_t pagesize, size_t offset, size_t length);
 	void reopen(string path, size_t offset, size_t length);
+	void reuse(const CodeDirectory *original, const Ranges &dirty); // seed page hashes
+	size_t execLength() const { return mExecLength; }
+	bool matches(const CodeDirectory *cd) const;	// describes the same code as we will
 
 	void specialSlot(SpecialSlot slot, CFDataRef data);
 	void identifier(const std::string &code) { mIdentifier = code; }
@@ -61,6 +78,7 @@ public:
 
 private:
 	DynamicHash *getHash() const { return CodeDirectory::hashFor(this->mHashType); }
+	bool reusable(unsigned int slot) const;		// can copy this page hash from mOriginal
 	
 	Hashing::Byte *specialSlot(SpecialSlot slot)
 		{ assert(slot > 0 && slot <= cdSlotMax); return mSpecial + (slot - 1) * mDigestLength; }
@@ -84,6 +102,9 @@ private:
 	Scatter *mScatter;							// scatter vector
 	size_t mScatterSize;						// number of scatter elements allocated (incl. sentinel)
 	
+	CodeDirectory *mOriginal;					// earlier version to copy page hashes from (or NULL)
+	Ranges mDirty;								// ranges changed since mOriginal
+	
 	CodeDirectory *mDir;						// what we're building
 };
 
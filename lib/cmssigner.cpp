@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// cmssigner - making CMS signatures, locally or by a signing service
+//
+#include "cmssigner.h"
+#include <Security/CMSEncoder.h>
+#include <Security/CMSPrivate.h>
+#include <Security/tsaSupport.h>
+#include <Security/CSCommonPriv.h>
+#include <Security/SecCertificate.h>
+#include <Security/SecPolicy.h>
+#include <Security/SecTrust.h>
+#include <security_utilities/cfmunge.h>
+#include <security_utilities/debugging.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <vector>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+const CFStringRef CMSSigner::signingTimeKey = CFSTR("signingtime");
+const CFStringRef CMSSigner::timestampKey = CFSTR("timestamp");
+const CFStringRef CMSSigner::timestampServerKey = CFSTR("timestamp-server");
+const CFStringRef CMSSigner::timestampNoCertsKey = CFSTR("timestamp-nocerts");
+
+CMSSigner::~CMSSigner()
+{ /* virtual */ }
+
+CFArrayRef CMSSigner::certificates()
+{
+	StLock<Mutex> _(mLock);
+	if (!mCertificates)
+		mCertificates.take(fetchCertificates());
+	return mCertificates;
+}
+
+SecCertificateRef CMSSigner::leaf()
+{
+	return SecCertificateRef(CFArrayGetValueAtIndex(certificates(), 0));
+}
+
+
+//
+// Sign with a local identity.
+// Our certificate chain is what trust evaluation of the identity's certificate finds.
+//
+SecCertificateRef LocalCMSSigner::leaf()
+{
+	StLock<Mutex> _(mLock);
+	if (!mLeaf)
+		MacOSError::check(SecIdentityCopyCertificate(mIdentity, &mLeaf.aref()));
+	return mLeaf;
+}
+
+CFArrayRef LocalCMSSigner::fetchCertificates()
+{
+	CFRef<SecCertificateRef> signingCert;
+	MacOSError::check(SecIdentityCopyCertificate(mIdentity, &signingCert.aref()));
+	CFRef<SecPolicyRef> policy = SecPolicyCreateWithOID(kSecPolicyAppleCodeSigning);
+	CFRef<SecTrustRef> trust;
+	MacOSError::check(SecTrustCreateWithCertificates(CFArrayRef(signingCert.get()), policy, &trust.aref()));
+	SecTrustResultType result;
+	MacOSError::check(SecTrustEvaluate(trust, &result));
+	CSSM_TP_APPLE_EVIDENCE_INFO *info;
+	CFRef<CFArrayRef> chain;
+	MacOSError::check(SecTrustGetResult(trust, &result, &chain.aref(), &info));
+	if (!chain || CFArrayGetCount(chain) == 0)
+		MacOSError::throwMe(errSecCSInvalidObjectRef);
+	return chain.yield();
+}
+
+CFDataRef LocalCMSSigner::sign(CFDataRef content, CFDictionaryRef options)
+{
+	CFRef<CMSEncoderRef> cms;
+	MacOSError::check(CMSEncoderCreate(&cms.aref()));
+	MacOSError::check(CMSEncoderSetCertificateChainMode(cms, kCMSCertificateChainWithRoot));
+	CMSEncoderAddSigners(cms, mIdentity);
+	MacOSError::check(CMSEncoderSetHasDetachedContent(cms, true));
+	
+	CFDateRef time = options ? CFDateRef(CFDictionaryGetValue(options, signingTimeKey)) : NULL;
+	if (time) {
+		if (CFGetTypeID(time) != CFDateGetTypeID())
+			MacOSError::throwMe(errSecCSInvalidObjectRef);
+		MacOSError::check(CMSEncoderAddSignedAttributes(cms, kCMSAttrSigningTime));
+		MacOSError::check(CMSEncoderSetSigningTime(cms, CFDateGetAbsoluteTime(time)));
+	}
+	
+	MacOSError::check(CMSEncoderUpdateContent(cms, CFDataGetBytePtr(content), CFDataGetLength(content)));
+	
+	// set up to call the timestamp server if requested
+	if (options && CFDictionaryGetValue(options, timestampKey) == kCFBooleanTrue) {
+		CFRef<CFErrorRef> error;
+		CFRef<CFMutableDictionaryRef> tsContext;
+		tsContext.take(SecCmsTSAGetDefaultContext(&error.aref()));
+		if (error)
+			MacOSError::throwMe(errSecDataNotAvailable);
+		if (CFStringRef server = CFStringRef(CFDictionaryGetValue(options, timestampServerKey))) {
+			if (CFGetTypeID(server) != CFStringGetTypeID())
+				MacOSError::throwMe(errSecCSInvalidObjectRef);
+			CFRef<CFURLRef> url;
+			url.take(CFURLCreateWithString(NULL, server, NULL));
+			CFDictionarySetValue(tsContext, kTSAContextKeyURL, url);
+		}
+		if (CFDictionaryGetValue(options, timestampNoCertsKey) == kCFBooleanTrue)
+			CFDictionarySetValue(tsContext, kTSAContextKeyNoCerts, kCFBooleanTrue);
+		CmsMessageSetTSAContext(cms, tsContext);
+	}
+	
+	CFDataRef signature;
+	MacOSError::check(CMSEncoderCopyEncodedContent(cms, &signature));
+	return signature;
+}
+
+
+//
+// Socket protocol helpers
+//
+static void readAll(FileDesc fd, void *buffer, size_t length)
+{
+	char *p = (char *)buffer;
+	while (length > 0) {
+		size_t got = fd.read(p, length);
+		if (got == 0 || got == size_t(-1))	// premature end
+			MacOSError::throwMe(errSecCSInternalError);
+		p += got;
+		length -= got;
+	}
+}
+
+static void makeAddress(const std::string &path, struct sockaddr_un &addr)
+{
+	if (path.size() >= sizeof(addr.sun_path))
+		UnixError::throwMe(ENAMETOOLONG);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+}
+
+static void noSigPipe(int fd)
+{
+	int on = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+}
+
+void SocketCMSSigner::send(FileDesc fd, CFDictionaryRef message)
+{
+	CFRef<CFDataRef> data = makeCFData(message);
+	uint32_t length = htonl(uint32_t(CFDataGetLength(data)));
+	fd.writeAll(&length, sizeof(length));
+	fd.writeAll(CFDataGetBytePtr(data), CFDataGetLength(data));
+}
+
+CFDictionaryRef SocketCMSSigner::receive(FileDesc fd)
+{
+	uint32_t length;
+	readAll(fd, &length, sizeof(length));
+	length = ntohl(length);
+	if (length == 0 || length > maxMessage)
+		MacOSError::throwMe(errSecCSInternalError);
+	std::vector<UInt8> buffer(length);
+	readAll(fd, &buffer[0], length);
+	if (CFDictionaryRef message = makeCFDictionaryFrom(CFTempData(&buffer[0], length)))
+		return message;
+	MacOSError::throwMe(errSecCSInternalError);
+}
+
+
+//
+// One request to the signing service, and its reply.
+// A reply carrying an error is turned into an exception here.
+//
+CFDictionaryRef SocketCMSSigner::transact(CFDictionaryRef request)
+{
+	struct sockaddr_un addr;
+	makeAddress(mPath, addr);
+	int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	UnixError::check(sock);
+	AutoFileDesc fd(sock);
+	noSigPipe(fd);
+	UnixError::check(::connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	send(fd, request);
+	CFDictionaryRef reply = receive(fd);
+	if (CFTypeRef error = CFDictionaryGetValue(reply, CFSTR("error"))) {
+		OSStatus rc = (CFGetTypeID(error) == CFNumberGetTypeID())
+			? cfNumber<OSStatus>(CFNumberRef(error)) : OSStatus(errSecCSInternalError);
+		CFRelease(reply);
+		MacOSError::throwMe(rc);
+	}
+	return reply;
+}
+
+
+//
+// Find out who the signing service signs as.
+//
+CFArrayRef SocketCMSSigner::fetchCertificates()
+{
+	CFRef<CFMutableDictionaryRef> request = makeCFMutableDictionary();	// no content
+	CFRef<CFDictionaryRef> reply = transact(request);
+	CFArrayRef chain = CFArrayRef(CFDictionaryGetValue(reply, CFSTR("certificates")));
+	if (!chain || CFGetTypeID(chain) != CFArrayGetTypeID() || CFArrayGetCount(chain) == 0)
+		MacOSError::throwMe(errSecCSInternalError);
+	CFRef<CFMutableArrayRef> certs = makeCFMutableArray(0);
+	for (CFIndex n = 0; n < CFArrayGetCount(chain); n++) {
+		CFDataRef der = CFDataRef(CFArrayGetValueAtIndex(chain, n));
+		if (CFGetTypeID(der) != CFDataGetTypeID())
+			MacOSError::throwMe(errSecCSInternalError);
+		CFRef<SecCertificateRef> cert = SecCertificateCreateWithData(NULL, der);
+		if (!cert)
+			MacOSError::throwMe(errSecCSInternalError);
+		CFArrayAppendValue(certs, cert);
+	}
+	secdebug("cmssigner", "%p service %s signs with %ld certificate(s)", this, mPath.c_str(), CFArrayGetCount(certs));
+	return certs.yield();
+}
+
+
+//
+// Ask a signing service to sign for us.
+// The content (usually a CodeDirectory) and options are all that's sent.
+//
+CFDataRef SocketCMSSigner::sign(CFDataRef content, CFDictionaryRef options)
+{
+	CFRef<CFMutableDictionaryRef> request = options ? makeCFMutableDictionary(options) : makeCFMutableDictionary();
+	CFDictionarySetValue(request, CFSTR("content"), content);
+	secdebug("cmssigner", "%p sending %ld bytes to %s for signing", this, CFDataGetLength(content), mPath.c_str());
+	CFRef<CFDictionaryRef> reply = transact(request);
+	if (CFTypeRef signature = CFDictionaryGetValue(reply, CFSTR("signature")))
+		if (CFGetTypeID(signature) == CFDataGetTypeID())
+			return CFDataRef(CFRetain(signature));
+	MacOSError::throwMe(errSecCSInternalError);
+}
+
+
+//
+// The stand-in signing service
+//
+CMSSigningService::CMSSigningService(const std::string &path, SecIdentityRef identity)
+	: mPath(path), mSocket(-1), mSigner(identity), mQueue(NULL), mSource(NULL)
+{
+	struct sockaddr_un addr;
+	makeAddress(path, addr);
+	mSocket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	UnixError::check(mSocket);
+	try {
+		::unlink(path.c_str());		// stale socket from an earlier run
+		UnixError::check(::bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)));
+		UnixError::check(::listen(mSocket, 16));
+	} catch (...) {
+		::close(mSocket);
+		throw;
+	}
+}
+
+CMSSigningService::~CMSSigningService()
+{
+	if (mSource) {
+		// wait for any connection in progress to finish
+		dispatch_semaphore_t done = dispatch_semaphore_create(0);
+		dispatch_source_set_cancel_handler(mSource, ^{ dispatch_semaphore_signal(done); });
+		dispatch_source_cancel(mSource);
+		dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+		dispatch_release(done);
+		dispatch_release(mSource);
+		dispatch_release(mQueue);
+	}
+	::close(mSocket);
+	::unlink(mPath.c_str());
+}
+
+void CMSSigningService::start()
+{
+	assert(!mSource);
+	mQueue = dispatch_queue_create("com.apple.security.codesigning.cmsservice", NULL);
+	mSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, mSocket, 0, mQueue);
+	dispatch_source_set_event_handler(mSource, ^{
+		int conn = ::accept(mSocket, NULL, NULL);
+		if (conn < 0)
+			return;
+		AutoFileDesc fd(conn);
+		noSigPipe(fd);
+		try {
+			serve(fd);
+		} catch (...) {
+			secdebug("cmssigner", "%p connection failed", this);
+		}
+	});
+	dispatch_resume(mSource);
+}
+
+
+//
+// Serve one request: a signature, or (if there's no content) our certificate chain.
+// Failures are reported to the client.
+//
+void CMSSigningService::serve(FileDesc fd)
+{
+	CFRef<CFDictionaryRef> request = SocketCMSSigner::receive(fd);
+	CFRef<CFDictionaryRef> reply;
+	try {
+		CFDataRef content = CFDataRef(CFDictionaryGetValue(request, CFSTR("content")));
+		if (!content) {
+			CFArrayRef certs = mSigner.certificates();
+			CFRef<CFMutableArrayRef> chain = makeCFMutableArray(0);
+			for (CFIndex n = 0; n < CFArrayGetCount(certs); n++) {
+				CFRef<CFDataRef> der = SecCertificateCopyData(SecCertificateRef(CFArrayGetValueAtIndex(certs, n)));
+				CFArrayAppendValue(chain, der);
+			}
+			reply.take(cfmake<CFDictionaryRef>("{certificates=%O}", chain.get()));
+		} else {
+			if (CFGetTypeID(content) != CFDataGetTypeID())
+				MacOSError::throwMe(errSecCSInvalidObjectRef);
+			CFRef<CFDataRef> signature = mSigner.sign(content, request);
+			reply.take(cfmake<CFDictionaryRef>("{signature=%O}", signature.get()));
+			secdebug("cmssigner", "%p signed %ld bytes", this, CFDataGetLength(content));
+		}
+	} catch (const CommonError &err) {
+		reply.take(cfmake<CFDictionaryRef>("{error=%d}", int(err.osStatus())));
+	}
+	SocketCMSSigner::send(fd, reply);
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
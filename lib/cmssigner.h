@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// cmssigner - making CMS signatures, locally or by a signing service
+//
+#ifndef _H_CMSSIGNER
+#define _H_CMSSIGNER
+
+#include <security_utilities/refcount.h>
+#include <security_utilities/cfutilities.h>
+#include <security_utilities/unix++.h>
+#include <security_utilities/utilities.h>
+#include <security_utilities/threading.h>
+#include <Security/SecIdentity.h>
+#include <Security/SecCertificate.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <string>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A CMSSigner makes a detached CMS signature over some content (ordinarily, a
+// CodeDirectory). This is the only step of signing that needs the private key, so it's
+// the only one we let happen elsewhere: everything else (CodeDirectories, resource seals)
+// is computed locally, and only the content to be signed - a few kilobytes - goes out.
+// The signer's certificate chain is needed locally too (for the designated requirement
+// and the choice of timestamping), so a CMSSigner can always tell us what it is.
+// It's found when first asked for, which is ordinarily when signing starts.
+//
+// Options are a CFDictionary with these (optional) keys:
+//	signingtime			CFDate to sign in as a signed attribute
+//	timestamp			kCFBooleanTrue to obtain a timestamp
+//	timestamp-server	CFString (URL) of the timestamp authority to use
+//	timestamp-nocerts	kCFBooleanTrue to ask the timestamp authority for no certificates
+//
+class CMSSigner : public RefCount {
+public:
+	virtual ~CMSSigner();
+	
+	virtual CFDataRef sign(CFDataRef content, CFDictionaryRef options) = 0; // caller owns result
+	CFArrayRef certificates();			// SecCertificateRefs, leaf first
+	virtual SecCertificateRef leaf();	// signing certificate [first of certificates()]
+	
+	static const CFStringRef signingTimeKey;
+	static const CFStringRef timestampKey;
+	static const CFStringRef timestampServerKey;
+	static const CFStringRef timestampNoCertsKey;
+
+protected:
+	virtual CFArrayRef fetchCertificates() = 0;	// find certificate chain (caller owns; not empty)
+
+protected:
+	Mutex mLock;						// protects lazily found state
+
+private:
+	CFRef<CFArrayRef> mCertificates;	// certificate chain (NULL until fetched)
+};
+
+
+//
+// A CMSSigner using a signing identity we have here
+//
+class LocalCMSSigner : public CMSSigner {
+public:
+	LocalCMSSigner(SecIdentityRef identity) : mIdentity(identity) { }
+	
+	CFDataRef sign(CFDataRef content, CFDictionaryRef options);
+	SecCertificateRef leaf();			// straight from the identity (no trust evaluation)
+
+protected:
+	CFArrayRef fetchCertificates();
+
+private:
+	CFCopyRef<SecIdentityRef> mIdentity;
+	CFRef<SecCertificateRef> mLeaf;		// identity's certificate (NULL until asked for)
+};
+
+
+//
+// A CMSSigner that asks a signing service listening on a UNIX-domain socket.
+// Each request is one connection. Requests and replies are XML property lists,
+// each preceded by its length (32 bits, network byte order). The request holds
+// the options plus the content (key "content"); the reply holds either the
+// signature (key "signature") or an OSStatus (key "error").
+// A request without content asks for the service's certificate chain instead; the
+// reply holds it as an array of DER certificates, leaf first (key "certificates").
+//
+class SocketCMSSigner : public CMSSigner {
+public:
+	SocketCMSSigner(const std::string &path) : mPath(path) { }
+	
+	CFDataRef sign(CFDataRef content, CFDictionaryRef options);
+	
+	static void send(UnixPlusPlus::FileDesc fd, CFDictionaryRef message);
+	static CFDictionaryRef receive(UnixPlusPlus::FileDesc fd);	// caller owns result
+	
+	static const size_t maxMessage = 1024 * 1024;	// sanity limit on message size
+
+protected:
+	CFArrayRef fetchCertificates();
+
+private:
+	CFDictionaryRef transact(CFDictionaryRef request);	// one round trip; caller owns reply
+
+private:
+	std::string mPath;
+};
+
+
+//
+// A stand-in signing service, serving SocketCMSSigner clients from a local identity.
+// This is meant for testing the remote signing path; a real signing farm would speak
+// the same protocol with its keys in hardware. Connections are served in turn, on a
+// background dispatch queue, until the service object is destroyed.
+//
+class CMSSigningService : public RefCount {
+	NOCOPY(CMSSigningService)
+public:
+	CMSSigningService(const std::string &path, SecIdentityRef identity);
+	~CMSSigningService();
+	
+	void start();					// begin serving (asynchronously)
+	void serve(UnixPlusPlus::FileDesc fd);	// handle one connection
+	
+	const std::string &path() const { return mPath; }
+
+private:
+	std::string mPath;				// socket path (we made it; we remove it)
+	int mSocket;					// listening socket
+	LocalCMSSigner mSigner;
+	dispatch_queue_t mQueue;		// where we serve (NULL until started)
+	dispatch_source_t mSource;		// accept source (NULL until started)
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_CMSSIGNER
@@ -26,7 +26,14 @@
 //
 #include "codedirectory.h"
 #include "csutilities.h"
+#include "hwhash.h"
+#include "treehash.h"
 #include "CSCommonPriv.h"
+#include <security_utilities/globalizer.h>
+#include <security_utilities/threading.h>
+#include <map>
+#include <memory>
+#include <vector>
 
 using namespace UnixPlusPlus;
 
@@ -179,11 +186,11 @@ bool CodeDirectory::validateSlot(const void *data, size_t length, Slot slot) con
 // Validate a slot against the contents of an open file. At most 'length' bytes
 // will be read from the file.
 //
-bool CodeDirectory::validateSlot(FileDesc fd, size_t length, Slot slot) const
+bool CodeDirectory::validateSlot(FileDesc fd, size_t length, Slot slot, HoleFinder *holes) const
 {
 	MakeHash<CodeDirectory> hasher(this);
 	Hashing::Byte digest[hasher->digestLength()];
-	generateHash(hasher, fd, digest, length);
+	generatePageHash(hashType, hasher, fd, digest, length, holes);
 	return memcmp(digest, (*this)[slot], hasher->digestLength()) == 0;
 }
 
@@ -210,13 +217,19 @@ bool CodeDirectory::slotIsPresent(Slot slot) const
 // and return it. The caller owns the object and  must delete it when done.
 // This function never returns NULL. It throws if the hashType is unsuupported,
 // or if there's an error creating the hasher.
+// If the processor can compute the digest directly (and that engine passed its
+// self-test), we use it; otherwise we use CommonCrypto.
+// Tree hashes are built out of one of the plain hashes.
 //
 DynamicHash *CodeDirectory::hashFor(HashAlgorithm hashType)
 {
+	if (DynamicHash *hash = AcceleratedHash::make(hashType))
+		return hash;
 	CCDigestAlg alg;
 	switch (hashType) {
 	case kSecCodeSignatureHashSHA1:						alg = kCCDigestSHA1; break;
 	case kSecCodeSignatureHashSHA256:					alg = kCCDigestSHA256; break;
+	case kSecCodeSignatureHashSHA256Tree:				return new TreeHash(kSecCodeSignatureHashSHA256);
 	case kSecCodeSignatureHashPrestandardSkein160x256:	alg = kCCDigestSkein160; break;
 	case kSecCodeSignatureHashPrestandardSkein256x512:	alg = kCCDigestSkein256; break;
 	default:
@@ -252,6 +265,66 @@ size_t CodeDirectory::generateHash(DynamicHash *hasher, const void *data, size_t
 }
 
 
+//
+// Hash one page of a file, like generateHash. Pages that are all zeros (common in
+// big binaries and sparse files) get a precomputed digest instead of being hashed,
+// and pages the HoleFinder says lie in a hole aren't even read. The digest is the
+// same either way. Unlimited pages (length == 0) are hashed as usual.
+//
+size_t CodeDirectory::generatePageHash(HashAlgorithm type, DynamicHash *hasher, FileDesc fd,
+	Hashing::Byte *digest, size_t length, HoleFinder *holes)
+{
+	if (length == 0 || length > zeroPageMax)
+		return generateHash(hasher, fd, digest, length);
+	
+	size_t position = fd.position();
+	if (holes && holes->inHole(position, length)) {
+		fd.seek(position + length);
+		zeroPageHash(type, length, digest);
+		return length;
+	}
+	
+	Hashing::Byte buffer[zeroPageMax];
+	size_t total = 0;
+	while (total < length) {
+		size_t got = fd.read(buffer + total, length - total);
+		if (fd.atEnd())
+			break;
+		total += got;
+	}
+	if (total == length && isZero(buffer, length)) {
+		zeroPageHash(type, length, digest);
+		return length;
+	}
+	return generateHash(hasher, buffer, total, digest);
+}
+
+
+//
+// Digests of zero pages are computed once per hash type and page size, and kept.
+//
+class ZeroPageHashes : public Mutex {
+public:
+	typedef std::map<std::pair<CodeDirectory::HashAlgorithm, size_t>, std::vector<Hashing::Byte> > Map;
+	Map hashes;
+};
+static ModuleNexus<ZeroPageHashes> zeroPageHashes;
+
+void CodeDirectory::zeroPageHash(HashAlgorithm type, size_t length, Hashing::Byte *digest)
+{
+	ZeroPageHashes &zeros = zeroPageHashes();
+	StLock<Mutex> _(zeros);
+	std::vector<Hashing::Byte> &hash = zeros.hashes[std::make_pair(type, length)];
+	if (hash.empty()) {
+		std::auto_ptr<DynamicHash> hasher(hashFor(type));
+		std::vector<Hashing::Byte> page(length, 0);
+		hash.resize(hasher->digestLength());
+		generateHash(hasher.get(), &page[0], length, &hash[0]);
+	}
+	memcpy(digest, &hash[0], hash.size());
+}
+
+
 }	// CodeSigning
 }	// Security
 
@@ -52,6 +52,8 @@
 namespace Security {
 namespace CodeSigning {
 
+class HoleFinder;
+
 
 //
 // Conventional string names for various code signature components.
@@ -233,7 +235,8 @@ public:
 	
 public:
 	bool validateSlot(const void *data, size_t size, Slot slot) const;			// validate memory buffer against page slot
-	bool validateSlot(UnixPlusPlus::FileDesc fd, size_t size, Slot slot) const;	// read and validate file
+	bool validateSlot(UnixPlusPlus::FileDesc fd, size_t size, Slot slot,
+		HoleFinder *holes = NULL) const;											// read and validate file
 	bool slotIsPresent(Slot slot) const;
 	
 	class Builder;
@@ -245,6 +248,11 @@ public:
 protected:
 	static size_t generateHash(DynamicHash *hash, UnixPlusPlus::FileDesc fd, Hashing::Byte *digest, size_t limit = 0); // hash to count or end of file
 	static size_t generateHash(DynamicHash *hash, const void *data, size_t length, Hashing::Byte *digest); // hash data buffer
+	static size_t generatePageHash(HashAlgorithm type, DynamicHash *hash, UnixPlusPlus::FileDesc fd,
+		Hashing::Byte *digest, size_t length, HoleFinder *holes = NULL); // hash one page; zero pages are precomputed
+	static void zeroPageHash(HashAlgorithm type, size_t length, Hashing::Byte *digest); // digest of length zero bytes
+	
+	static const size_t zeroPageMax = 64 * 1024;	// largest page we check for zeros
 	
 public:
 	//
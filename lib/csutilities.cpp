@@ -25,10 +25,15 @@
 // csutilities - miscellaneous utilities for the code signing implementation
 //
 #include "csutilities.h"
+#include "hwhash.h"
+#include "treehash.h"
 #include <Security/SecCertificatePriv.h>
 #include <security_codesigning/requirement.h>
 #include <security_utilities/debugging.h>
 #include <security_utilities/errors.h>
+#include <mach/mach_time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 
 namespace Security {
 namespace CodeSigning {
@@ -39,7 +44,7 @@ namespace CodeSigning {
 //
 void hashOfCertificate(const void *certData, size_t certLength, SHA1::Digest digest)
 {
-	SHA1 hasher;
+	FastSHA1 hasher;
 	hasher(certData, certLength);
 	hasher.finish(digest);
 }
@@ -57,6 +62,104 @@ void hashOfCertificate(SecCertificateRef cert, SHA1::Digest digest)
 }
 
 
+//
+// Hash (part of) a file through a DynamicHash.
+// Tree hashes get to do this in parallel; everything else goes the usual way.
+//
+size_t hashFileData(UnixPlusPlus::FileDesc fd, DynamicHash *hasher, size_t limit)
+{
+	if (TreeHash *tree = dynamic_cast<TreeHash *>(hasher))
+		return tree->updateFile(fd, limit);
+	return hashFileData<DynamicHash>(fd, hasher, limit);
+}
+
+
+//
+// Zero detection.
+// The memcmp of a buffer against itself, shifted by one byte, is as fast
+// (vectorized) a test for uniform content as we're going to get.
+//
+bool isZero(const void *data, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	return length == 0 || (bytes[0] == 0 && memcmp(bytes, bytes + 1, length - 1) == 0);
+}
+
+HoleFinder::HoleFinder(UnixPlusPlus::FileDesc fd)
+	: mFd(fd), mSize(fd.fileSize()), mHole(0), mData(0)
+{
+	if (mSize < minimumSparseSize)
+		mHole = mData = SIZE_MAX;
+}
+
+bool HoleFinder::inHole(size_t position, size_t length)
+{
+	if (position + length > mSize)
+		return false;
+	if (position >= mData)
+		find(position);
+	return position >= mHole && position + length <= mData;
+}
+
+//
+// Find the next hole at or after position. Seeking for holes moves the
+// file position, so we put it back where it was.
+//
+void HoleFinder::find(size_t position)
+{
+	mHole = mData = SIZE_MAX;
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+	off_t here = ::lseek(mFd, 0, SEEK_CUR);
+	off_t hole = ::lseek(mFd, position, SEEK_HOLE);
+	if (hole >= 0 && size_t(hole) < mSize) {	// a real hole (not the one at end of file)
+		off_t data = ::lseek(mFd, hole, SEEK_DATA);
+		mHole = hole;
+		mData = (data >= 0) ? size_t(data) : mSize;	// ENXIO: hole extends to end of file
+	}
+	::lseek(mFd, here, SEEK_SET);
+#endif
+}
+
+
+//
+// Ask the file system where a file starts on disk
+//
+uint64_t physicalOffset(const char *path)
+{
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct log2phys l2p;
+	l2p.l2p_flags = 0;
+	l2p.l2p_contigbytes = 1;	// just the first byte, please
+	l2p.l2p_devoffset = 0;		// (on input: file offset)
+	int rc = ::fcntl(fd, F_LOG2PHYS_EXT, &l2p);
+	::close(fd);
+	return (rc == 0) ? l2p.l2p_devoffset : 0;
+}
+
+
+//
+// Clocks for performance accounting
+//
+double wallClockSeconds()
+{
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	return double(mach_absolute_time()) * timebase.numer / timebase.denom / 1E9;
+}
+
+double cpuSeconds()
+{
+	struct rusage usage;
+	if (::getrusage(RUSAGE_SELF, &usage))
+		return 0;		// no clock; account nothing
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1E6;
+}
+
+
 //
 // Check to see if a certificate contains a particular field, by OID. This works for extensions,
 // even ones not recognized by the local CL. It does not return any value, only presence.
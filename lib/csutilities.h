@@ -50,12 +50,45 @@ void hashOfCertificate(const void *certData, size_t certLength, SHA1::Digest dig
 void hashOfCertificate(SecCertificateRef cert, SHA1::Digest digest);
 
 
+//
+// Zero detection, so that zero-filled data need not be read or hashed the hard way.
+// isZero checks a memory buffer. A HoleFinder tracks the holes of a sparse file
+// while it is read front to back, asking the file system (SEEK_HOLE/SEEK_DATA) only
+// when reading passes the hole it found last. inHole says whether a range of the
+// file lies entirely in a hole (and so reads as zeros); it does not move the file position.
+// Small files, and file systems that don't report holes, have no holes.
+//
+bool isZero(const void *data, size_t length);
+
+class HoleFinder {
+public:
+	HoleFinder(UnixPlusPlus::FileDesc fd);
+	
+	bool inHole(size_t position, size_t length);
+	
+private:
+	void find(size_t position);
+	
+	static const size_t minimumSparseSize = 64 * 1024; // don't bother with smaller files
+
+private:
+	UnixPlusPlus::FileDesc mFd;
+	size_t mSize;				// file size
+	size_t mHole;				// start of the last hole found (SIZE_MAX if no more holes)
+	size_t mData;				// end of that hole
+};
+
+
 //
 // Calculate hashes of (a section of) a file.
 // Starts at the current file position.
 // Extends to end of file, or (if limit > 0) at most limit bytes.
 // Returns number of bytes digested.
+// Holes in the file are hashed as the zeros they are, without reading them.
+// The DynamicHash version lets tree hashes work on the file concurrently.
 //
+size_t hashFileData(UnixPlusPlus::FileDesc fd, DynamicHash *hasher, size_t limit = 0);
+
 template <class _Hash>
 size_t hashFileData(const char *path, _Hash *hasher)
 {
@@ -66,24 +99,57 @@ size_t hashFileData(const char *path, _Hash *hasher)
 template <class _Hash>
 size_t hashFileData(UnixPlusPlus::FileDesc fd, _Hash *hasher, size_t limit = 0)
 {
+	static const unsigned char zeros[4096] = { 0 };
 	unsigned char buffer[4096];
+	HoleFinder holes(fd);
+	size_t position = fd.position();
+	bool skipped = false;		// file position is behind (we skipped a hole)
 	size_t total = 0;
 	for (;;) {
 		size_t size = sizeof(buffer);
 		if (limit && limit < size)
 			size = limit;
-		size_t got = fd.read(buffer, size);
-		total += got;
-		if (fd.atEnd())
-			break;
-		hasher->update(buffer, got);
-		if (limit && (limit -= got) == 0)
+		if (holes.inHole(position, size)) {
+			hasher->update(zeros, size);
+			skipped = true;
+		} else {
+			if (skipped) {
+				fd.seek(position);
+				skipped = false;
+			}
+			size_t got = fd.read(buffer, size);
+			if (fd.atEnd())
+				break;
+			hasher->update(buffer, got);
+			size = got;
+		}
+		total += size;
+		position += size;
+		if (limit && (limit -= size) == 0)
 			break;
 	}
+	if (skipped)
+		fd.seek(position);
 	return total;
 }
 
 
+//
+// Where a file's data starts on its device, as a byte offset.
+// This is for ordering reads to avoid seeking; it is never needed for correctness.
+// Returns zero if the file system won't tell (or the file is empty).
+//
+uint64_t physicalOffset(const char *path);
+
+
+//
+// Clocks for performance accounting.
+// Both return seconds as a double; only differences between calls are meaningful.
+//
+double wallClockSeconds();			// elapsed (real) time
+double cpuSeconds();				// user+system CPU time consumed by this process
+
+
 //
 // Check to see if a certificate contains a particular field, by OID. This works for extensions,
 // even ones not recognized by the local CL. It does not return any value, only presence.
@@ -54,6 +54,7 @@ public:
 	CFDataRef component(CodeDirectory::SpecialSlot slot);
 	
 	const std::string &source() const { return mSource; }
+	CFDataRef signature() const { return mSig; }	// as given (all architectures, or just ours)
 
 private:
 	CFRef<CFDataRef> mSig, mGSig;
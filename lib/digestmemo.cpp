@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// digestmemo - remember file digests for the duration of a validation or signing
+//
+#include "digestmemo.h"
+#include <algorithm>
+#include <vector>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+const unsigned DigestMemo::maxCandidates;
+
+
+DigestMemo::DigestMemo(size_t matchContents)
+	: mMatchContents(matchContents)
+{ }
+
+
+bool DigestMemo::Key::operator < (const Key &other) const
+{
+	if (dev != other.dev)
+		return dev < other.dev;
+	if (ino != other.ino)
+		return ino < other.ino;
+	return hashType < other.hashType;
+}
+
+
+//
+// Find the digest of an open file, if we can.
+// First by identity, then (optionally) by comparing contents with same-size files.
+// This doesn't move the file position of fd.
+//
+bool DigestMemo::find(FileDesc fd, const struct stat &st, uint32_t hashType, std::string &digest)
+{
+	std::vector<std::pair<Key, Value> > candidates;
+	{
+		StLock<Mutex> _(mLock);
+		Map::const_iterator it = mDigests.find(Key(st, hashType));
+		if (it != mDigests.end() && current(it->second, st)) {
+			digest = it->second.digest;
+			return true;
+		}
+		if (!mMatchContents || size_t(st.st_size) < mMatchContents)
+			return false;
+		std::pair<SizeMap::const_iterator, SizeMap::const_iterator> range = mBySize.equal_range(st.st_size);
+		for (SizeMap::const_iterator sit = range.first; sit != range.second && candidates.size() < maxCandidates; ++sit)
+			if (sit->second.hashType == hashType) {
+				Map::const_iterator cit = mDigests.find(sit->second);
+				if (cit != mDigests.end() && cit->second.size == st.st_size)
+					candidates.push_back(*cit);
+			}
+	}
+	// compare without holding the lock; this is slow
+	for (std::vector<std::pair<Key, Value> >::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+		if (sameContents(fd, it->first, it->second)) {
+			digest = it->second.digest;
+			add(st, hashType, digest.data(), digest.size());	// by identity from now on
+			return true;
+		}
+	return false;
+}
+
+void DigestMemo::add(const struct stat &st, uint32_t hashType, const void *digest, size_t length,
+	const std::string &path)
+{
+	Value value;
+	value.size = st.st_size;
+	value.mtime = st.st_mtimespec;
+	value.digest.assign((const char *)digest, length);
+	value.path = path;
+	Key key(st, hashType);
+	StLock<Mutex> _(mLock);
+	if (mMatchContents && size_t(st.st_size) >= mMatchContents && !path.empty()
+			&& mDigests.find(key) == mDigests.end())
+		mBySize.insert(std::make_pair(st.st_size, key));
+	mDigests[key] = value;
+}
+
+
+bool DigestMemo::current(const Value &value, const struct stat &st) const
+{
+	return value.size == st.st_size
+		&& value.mtime.tv_sec == st.st_mtimespec.tv_sec
+		&& value.mtime.tv_nsec == st.st_mtimespec.tv_nsec;
+}
+
+
+//
+// Compare the contents of an open file with those of a (same-size) file we've hashed
+// before. The other file must still be what it was when we hashed it: the same
+// file (its path may have been replaced since), unmodified.
+//
+bool DigestMemo::sameContents(FileDesc fd, const Key &key, const Value &other)
+{
+	AutoFileDesc theirFd(other.path, O_RDONLY, FileDesc::modeMissingOk);
+	if (!theirFd)
+		return false;
+	struct stat st;
+	if (::fstat(theirFd, &st) || st.st_dev != key.dev || st.st_ino != key.ino)
+		return false;		// not the file we hashed
+	if (!current(other, st))
+		return false;		// changed since we hashed it
+	
+	static const size_t bufferSize = 64 * 1024;
+	std::vector<char> mine(bufferSize), theirs(bufferSize);
+	for (off_t pos = 0; pos < other.size; ) {
+		size_t length = size_t(std::min(off_t(bufferSize), other.size - pos));
+		if (fd.read(&mine[0], length, pos) != length || theirFd.read(&theirs[0], length, pos) != length)
+			return false;
+		if (memcmp(&mine[0], &theirs[0], length))
+			return false;
+		pos += length;
+	}
+	return true;
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
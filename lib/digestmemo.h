@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// digestmemo - remember file digests for the duration of a validation or signing
+//
+#ifndef _H_DIGESTMEMO
+#define _H_DIGESTMEMO
+
+#include <security_utilities/refcount.h>
+#include <security_utilities/threading.h>
+#include <security_utilities/unix++.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A DigestMemo remembers the digests of files, by file identity (device and inode)
+// and digest type. During a nested-code validation, the same file is usually covered
+// by several resource seals (its own bundle's and those of all enclosing bundles);
+// with a shared DigestMemo, it is read and hashed only once. The same goes for
+// hard links within one bundle.
+//
+// Optionally, a DigestMemo also recognizes distinct files with identical contents
+// (localized copies and the like). A file that has the same size as one whose digest
+// we know is compared with it, byte for byte; if they are equal, it gets the same
+// digest without being hashed. This trades hashing for comparing, so it's off by default.
+//
+// An entry is only used while the file's size and modification time are what they
+// were when it was made. DigestMemos are thread-safe.
+//
+class DigestMemo : public RefCount {
+public:
+	DigestMemo(size_t matchContents = 0);	// compare contents of files this large or larger (0 = never)
+
+	bool find(UnixPlusPlus::FileDesc fd, const struct stat &st, uint32_t hashType, std::string &digest);
+	void add(const struct stat &st, uint32_t hashType, const void *digest, size_t length,
+		const std::string &path = "");
+
+	static const unsigned maxCandidates = 4; // most same-size files compared against
+
+private:
+	struct Key {
+		Key(const struct stat &st, uint32_t type) : dev(st.st_dev), ino(st.st_ino), hashType(type) { }
+		dev_t dev;
+		ino_t ino;
+		uint32_t hashType;
+		bool operator < (const Key &other) const;
+	};
+	struct Value {
+		off_t size;
+		struct timespec mtime;
+		std::string digest;
+		std::string path;				// where to find it for comparison ("" if unknown)
+	};
+	typedef std::map<Key, Value> Map;
+	typedef std::multimap<off_t, Key> SizeMap;
+	
+	bool current(const Value &value, const struct stat &st) const;
+	bool sameContents(UnixPlusPlus::FileDesc fd, const Key &key, const Value &other);
+	
+	size_t mMatchContents;
+	Mutex mLock;
+	Map mDigests;
+	SizeMap mBySize;					// content-match candidates, by size
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_DIGESTMEMO
@@ -33,6 +33,7 @@
 #include "bundlediskrep.h"
 #include "cfmdiskrep.h"
 #include "slcrep.h"
+#include "archiverep.h"
 
 
 namespace Security {
@@ -91,6 +92,10 @@ void DiskRep::Writer::addDiscretionary(CodeDirectory::Builder &)
 DiskRep *DiskRep::bestGuess(const char *path, const Context *ctx)
 {
 	try {
+		// explicitly requested: code inside an archive
+		if (ctx && ctx->archive)
+			return new ArchiveDiskRep(path, ctx);
+
 		if (!(ctx && ctx->fileOnly)) {
 			struct stat st;
 			if (::stat(path, &st))
@@ -177,11 +182,16 @@ string DiskRep::resourcesRootPath()
 	return "";		// has no resources directory
 }
 
-void DiskRep::adjustResources(ResourceBuilder &builder)
+void DiskRep::adjustResources(ResourceRules &rules)
 {
 	// do nothing
 }
 
+ResourceStore *DiskRep::resourceStore()
+{
+	return NULL;	// resources (if any) are plain files
+}
+
 Universal *DiskRep::mainExecutableImage()
 {
 	return NULL;	// no Mach-O executable
@@ -204,6 +214,15 @@ void DiskRep::flush()
 	// nothing cached
 }
 
+int DiskRep::openExecutable()
+{
+	// a private descriptor, so callers can seek (and fiddle with caching) freely
+	int fd = ::open(mainExecutablePath().c_str(), O_RDONLY);
+	if (fd < 0)
+		UnixError::throwMe();
+	return fd;
+}
+
 
 CFDictionaryRef DiskRep::defaultResourceRules(const SigningContext &)
 {
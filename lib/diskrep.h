@@ -60,13 +60,15 @@ public:
 	virtual std::string mainExecutablePath() = 0;			// path to main executable
 	virtual CFURLRef canonicalPath() = 0;					// path to whole code
 	virtual std::string resourcesRootPath();				// resource directory if any [none]
-	virtual void adjustResources(ResourceBuilder &builder);	// adjust resource rule set [no change]
+	virtual void adjustResources(ResourceRules &rules);		// adjust resource rule set [no change]
+	virtual ResourceStore *resourceStore();					// resources not in files under resourcesRootPath [none]
 	virtual Universal *mainExecutableImage();				// Mach-O image if Mach-O based [null]
 	virtual size_t signingBase();							// start offset of signed area in main executable [zero]
 	virtual size_t signingLimit() = 0;						// size of signed area in main executable
 	virtual std::string format() = 0;						// human-readable type string
 	virtual CFArrayRef modifiedFiles();						// list of files modified by signing [main execcutable only]
 	virtual UnixPlusPlus::FileDesc &fd() = 0;				// a cached file descriptor for main executable file
+	virtual int openExecutable();							// new read-only fd for main executable [open mainExecutablePath()]
 	virtual void flush();									// flush caches (refetch as needed)
 
 	// default values for signing operations
@@ -89,11 +91,12 @@ public:
 public:
 	// optional information that might be used to create a suitable DiskRep. All optional
 	struct Context {
-		Context() : arch(Architecture::none), version(NULL), offset(0), fileOnly(false), inMemory(NULL) { }
+		Context() : arch(Architecture::none), version(NULL), offset(0), fileOnly(false), archive(false), inMemory(NULL) { }
 		Architecture arch;			// explicit architecture (choose amongst universal variants)
 		const char *version;		// bundle version (string)
 		off_t offset;				// explicit file offset
 		bool fileOnly;				// only consider single-file representations (no bundles etc.)
+		bool archive;				// path is an archive (zip or tar) containing the code
 		const void *inMemory;		// consider using in-memory copy at this address
 	};
 
@@ -194,13 +197,15 @@ public:
 	std::string mainExecutablePath()		{ return mOriginal->mainExecutablePath(); }
 	CFURLRef canonicalPath()				{ return mOriginal->canonicalPath(); }
 	std::string resourcesRootPath()			{ return mOriginal->resourcesRootPath(); }
-	void adjustResources(ResourceBuilder &builder) { return mOriginal->adjustResources(builder); }
+	void adjustResources(ResourceRules &rules) { return mOriginal->adjustResources(rules); }
+	ResourceStore *resourceStore()			{ return mOriginal->resourceStore(); }
 	Universal *mainExecutableImage()		{ return mOriginal->mainExecutableImage(); }
 	size_t signingBase()					{ return mOriginal->signingBase(); }
 	size_t signingLimit()					{ return mOriginal->signingLimit(); }
 	std::string format()					{ return mOriginal->format(); }
 	CFArrayRef modifiedFiles()				{ return mOriginal->modifiedFiles(); }
 	UnixPlusPlus::FileDesc &fd()			{ return mOriginal->fd(); }
+	int openExecutable()					{ return mOriginal->openExecutable(); }
 	void flush()							{ return mOriginal->flush(); }
 	
 	std::string recommendedIdentifier(const SigningContext &ctx)
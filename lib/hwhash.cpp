@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// hwhash - digest engines using processor SHA instructions
+//
+#include "hwhash.h"
+#include <security_utilities/globalizer.h>
+#include <security_utilities/debugging.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(__i386__) || defined(__x86_64__)
+# define HWHASH_X86 1
+# include <cpuid.h>
+# include <immintrin.h>
+#elif defined(__arm64__) || defined(__aarch64__)
+# if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)
+#  define HWHASH_ARM 1
+#  include <arm_neon.h>
+#  if !defined(__APPLE__)
+#   include <sys/auxv.h>
+#   include <asm/hwcap.h>
+#  endif
+# endif
+#endif
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// Standard constants
+//
+static const uint32_t sha1Initial[5] = {
+	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const uint32_t sha256Initial[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint32_t sha1K[4] = {
+	0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
+};
+
+static const uint32_t sha256K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+
+#if HWHASH_X86
+
+//
+// Intel SHA extensions.
+// The message schedule is kept in a ring of four vectors w[0..3]; each group runs
+// four rounds. The groups are unrolled by macro so that the ring indices and the
+// round function selector (which must be an immediate) are constants.
+//
+#define SHA1_GROUP(g, f) \
+	if (g >= 4) w[(g) & 3] = _mm_sha1msg2_epu32( \
+		_mm_xor_si128(_mm_sha1msg1_epu32(w[(g) & 3], w[((g) + 1) & 3]), w[((g) + 2) & 3]), \
+		w[((g) + 3) & 3]); \
+	e = _mm_sha1nexte_epu32(prev, w[(g) & 3]); \
+	prev = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1CompressX86(uint32_t *state, const uint8_t *data, size_t count)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; count > 0; count--, data += 64) {
+		__m128i w[4], e, prev;
+		for (unsigned n = 0; n < 4; n++)
+			w[n] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * n)), mask);
+		const __m128i abcdSave = abcd;
+		
+		// group 0 seeds e from the saved state instead of sha1nexte
+		e = _mm_add_epi32(e0, w[0]);
+		prev = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+		SHA1_GROUP(1, 0) SHA1_GROUP(2, 0) SHA1_GROUP(3, 0) SHA1_GROUP(4, 0)
+		SHA1_GROUP(5, 1) SHA1_GROUP(6, 1) SHA1_GROUP(7, 1) SHA1_GROUP(8, 1) SHA1_GROUP(9, 1)
+		SHA1_GROUP(10, 2) SHA1_GROUP(11, 2) SHA1_GROUP(12, 2) SHA1_GROUP(13, 2) SHA1_GROUP(14, 2)
+		SHA1_GROUP(15, 3) SHA1_GROUP(16, 3) SHA1_GROUP(17, 3) SHA1_GROUP(18, 3) SHA1_GROUP(19, 3)
+
+		e0 = _mm_sha1nexte_epu32(prev, e0);
+		abcd = _mm_add_epi32(abcd, abcdSave);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_GROUP
+
+#define SHA256_GROUP(g) \
+	if (g >= 4) w[(g) & 3] = _mm_sha256msg2_epu32( \
+		_mm_add_epi32(_mm_sha256msg1_epu32(w[(g) & 3], w[((g) + 1) & 3]), \
+			_mm_alignr_epi8(w[((g) + 3) & 3], w[((g) + 2) & 3], 4)), \
+		w[((g) + 3) & 3]); \
+	msg = _mm_add_epi32(w[(g) & 3], _mm_loadu_si128((const __m128i *)&sha256K[4 * (g)])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256CompressX86(uint32_t *state, const uint8_t *data, size_t count)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// rearrange state into the ABEF/CDGH layout the instructions want
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);	// CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);		// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);			// CDGH
+
+	for (; count > 0; count--, data += 64) {
+		const __m128i abefSave = state0;
+		const __m128i cdghSave = state1;
+		__m128i w[4], msg;
+		for (unsigned n = 0; n < 4; n++)
+			w[n] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * n)), mask);
+		SHA256_GROUP(0) SHA256_GROUP(1) SHA256_GROUP(2) SHA256_GROUP(3)
+		SHA256_GROUP(4) SHA256_GROUP(5) SHA256_GROUP(6) SHA256_GROUP(7)
+		SHA256_GROUP(8) SHA256_GROUP(9) SHA256_GROUP(10) SHA256_GROUP(11)
+		SHA256_GROUP(12) SHA256_GROUP(13) SHA256_GROUP(14) SHA256_GROUP(15)
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);					// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);				// DCHG
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));	// DCBA
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));	// HGFE
+}
+
+#undef SHA256_GROUP
+
+static bool haveX86SHA()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return false;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & (1 << 29);		// SHA extensions
+}
+
+#endif //HWHASH_X86
+
+
+#if HWHASH_ARM
+
+//
+// ARMv8 cryptographic extensions.
+// Same structure as above. The ARM instructions select the SHA-1 round function
+// by opcode, and leave adding the round constants to us.
+//
+#define SHA1_GROUP(g, op) \
+	if (g >= 4) w[(g) & 3] = vsha1su1q_u32( \
+		vsha1su0q_u32(w[(g) & 3], w[((g) + 1) & 3], w[((g) + 2) & 3]), w[((g) + 3) & 3]); \
+	msg = vaddq_u32(w[(g) & 3], vdupq_n_u32(sha1K[(g) / 5])); \
+	next = vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+	abcd = op(abcd, e, msg); \
+	e = next;
+
+static void sha1CompressARM(uint32_t *state, const uint8_t *data, size_t count)
+{
+	uint32x4_t abcd = vld1q_u32(state);
+	uint32_t e0 = state[4];
+
+	for (; count > 0; count--, data += 64) {
+		const uint32x4_t abcdSave = abcd;
+		uint32x4_t w[4], msg;
+		uint32_t e = e0, next;
+		for (unsigned n = 0; n < 4; n++)
+			w[n] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * n)));
+		SHA1_GROUP(0, vsha1cq_u32) SHA1_GROUP(1, vsha1cq_u32) SHA1_GROUP(2, vsha1cq_u32)
+		SHA1_GROUP(3, vsha1cq_u32) SHA1_GROUP(4, vsha1cq_u32)
+		SHA1_GROUP(5, vsha1pq_u32) SHA1_GROUP(6, vsha1pq_u32) SHA1_GROUP(7, vsha1pq_u32)
+		SHA1_GROUP(8, vsha1pq_u32) SHA1_GROUP(9, vsha1pq_u32)
+		SHA1_GROUP(10, vsha1mq_u32) SHA1_GROUP(11, vsha1mq_u32) SHA1_GROUP(12, vsha1mq_u32)
+		SHA1_GROUP(13, vsha1mq_u32) SHA1_GROUP(14, vsha1mq_u32)
+		SHA1_GROUP(15, vsha1pq_u32) SHA1_GROUP(16, vsha1pq_u32) SHA1_GROUP(17, vsha1pq_u32)
+		SHA1_GROUP(18, vsha1pq_u32) SHA1_GROUP(19, vsha1pq_u32)
+		e0 += e;
+		abcd = vaddq_u32(abcd, abcdSave);
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+
+#undef SHA1_GROUP
+
+#define SHA256_GROUP(g) \
+	if (g >= 4) w[(g) & 3] = vsha256su1q_u32( \
+		vsha256su0q_u32(w[(g) & 3], w[((g) + 1) & 3]), w[((g) + 2) & 3], w[((g) + 3) & 3]); \
+	msg = vaddq_u32(w[(g) & 3], vld1q_u32(&sha256K[4 * (g)])); \
+	save = state0; \
+	state0 = vsha256hq_u32(state0, state1, msg); \
+	state1 = vsha256h2q_u32(state1, save, msg);
+
+static void sha256CompressARM(uint32_t *state, const uint8_t *data, size_t count)
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+
+	for (; count > 0; count--, data += 64) {
+		const uint32x4_t abefSave = state0;
+		const uint32x4_t cdghSave = state1;
+		uint32x4_t w[4], msg, save;
+		for (unsigned n = 0; n < 4; n++)
+			w[n] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * n)));
+		SHA256_GROUP(0) SHA256_GROUP(1) SHA256_GROUP(2) SHA256_GROUP(3)
+		SHA256_GROUP(4) SHA256_GROUP(5) SHA256_GROUP(6) SHA256_GROUP(7)
+		SHA256_GROUP(8) SHA256_GROUP(9) SHA256_GROUP(10) SHA256_GROUP(11)
+		SHA256_GROUP(12) SHA256_GROUP(13) SHA256_GROUP(14) SHA256_GROUP(15)
+		state0 = vaddq_u32(state0, abefSave);
+		state1 = vaddq_u32(state1, cdghSave);
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+#undef SHA256_GROUP
+
+static bool haveARMSHA()
+{
+#if defined(__APPLE__)
+	return true;		// all Apple arm64 processors implement the crypto extensions
+#else
+	unsigned long caps = getauxval(AT_HWCAP);
+	return (caps & HWCAP_SHA1) && (caps & HWCAP_SHA2);
+#endif
+}
+
+#endif //HWHASH_ARM
+
+
+//
+// The engine registry.
+// Probing and self-testing happens once, on first use. An engine that fails
+// its known-answer test is not used (and we fall back to the generic code).
+//
+class Engines {
+public:
+	Engines();
+
+	const AcceleratedHash::Engine *find(uint32_t hashType) const;
+
+private:
+	bool selfTest(const AcceleratedHash::Engine &engine);
+
+	const AcceleratedHash::Engine *mSHA1;
+	const AcceleratedHash::Engine *mSHA256;
+};
+
+static ModuleNexus<Engines> engines;
+
+
+#if HWHASH_X86
+static const AcceleratedHash::Engine sha1Engine =
+	{ "sha1-x86", kSecCodeSignatureHashSHA1, sha1CompressX86, 5, sha1Initial };
+static const AcceleratedHash::Engine sha256Engine =
+	{ "sha256-x86", kSecCodeSignatureHashSHA256, sha256CompressX86, 8, sha256Initial };
+static bool haveEngines() { return haveX86SHA(); }
+#elif HWHASH_ARM
+static const AcceleratedHash::Engine sha1Engine =
+	{ "sha1-arm", kSecCodeSignatureHashSHA1, sha1CompressARM, 5, sha1Initial };
+static const AcceleratedHash::Engine sha256Engine =
+	{ "sha256-arm", kSecCodeSignatureHashSHA256, sha256CompressARM, 8, sha256Initial };
+static bool haveEngines() { return haveARMSHA(); }
+#endif
+
+Engines::Engines()
+	: mSHA1(NULL), mSHA256(NULL)
+{
+#if HWHASH_X86 || HWHASH_ARM
+	if (getenv("CODESIGN_NO_HWHASH"))		// debugging escape hatch
+		return;
+	if (haveEngines()) {
+		if (selfTest(sha1Engine))
+			mSHA1 = &sha1Engine;
+		if (selfTest(sha256Engine))
+			mSHA256 = &sha256Engine;
+	}
+#endif
+}
+
+const AcceleratedHash::Engine *Engines::find(uint32_t hashType) const
+{
+	switch (hashType) {
+	case kSecCodeSignatureHashSHA1:
+		return mSHA1;
+	case kSecCodeSignatureHashSHA256:
+		return mSHA256;
+	default:
+		return NULL;
+	}
+}
+
+
+//
+// Known-answer tests.
+// These are the FIPS 180-2 sample vectors "abc" (one block) and the 56-byte
+// "abcdbcde..." string (which pads into a second block), fed in uneven pieces
+// to exercise buffering.
+//
+static const char kat1[] = "abc";
+static const char kat2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+static const uint8_t sha1Answers[2][20] = {
+	{ 0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+	  0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d },
+	{ 0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+	  0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1 },
+};
+
+static const uint8_t sha256Answers[2][32] = {
+	{ 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+	  0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad },
+	{ 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+	  0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 },
+};
+
+static bool knownAnswer(const AcceleratedHash::Engine &engine, const char *text, size_t split, const uint8_t *answer)
+{
+	AcceleratedHash hash(engine);
+	size_t length = strlen(text);
+	hash.update(text, split);
+	hash.update(text + split, length - split);
+	Hashing::Byte digest[32];
+	hash.finish(digest);
+	return memcmp(digest, answer, hash.digestLength()) == 0;
+}
+
+bool Engines::selfTest(const AcceleratedHash::Engine &engine)
+{
+	const uint8_t *answer1 = sha256Answers[0], *answer2 = sha256Answers[1];
+	if (engine.hashType == kSecCodeSignatureHashSHA1) {
+		answer1 = sha1Answers[0];
+		answer2 = sha1Answers[1];
+	}
+	if (knownAnswer(engine, kat1, 0, answer1) && knownAnswer(engine, kat2, 7, answer2)) {
+		secdebug("hwhash", "engine %s enabled", engine.name);
+		return true;
+	}
+	secdebug("hwhash", "engine %s FAILED self-test; not used", engine.name);
+	return false;
+}
+
+
+//
+// Engine lookup
+//
+DynamicHash *AcceleratedHash::make(uint32_t hashType)
+{
+	if (const Engine *engine = engines().find(hashType))
+		return new AcceleratedHash(*engine);
+	return NULL;
+}
+
+const char *AcceleratedHash::engineName(uint32_t hashType)
+{
+	if (const Engine *engine = engines().find(hashType))
+		return engine->name;
+	return NULL;
+}
+
+
+//
+// FastSHA1
+//
+FastSHA1::FastSHA1()
+	: mHash(AcceleratedHash::make(kSecCodeSignatureHashSHA1))
+{
+	if (!mHash.get())
+		mHash.reset(new CCHashInstance(kCCDigestSHA1));
+}
+
+
+//
+// The generic Merkle-Damgard framing around the compression functions
+//
+AcceleratedHash::AcceleratedHash(const Engine &engine)
+	: mEngine(engine), mBuffered(0), mTotal(0)
+{
+	memcpy(mState, engine.initialState, engine.stateWords * sizeof(uint32_t));
+}
+
+void AcceleratedHash::update(const void *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	mTotal += length;
+	if (mBuffered) {
+		size_t fill = std::min(length, blockSize - mBuffered);
+		memcpy(mBuffer + mBuffered, p, fill);
+		mBuffered += fill;
+		p += fill;
+		length -= fill;
+		if (mBuffered < blockSize)
+			return;
+		mEngine.compress(mState, mBuffer, 1);
+		mBuffered = 0;
+	}
+	if (size_t blocks = length / blockSize) {
+		mEngine.compress(mState, p, blocks);
+		p += blocks * blockSize;
+		length -= blocks * blockSize;
+	}
+	if (length) {
+		memcpy(mBuffer, p, length);
+		mBuffered = length;
+	}
+}
+
+void AcceleratedHash::finish(Byte *digest)
+{
+	uint64_t bits = mTotal * 8;
+	mBuffer[mBuffered++] = 0x80;
+	if (mBuffered > blockSize - 8) {		// no room for the length; spill into another block
+		memset(mBuffer + mBuffered, 0, blockSize - mBuffered);
+		mEngine.compress(mState, mBuffer, 1);
+		mBuffered = 0;
+	}
+	memset(mBuffer + mBuffered, 0, blockSize - 8 - mBuffered);
+	for (unsigned n = 0; n < 8; n++)
+		mBuffer[blockSize - 1 - n] = uint8_t(bits >> (8 * n));
+	mEngine.compress(mState, mBuffer, 1);
+	for (size_t n = 0; n < mEngine.stateWords; n++) {
+		digest[4*n] = uint8_t(mState[n] >> 24);
+		digest[4*n+1] = uint8_t(mState[n] >> 16);
+		digest[4*n+2] = uint8_t(mState[n] >> 8);
+		digest[4*n+3] = uint8_t(mState[n]);
+	}
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
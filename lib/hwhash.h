@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// hwhash - digest engines using processor SHA instructions
+//
+// Some processors can run the SHA-1 and SHA-256 compression functions directly
+// (the Intel SHA extensions and the ARMv8 cryptographic extensions). This module
+// wraps those instructions into DynamicHash objects. Which engine (if any) is used
+// is decided once per process by probing the processor; each engine must also pass
+// a known-answer test before it is put into service.
+//
+// Use CodeDirectory::hashFor() to get digests; it consults us first and falls
+// back to the generic (CommonCrypto) implementation if we have nothing to offer.
+//
+#ifndef _H_HWHASH
+#define _H_HWHASH
+
+#include <security_utilities/hashing.h>
+#include <Security/CSCommonPriv.h>
+#include <memory>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// An AcceleratedHash implements a 64-byte-block Merkle-Damgard digest
+// (SHA-1 or SHA-256) over a hardware compression function.
+//
+class AcceleratedHash : public DynamicHash {
+public:
+	typedef void Compressor(uint32_t *state, const uint8_t *blocks, size_t count);
+
+	struct Engine {
+		const char *name;					// for debug logging
+		uint32_t hashType;					// kSecCodeSignatureHash* code
+		Compressor *compress;				// process whole blocks
+		size_t stateWords;					// number of 32-bit state words
+		const uint32_t *initialState;		// starting state
+	};
+
+	AcceleratedHash(const Engine &engine);
+
+	size_t digestLength() const { return mEngine.stateWords * sizeof(uint32_t); }
+	void update(const void *data, size_t length);
+	void finish(Byte *digest);
+
+	static DynamicHash *make(uint32_t hashType);	// NULL if no working engine for hashType
+	static const char *engineName(uint32_t hashType); // NULL if none
+
+private:
+	static const size_t blockSize = 64;
+
+	const Engine &mEngine;
+	uint32_t mState[8];						// chaining state (up to SHA-256 size)
+	uint8_t mBuffer[blockSize];				// partial block
+	size_t mBuffered;						// bytes in mBuffer
+	uint64_t mTotal;						// total bytes digested
+};
+
+
+//
+// A drop-in for the generic SHA1 class that uses an accelerated engine
+// where one is available.
+//
+class FastSHA1 {
+public:
+	FastSHA1();
+	
+	void operator () (const void *data, size_t length) { mHash->update(data, length); }
+	void update(const void *data, size_t length) { mHash->update(data, length); }
+	void finish(SHA1::Digest digest) { mHash->finish(digest); }
+
+private:
+	std::auto_ptr<DynamicHash> mHash;
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_HWHASH
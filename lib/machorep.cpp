@@ -27,6 +27,7 @@
 #include "machorep.h"
 #include "StaticCode.h"
 #include "reqmaker.h"
+#include "hwhash.h"
 
 
 namespace Security {
@@ -128,7 +129,7 @@ CFDataRef MachORep::identificationFor(MachO *macho)
 	}
 	
 	// otherwise, use the SHA-1 hash of the entire load command area
-	SHA1 hash;
+	FastSHA1 hash;
 	hash(&macho->header(), sizeof(mach_header));
 	hash(macho->loadCommands(), macho->commandLength());
 	SHA1::Digest digest;
@@ -23,6 +23,7 @@
 #include "cs.h"
 #include "policydb.h"
 #include "policyengine.h"
+#include "policysnapshot.h"
 #include <Security/CodeSigning.h>
 #include <security_utilities/cfutilities.h>
 #include <security_utilities/cfmunge.h>
@@ -31,10 +32,13 @@
 #include <security_utilities/simpleprefs.h>
 #include <security_utilities/logging.h>
 #include "csdatabase.h"
+#include "reqmaker.h"
 
 #include <dispatch/dispatch.h>
+#include <libkern/OSAtomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <ctype.h>
 #include <notify.h>
 
 namespace Security {
@@ -99,7 +103,7 @@ CFStringRef typeNameFor(AuthorityType type)
 //
 PolicyDatabase::PolicyDatabase(const char *path, int flags)
 	: SQLite::Database(path ? path : dbPath(), flags),
-	  mLastExplicitCheck(0)
+	  mPath(path ? path : dbPath()), mLastExplicitCheck(0), mRequirementBlobs(-1)
 {
 	// sqlite3 doesn't do foreign key support by default, have to turn this on per connection
 	SQLite::Statement foreign(*this, "PRAGMA foreign_keys = true");
@@ -108,10 +112,14 @@ PolicyDatabase::PolicyDatabase(const char *path, int flags)
 	// Try upgrade processing if we may be open for write.
 	// Ignore any errors (we may have been downgraded to read-only)
 	// and try again later.
+	// Both steps start with a quick check, so opening an up-to-date database is cheap.
 	if (openFlags() & SQLITE_OPEN_READWRITE)
 		try {
-			upgradeDatabase();
-			installExplicitSet(gkeAuthFile, gkeSigsFile);
+			if (currentSchemaLevel() < schemaLevel) {
+				upgradeDatabase();
+				publishSnapshot();
+			}
+			scheduleExplicitSet(gkeAuthFile, gkeSigsFile);
 		} catch(...) {
 		}
 }
@@ -123,19 +131,14 @@ PolicyDatabase::~PolicyDatabase()
 //
 // Quick-check the cache for a match.
 // Return true on a cache hit, false on failure to confirm a hit for any reason.
+// The code-side work is shared with PolicySnapshot::checkCache.
 //
 bool PolicyDatabase::checkCache(CFURLRef path, AuthorityType type, CFMutableDictionaryRef result)
 {
-	// we currently don't use the cache for anything but execution rules
-	if (type != kAuthorityExecute)
-		return false;
-	
 	CFRef<SecStaticCodeRef> code;
-	MacOSError::check(SecStaticCodeCreateWithPath(path, kSecCSDefaultFlags, &code.aref()));
-	if (SecStaticCodeCheckValidity(code, kSecCSBasicValidateOnly, NULL) != noErr)
-		return false;	// quick pass - any error is a cache miss
 	CFRef<CFDictionaryRef> info;
-	MacOSError::check(SecCodeCopySigningInformation(code, kSecCSDefaultFlags, &info.aref()));
+	if (!cacheCandidate(path, type, code, info))
+		return false;
 	CFDataRef cdHash = CFDataRef(CFDictionaryGetValue(info, kSecCodeInfoUnique));
 	
 	// check the cache table for a fast match
@@ -145,23 +148,156 @@ bool PolicyDatabase::checkCache(CFURLRef path, AuthorityType type, CFMutableDict
 	cached.bind(":type").integer(type);
 	cached.bind(":hash") = cdHash;
 	if (cached.nextRow()) {
-		bool allow = int(cached[0]);
-		const char *label = cached[1];
-		SQLite::int64 auth = cached[2];
-		SYSPOLICY_ASSESS_CACHE_HIT();
+		cacheHit(code, info, int(cached[0]), cached[1], cached[2], result);
+		return true;
+	}
+	return false;
+}
+
+bool PolicyDatabase::cacheCandidate(CFURLRef path, AuthorityType type,
+	CFRef<SecStaticCodeRef> &code, CFRef<CFDictionaryRef> &info)
+{
+	// we currently don't use the cache for anything but execution rules
+	if (type != kAuthorityExecute)
+		return false;
+	
+	MacOSError::check(SecStaticCodeCreateWithPath(path, kSecCSDefaultFlags, &code.aref()));
+	if (SecStaticCodeCheckValidity(code, kSecCSBasicValidateOnly, NULL) != noErr)
+		return false;	// quick pass - any error is a cache miss
+	MacOSError::check(SecCodeCopySigningInformation(code, kSecCSDefaultFlags, &info.aref()));
+	return true;
+}
+
+void PolicyDatabase::cacheHit(SecStaticCodeRef code, CFDictionaryRef info, bool allow,
+	const char *label, SQLite::int64 auth, CFMutableDictionaryRef result)
+{
+	SYSPOLICY_ASSESS_CACHE_HIT();
 
-		// If its allowed, lets do a full validation unless if
-		// we are overriding the assessement, since that force
-		// the verdict to 'pass' at the end
+	// If its allowed, lets do a full validation unless if
+	// we are overriding the assessement, since that force
+	// the verdict to 'pass' at the end
 
-		if (allow && !overrideAssessment())
-		    MacOSError::check(SecStaticCodeCheckValidity(code, kSecCSDefaultFlags, NULL));
+	if (allow && !overrideAssessment())
+	    MacOSError::check(SecStaticCodeCheckValidity(code, kSecCSDefaultFlags, NULL));
 
-		cfadd(result, "{%O=%B}", kSecAssessmentAssessmentVerdict, allow);
-		PolicyEngine::addAuthority(result, label, auth, kCFBooleanTrue);
-		return true;
+	cfadd(result, "{%O=%B}", kSecAssessmentAssessmentVerdict, allow);
+	PolicyEngine::addAuthority(result, label, auth, kCFBooleanTrue);
+	if (CFStringRef identifier = CFStringRef(CFDictionaryGetValue(info, kSecCodeInfoIdentifier)))
+		CFDictionaryAddValue(result, kSecAssessmentAssessmentIdentifier, identifier);
+}
+
+
+//
+// The unexpired rules of one type, in evaluation order (highest priority first).
+// A current snapshot has them ready; otherwise we ask the database.
+//
+void PolicyDatabase::scanRules(AuthorityType type, AuthorityRules &rules)
+{
+	if (RefPointer<PolicySnapshot> snapshot = PolicySnapshot::current(mPath.c_str())) {
+		snapshot->rules(type, rules);
+		return;
+	}
+	queryRules(type, rules);
+}
+
+void PolicyDatabase::queryRules(AuthorityType type, AuthorityRules &rules)
+{
+	std::string scan = std::string("SELECT allow, requirement, id, label, expires, flags, disabled, ")
+		+ (hasRequirementBlobs() ? "reqblob" : "NULL") + " FROM scan_authority"
+		" WHERE type = :type"
+		" ORDER BY priority DESC;";
+	SQLite::Statement query(*this, scan.c_str());
+	query.bind(":type").integer(type);
+	while (query.nextRow()) {
+		AuthorityRule rule;
+		rule.allow = int(query[0]);
+		rule.requirement = (const char *)query[1];
+		rule.id = query[2];
+		if (const char *label = query[3]) {
+			rule.hasLabel = true;
+			rule.label = label;
+		}
+		rule.expires = query[4];
+		rule.flags = query[5];
+		rule.disabled = query[6];
+		rule.reqblob.take(query[7].data());
+		rules.push_back(rule);
+	}
+}
+
+
+//
+// Policy snapshots.
+// After each change, the writer publishes the rules and the object cache in a
+// PolicySnapshot file, so assessment clients can use them without opening the database.
+// Everything is read in one transaction, and the change counter while we still
+// hold its read lock, so the snapshot is exactly the state the counter names.
+// Failure to publish is harmless: readers see a stale (or no) snapshot and use the database.
+//
+void PolicyDatabase::publishSnapshot()
+{
+	try {
+		PolicySnapshotBlob::Maker maker;
+		SQLite::Transaction xact(*this, SQLite::Transaction::deferred, "snapshot");
+		
+		static const AuthorityType types[] = { kAuthorityExecute, kAuthorityInstall, kAuthorityOpenDoc };
+		for (unsigned n = 0; n < sizeof(types) / sizeof(types[0]); n++) {
+			AuthorityRules rules;
+			queryRules(types[n], rules);
+			for (AuthorityRules::const_iterator it = rules.begin(); it != rules.end(); ++it)
+				maker.rule(*it, types[n]);
+		}
+		
+		SQLite::Statement objects(*this, "SELECT object.type, object.hash, object.allow, object.expires, authority.id, authority.label"
+			" FROM object, authority"
+			" WHERE object.authority = authority.id AND authority.disabled = 0 AND JULIANDAY('now') < object.expires"
+			" ORDER BY object.type, object.hash;");
+		while (objects.nextRow()) {
+			CFRef<CFDataRef> hash = objects[1].data();
+			maker.object(AuthorityType(int(objects[0])), hash, int(objects[2]), objects[3], objects[4], objects[5]);
+		}
+		
+		uint32_t counter;
+		if (!PolicySnapshot::changeCounter(mPath.c_str(), counter))
+			return;
+		xact.commit();
+		PolicySnapshot::publish(mPath.c_str(), maker, counter);
+	} catch (...) {
+		secdebug("policysnapshot", "failed to publish snapshot of %s", mPath.c_str());
 	}
-	return false;
+}
+
+
+//
+// Publish a snapshot in the background, after a short delay.
+// Cached outcomes are recorded in bursts; there's no need to publish after each one.
+// At most one publication is pending in a process, and it runs on its own connection
+// to the database. Until it's done, clients find the snapshot stale and use the database.
+//
+static volatile int32_t snapshotPending = 0;
+
+void PolicyDatabase::scheduleSnapshot()
+{
+	if (!OSAtomicCompareAndSwap32Barrier(0, 1, &snapshotPending))
+		return;		// one is coming; it'll include our change
+	
+	static dispatch_once_t once;
+	static dispatch_queue_t queue;
+	dispatch_once(&once, ^{
+		queue = dispatch_queue_create("com.apple.SecAssessment.snapshot", NULL);
+		dispatch_set_target_queue(queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+	});
+	
+	std::string dbpath = mPath;
+	dispatch_after(dispatch_time(DISPATCH_TIME_NOW, int64_t(snapshotDelay) * NSEC_PER_SEC), queue, ^{
+		OSAtomicCompareAndSwap32Barrier(1, 0, &snapshotPending);	// later changes need another
+		try {
+			PolicyDatabase publisher(dbpath.c_str(), SQLITE_OPEN_READONLY);
+			publisher.publishSnapshot();
+		} catch (...) {
+			secdebug("policysnapshot", "background snapshot failed");
+		}
+	});
 }
 
 
@@ -236,6 +372,12 @@ void PolicyDatabase::simpleFeature(const char *feature, const char *sql)
 }
 
 
+int PolicyDatabase::currentSchemaLevel()
+{
+	SQLite::Statement version(*this, "PRAGMA user_version");
+	return version.nextRow() ? int(version[0]) : 0;
+}
+
 void PolicyDatabase::upgradeDatabase()
 {
 	simpleFeature("bookmarkhints",
@@ -258,6 +400,98 @@ void PolicyDatabase::upgradeDatabase()
 		updates.execute();
 		update.commit();
 	}
+	
+	if (!hasFeature("requirementblobs")) {
+		SQLite::Transaction update(*this);
+		addFeature("requirementblobs", "upgraded", "upgraded");
+		SQLite::Statement column(*this,
+			"ALTER TABLE authority ADD COLUMN reqblob BLOB NULL");	// compiled form of requirement
+		column.execute();
+		SQLite::Statement trigger(*this,
+			"CREATE TRIGGER authority_requirement AFTER UPDATE OF requirement ON authority"
+			" BEGIN"
+			"  UPDATE authority SET reqblob = NULL WHERE id = old.id;"	// stale now
+			" END");
+		trigger.execute();
+		compileRequirements();
+		update.commit();
+		mRequirementBlobs = true;
+	}
+	
+	// all done; future opens can skip this
+	char setLevel[40];
+	snprintf(setLevel, sizeof(setLevel), "PRAGMA user_version = %d", schemaLevel);
+	SQLite::Statement level(*this, setLevel);
+	level.execute();
+}
+
+
+//
+// Compiled requirements.
+// The authority table keeps the binary form of each rule's requirement in the reqblob
+// column, so assessments don't have to run the requirement parser. The text in the
+// requirement column remains authoritative; if it is changed, a trigger clears reqblob,
+// and readers fall back to compiling the text.
+//
+bool PolicyDatabase::hasRequirementBlobs()
+{
+	if (mRequirementBlobs < 0)
+		mRequirementBlobs = hasFeature("requirementblobs");
+	return mRequirementBlobs;
+}
+
+CFDataRef PolicyDatabase::compileRequirement(const char *text)
+{
+	CFRef<SecRequirementRef> requirement;
+	CFDataRef data;
+	if (text
+			&& SecRequirementCreateWithString(CFTempString(text), kSecCSDefaultFlags, &requirement.aref()) == noErr
+			&& SecRequirementCopyData(requirement, kSecCSDefaultFlags, &data) == noErr)
+		return data;
+	return NULL;
+}
+
+void PolicyDatabase::compileRequirements()
+{
+	std::vector<std::pair<SQLite::int64, std::string> > rules;
+	SQLite::Statement scan(*this,
+		"SELECT id, requirement FROM authority WHERE requirement IS NOT NULL AND reqblob IS NULL");
+	while (scan.nextRow())
+		rules.push_back(std::make_pair(SQLite::int64(scan[0]), std::string((const char *)scan[1])));
+	
+	SQLite::Statement store(*this, "UPDATE authority SET reqblob = :blob WHERE id = :id");
+	for (std::vector<std::pair<SQLite::int64, std::string> >::const_iterator it = rules.begin(); it != rules.end(); ++it)
+		if (CFRef<CFDataRef> blob = compileRequirement(it->second.c_str())) {
+			store.reset();
+			store.bind(":blob") = blob.get();
+			store.bind(":id").integer(it->first);
+			store.execute();
+		}
+	secdebug("gkupgrade", "%d requirement(s) compiled", int(rules.size()));
+}
+
+
+//
+// A GKE rule's requirement is a plain cdhash check. We make its compiled form
+// ourselves rather than running the parser for each of them.
+//
+static CFDataRef cdhashRequirement(const std::string &hex)
+{
+	SHA1::Digest digest;
+	if (hex.size() != 2 * sizeof(digest))
+		return NULL;
+	for (size_t n = 0; n < sizeof(digest); n++) {
+		char byte[3] = { hex[2 * n], hex[2 * n + 1], 0 };
+		if (!isxdigit(byte[0]) || !isxdigit(byte[1]))
+			return NULL;
+		digest[n] = strtoul(byte, NULL, 16);
+	}
+	Requirement::Maker maker;
+	maker.cdhash(digest);
+	Requirement *req = maker.make();
+	CFDataRef data = makeCFData(req, req->length());
+	::free(req);
+	return data;
 }
 
 
@@ -265,6 +499,10 @@ void PolicyDatabase::upgradeDatabase()
 // Install Gatekeeper override (GKE) data.
 // The arguments are paths to the authority and signature files.
 //
+// We remember the size and modification time of the authority file we installed
+// (along with its uuid) as the "gkestamp" feature, so that explicitSetChanged()
+// can tell whether there's anything to do without reading the file.
+//
 void PolicyDatabase::installExplicitSet(const char *authfile, const char *sigfile)
 {
 	// only try this every gkeCheckInterval seconds
@@ -274,6 +512,9 @@ void PolicyDatabase::installExplicitSet(const char *authfile, const char *sigfil
 	mLastExplicitCheck = now;
 
 	try {
+		struct stat st;
+		if (::stat(authfile, &st))
+			return;		// no GKE data
 		if (CFRef<CFDataRef> authData = cfLoadFile(authfile)) {
 			CFDictionary auth(CFRef<CFDictionaryRef>(makeCFDictionaryFrom(authData)), errSecCSDbCorrupt);
 			CFDictionaryRef content = auth.get<CFDictionaryRef>(CFSTR("authority"));
@@ -286,8 +527,10 @@ void PolicyDatabase::installExplicitSet(const char *authfile, const char *sigfil
 			SQLite::Statement uuidQuery(*this, "SELECT value FROM feature WHERE name='gke'");
 			if (uuidQuery.nextRow())
 				dbUUID = (const char *)uuidQuery[0];
+			std::string stamp = explicitStamp(st) + authUUID;
 			if (dbUUID == authUUID) {
 				secdebug("gkupgrade", "gke.auth already present, ignoring");
+				addFeature("gkestamp", stamp.c_str(), "gke.auth file stamp");
 				return;
 			}
 			Syslog::notice("loading GKE %s (replacing %s)", authUUID.c_str(), dbUUID.empty() ? "nothing" : dbUUID.c_str());
@@ -318,21 +561,34 @@ void PolicyDatabase::installExplicitSet(const char *authfile, const char *sigfil
 			CFDictionaryRef values[count];
 			CFDictionaryGetKeysAndValues(content, (const void **)keys, (const void **)values);
 			
-			SQLite::Statement insert(*this, "INSERT INTO authority (type, allow, requirement, label, flags, remarks)"
-				" VALUES (:type, 1, :requirement, 'GKE', :flags, :path)");
+			bool blobs = hasRequirementBlobs();
+			SQLite::Statement insert(*this, blobs
+				? "INSERT INTO authority (type, allow, requirement, reqblob, label, flags, remarks)"
+				  " VALUES (:type, 1, :requirement, :reqblob, 'GKE', :flags, :path)"
+				: "INSERT INTO authority (type, allow, requirement, label, flags, remarks)"
+				  " VALUES (:type, 1, :requirement, 'GKE', :flags, :path)");
 			for (CFIndex n = 0; n < count; n++) {
 				CFDictionary info(values[n], errSecCSDbCorrupt);
+				std::string cdhash = cfString(info.get<CFStringRef>(CFSTR("cdhash")));
 				insert.reset();
 				insert.bind(":type") = cfString(info.get<CFStringRef>(CFSTR("type")));
 				insert.bind(":path") = cfString(info.get<CFStringRef>(CFSTR("path")));
-				insert.bind(":requirement") = "cdhash H\"" + cfString(info.get<CFStringRef>(CFSTR("cdhash"))) + "\"";
+				insert.bind(":requirement") = "cdhash H\"" + cdhash + "\"";
+				if (blobs) {
+					if (CFRef<CFDataRef> blob = cdhashRequirement(cdhash))
+						insert.bind(":reqblob") = blob.get();
+					else
+						insert.bind(":reqblob").null();		// readers will use the text
+				}
 				insert.bind(":flags") = kAuthorityFlagWhitelist;
 				insert();
 			}
 			
 			// update version and commit
 			addFeature("gke", authUUID.c_str(), "gke loaded");
+			addFeature("gkestamp", stamp.c_str(), "gke.auth file stamp");
 			loadAuth.commit();
+			publishSnapshot();
 		}
 	} catch (...) {
 		secdebug("gkupgrade", "exception during GKE upgrade");
@@ -340,6 +596,69 @@ void PolicyDatabase::installExplicitSet(const char *authfile, const char *sigfil
 }
 
 
+//
+// Quick check for new GKE data: one stat(2) and a look at the feature table.
+// The GKE data is current if the authority file has the size and modification time
+// it had when we last installed it, and the uuid we got from it then is still the
+// one the database says is installed. A missing authority file is never news.
+//
+std::string PolicyDatabase::explicitStamp(const struct stat &st)
+{
+	char stamp[80];
+	snprintf(stamp, sizeof(stamp), "%lld %ld.%09ld ",
+		(long long)st.st_size, (long)st.st_mtimespec.tv_sec, (long)st.st_mtimespec.tv_nsec);
+	return stamp;
+}
+
+bool PolicyDatabase::explicitSetChanged(const char *authfile)
+{
+	struct stat st;
+	if (::stat(authfile, &st))
+		return false;
+	std::string prefix = explicitStamp(st);
+	std::string stamp = featureLevel("gkestamp");
+	if (stamp.compare(0, prefix.size(), prefix) != 0)
+		return true;		// file changed (or never installed)
+	return stamp.substr(prefix.size()) != featureLevel("gke");	// database changed
+}
+
+
+//
+// Install changed GKE data in the background.
+// Loading GKE data means reading and parsing the authority file and rewriting part of
+// the authority table, which is more than we want to make the caller's first
+// assessment wait for. The load runs on its own connection to the database, so it
+// doesn't get in the way of ours. At most one such load is pending in a process.
+//
+static volatile int32_t explicitSetPending = 0;
+
+void PolicyDatabase::scheduleExplicitSet(const char *authfile, const char *sigfile)
+{
+	if (!explicitSetChanged(authfile))
+		return;
+	if (!OSAtomicCompareAndSwap32Barrier(0, 1, &explicitSetPending))
+		return;		// already on it (possibly we're that very load)
+	
+	static dispatch_once_t once;
+	static dispatch_queue_t queue;
+	dispatch_once(&once, ^{
+		queue = dispatch_queue_create("com.apple.SecAssessment.gke", NULL);
+		dispatch_set_target_queue(queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+	});
+	
+	std::string dbpath = mPath;
+	dispatch_async(queue, ^{
+		try {
+			PolicyDatabase loader(dbpath.c_str(), SQLITE_OPEN_READWRITE);
+			loader.installExplicitSet(authfile, sigfile);
+		} catch (...) {
+			secdebug("gkupgrade", "background GKE load failed");
+		}
+		OSAtomicCompareAndSwap32Barrier(1, 0, &explicitSetPending);
+	});
+}
+
+
 //
 // Check the override-enable master flag
 //
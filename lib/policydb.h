@@ -26,7 +26,12 @@
 #include <security_utilities/globalizer.h>
 #include <security_utilities/hashing.h>
 #include <security_utilities/sqlite++.h>
+#include <security_utilities/cfutilities.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <Security/SecStaticCode.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
 
 namespace Security {
 namespace CodeSigning {
@@ -43,6 +48,8 @@ static const char gkeAuthFile[] = "/var/db/gke.auth";
 static const char gkeSigsFile[] = "/var/db/gke.sigs";
 static const unsigned int gkeCheckInterval = 60;	// seconds
 
+static const int schemaLevel = 3;	// PRAGMA user_version of a fully upgraded database
+
 
 //
 // We use Julian dates in the database, because SQLite understands them well and they convert easily to/from CFAbsoluteTime
@@ -80,6 +87,26 @@ enum {
 };
 
 
+//
+// An authority rule, as assessment sees it
+//
+struct AuthorityRule {
+	AuthorityRule() : allow(false), id(0), hasLabel(false), expires(never), flags(0), disabled(0) { }
+	bool allow;						// allow (or deny)
+	std::string requirement;		// requirement text
+	CFRef<CFDataRef> reqblob;		// compiled requirement (NULL if none)
+	SQLite::int64 id;				// authority row id
+	bool hasLabel;					// label is set
+	std::string label;				// label text
+	double expires;					// expiration (Julian date)
+	SQLite::int64 flags;			// authority flags
+	SQLite::int64 disabled;			// disable count (disabled if non-zero)
+	
+	const char *labelText() const { return hasLabel ? label.c_str() : NULL; }
+};
+typedef std::vector<AuthorityRule> AuthorityRules;
+
+
 //
 // Mapping/translation to/from API space
 //
@@ -101,6 +128,15 @@ public:
 	
 public:
 	bool checkCache(CFURLRef path, AuthorityType type, CFMutableDictionaryRef result);
+	static bool cacheCandidate(CFURLRef path, AuthorityType type,
+		CFRef<SecStaticCodeRef> &code, CFRef<CFDictionaryRef> &info);	// worth looking up?
+	static void cacheHit(SecStaticCodeRef code, CFDictionaryRef info, bool allow,
+		const char *label, SQLite::int64 authority, CFMutableDictionaryRef result);
+
+	void scanRules(AuthorityType type, AuthorityRules &rules);	// in evaluation order
+	
+	void publishSnapshot();			// publish a PolicySnapshot of the current state
+	void scheduleSnapshot();		// ... soon, in the background
 
 public:
 	void purgeAuthority();
@@ -108,6 +144,7 @@ public:
 	void purgeObjects(double priority);//
 
 	void upgradeDatabase();
+	int currentSchemaLevel();
 	std::string featureLevel(const char *feature);
 	bool hasFeature(const char *feature) { return !featureLevel(feature).empty(); }
 	void addFeature(const char *feature, const char *value, const char *remarks);
@@ -115,9 +152,23 @@ public:
 	void simpleFeature(const char *feature, void (^perform)());
 
 	void installExplicitSet(const char *auth, const char *sigs);
+	
+	bool hasRequirementBlobs();		// authority table has compiled requirements (reqblob)
+	static CFDataRef compileRequirement(const char *text);	// NULL if it won't
+	bool explicitSetChanged(const char *auth);
+	void scheduleExplicitSet(const char *auth, const char *sigs);
+	
+	static const unsigned int snapshotDelay = 1;	// seconds to gather changes before publishing
+
+private:
+	static std::string explicitStamp(const struct stat &st);
+	void queryRules(AuthorityType type, AuthorityRules &rules);	// scanRules, from the database
+	void compileRequirements();
 
 private:
+	std::string mPath;				// database file path
 	time_t mLastExplicitCheck;
+	int mRequirementBlobs;			// hasRequirementBlobs() (-1 => not yet known)
 };
 
 
@@ -27,6 +27,7 @@
 #include <security_utilities/cfmunge.h>
 #include <Security/Security.h>
 #include <Security/SecCodePriv.h>
+#include <Security/SecStaticCodePriv.h>
 #include <Security/SecRequirementPriv.h>
 #include <Security/SecPolicyPriv.h>
 #include <Security/SecTrustPriv.h>
@@ -97,6 +98,20 @@ void PolicyEngine::evaluate(CFURLRef path, AuthorityType type, SecAssessmentFlag
 }
 
 
+//
+// Make the SecRequirement for an authority rule.
+// The compiled form is used if the rule has a valid one; otherwise we compile the text.
+//
+static SecRequirementRef ruleRequirement(const char *text, CFDataRef blob)
+{
+	SecRequirementRef requirement;
+	if (blob && SecRequirementCreateWithData(blob, kSecCSDefaultFlags, &requirement) == noErr)
+		return requirement;
+	MacOSError::check(SecRequirementCreateWithString(CFTempString(text), kSecCSDefaultFlags, &requirement));
+	return requirement;
+}
+
+
 //
 // Executable code.
 // Read from disk, evaluate properly, cache as indicated. The whole thing, so far.
@@ -109,27 +124,26 @@ void PolicyEngine::evaluateCode(CFURLRef path, AuthorityType type, SecAssessment
 	
 	CFRef<SecStaticCodeRef> code;
 	MacOSError::check(SecStaticCodeCreateWithPath(path, kSecCSDefaultFlags, &code.aref()));
+	noteIdentifier(code, result);
 	
-	const SecCSFlags validationFlags = kSecCSEnforceRevocationChecks;
+	// we only need a verdict here, not a list of everything that's wrong
+	const SecCSFlags validationFlags = kSecCSEnforceRevocationChecks | kSecCSFailFast;
 
-	SQLite::Statement query(*this,
-		"SELECT allow, requirement, id, label, expires, flags, disabled FROM scan_authority"
-		" WHERE type = :type"
-		" ORDER BY priority DESC;");
-	query.bind(":type").integer(type);
+	AuthorityRules rules;
+	scanRules(type, rules);
 	SQLite3::int64 latentID = 0;		// first (highest priority) disabled matching ID
 	std::string latentLabel;			// ... and associated label, if any
-	while (query.nextRow()) {
-		bool allow = int(query[0]);
-		const char *reqString = query[1];
-		SQLite3::int64 id = query[2];
-		const char *label = query[3];
-		double expires = query[4];
-		sqlite3_int64 ruleFlags = query[5];
-		SQLite3::int64 disabled = query[6];
+	for (AuthorityRules::const_iterator rule = rules.begin(); rule != rules.end(); ++rule) {
+		bool allow = rule->allow;
+		const char *reqString = rule->requirement.c_str();
+		SQLite3::int64 id = rule->id;
+		const char *label = rule->labelText();
+		double expires = rule->expires;
+		sqlite3_int64 ruleFlags = rule->flags;
+		SQLite3::int64 disabled = rule->disabled;
+		CFDataRef reqBlob = rule->reqblob;
 		
-		CFRef<SecRequirementRef> requirement;
-		MacOSError::check(SecRequirementCreateWithString(CFTempString(reqString), kSecCSDefaultFlags, &requirement.aref()));
+		CFRef<SecRequirementRef> requirement = ruleRequirement(reqString, reqBlob);
 		OSStatus rc = SecStaticCodeCheckValidity(code, validationFlags, requirement);
 		
 		if (rc == errSecCSUnsigned && !overrideAssessment()) {
@@ -315,10 +329,11 @@ void PolicyEngine::evaluateInstall(CFURLRef path, SecAssessmentFlags flags, CFDi
 			}
 		}
 
-		SQLite::Statement query(*this,
-			"SELECT allow, requirement, id, label, flags, disabled FROM scan_authority"
+		std::string scan = std::string("SELECT allow, requirement, id, label, flags, disabled, ")
+			+ (hasRequirementBlobs() ? "reqblob" : "NULL") + " FROM scan_authority"
 			" WHERE type = :type"
-			" ORDER BY priority DESC;");
+			" ORDER BY priority DESC;";
+		SQLite::Statement query(*this, scan.c_str());
 		query.bind(":type").integer(type);
 		while (query.nextRow()) {
 			bool allow = int(query[0]);
@@ -327,9 +342,9 @@ void PolicyEngine::evaluateInstall(CFURLRef path, SecAssessmentFlags flags, CFDi
 			const char *label = query[3];
 			//sqlite_uint64 ruleFlags = query[4];
 			SQLite3::int64 disabled = query[5];
+			CFRef<CFDataRef> reqBlob = query[6].data();
 	
-			CFRef<SecRequirementRef> requirement;
-			MacOSError::check(SecRequirementCreateWithString(CFTempString(reqString), kSecCSDefaultFlags, &requirement.aref()));
+			CFRef<SecRequirementRef> requirement = ruleRequirement(reqString, reqBlob);
 			switch (OSStatus rc = SecRequirementEvaluate(requirement, chain, NULL, kSecCSDefaultFlags)) {
 			case noErr: // success
 				break;
@@ -459,6 +474,19 @@ void PolicyEngine::addAuthority(CFMutableDictionaryRef parent, const char *label
 	CFDictionaryAddValue(parent, kSecAssessmentAssessmentAuthority, auth);
 }
 
+//
+// Record the signing identifier of the code being assessed, for outcome tracing.
+// This is cheap (the CodeDirectory is needed for validation anyway) and optional;
+// unsigned or broken code simply has no identifier.
+//
+void PolicyEngine::noteIdentifier(SecStaticCodeRef code, CFMutableDictionaryRef result)
+{
+	CFRef<CFDictionaryRef> info;
+	if (SecCodeCopySigningInformation(code, kSecCSDefaultFlags, &info.aref()) == noErr)
+		if (CFStringRef identifier = CFStringRef(CFDictionaryGetValue(info, kSecCodeInfoIdentifier)))
+			CFDictionarySetValue(result, kSecAssessmentAssessmentIdentifier, identifier);
+}
+
 void PolicyEngine::addToAuthority(CFMutableDictionaryRef parent, CFStringRef key, CFTypeRef value)
 {
 	CFMutableDictionaryRef authority = CFMutableDictionaryRef(CFDictionaryGetValue(parent, kSecAssessmentAssessmentAuthority));
@@ -536,13 +564,20 @@ CFDictionaryRef PolicyEngine::add(CFTypeRef inTarget, AuthorityType type, SecAss
 
 	CFRef<CFStringRef> requirementText;
 	MacOSError::check(SecRequirementCopyString(target.as<SecRequirementRef>(), kSecCSDefaultFlags, &requirementText.aref()));
+	CFRef<CFDataRef> requirementData;
+	MacOSError::check(SecRequirementCopyData(target.as<SecRequirementRef>(), kSecCSDefaultFlags, &requirementData.aref()));
 	SQLite::Transaction xact(*this, SQLite3::Transaction::deferred, "add_rule");
-	SQLite::Statement insert(*this,
-		"INSERT INTO authority (type, allow, requirement, priority, label, expires, remarks)"
-		"	VALUES (:type, :allow, :requirement, :priority, :label, :expires, :remarks);");
+	bool blobs = hasRequirementBlobs();
+	SQLite::Statement insert(*this, blobs
+		? "INSERT INTO authority (type, allow, requirement, reqblob, priority, label, expires, remarks)"
+		  "	VALUES (:type, :allow, :requirement, :reqblob, :priority, :label, :expires, :remarks);"
+		: "INSERT INTO authority (type, allow, requirement, priority, label, expires, remarks)"
+		  "	VALUES (:type, :allow, :requirement, :priority, :label, :expires, :remarks);");
 	insert.bind(":type").integer(type);
 	insert.bind(":allow").integer(allow);
 	insert.bind(":requirement") = requirementText.get();
+	if (blobs)
+		insert.bind(":reqblob") = requirementData.get();
 	insert.bind(":priority") = priority;
 	if (!label.empty())
 		insert.bind(":label") = label;
@@ -559,6 +594,7 @@ CFDictionaryRef PolicyEngine::add(CFTypeRef inTarget, AuthorityType type, SecAss
 	}
 	this->purgeObjects(priority);
 	xact.commit();
+	publishSnapshot();
 	notify_post(kNotifySecAssessmentUpdate);
 	return cfmake<CFDictionaryRef>("{%O=%d}", kSecAssessmentUpdateKeyRow, newRow);
 }
@@ -721,6 +757,7 @@ CFDictionaryRef PolicyEngine::manipulateRules(const std::string &stanza,
 	if (changes) {
 		this->purgeObjects(1.0E100);
 		xact.commit();
+		publishSnapshot();
 		notify_post(kNotifySecAssessmentUpdate);
 		return cfmake<CFDictionaryRef>("{%O=%d}", kSecAssessmentUpdateKeyCount, changes);
 	}
@@ -770,6 +807,7 @@ void PolicyEngine::recordOutcome(SecStaticCodeRef code, bool allow, AuthorityTyp
 	insert.bind(":authority").integer(authority);
 	insert.execute();
 	xact.commit();
+	scheduleSnapshot();
 }
 
 
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// policysnapshot - memory-mapped image of the policy database for assessment clients
+//
+#include "policysnapshot.h"
+#include "requirement.h"
+#include <security_utilities/unix++.h>
+#include <security_utilities/globalizer.h>
+#include <security_utilities/threading.h>
+#include <security_utilities/debugging.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+//
+// Check a snapshot thoroughly, so that readers can trust what they find:
+// the arrays fit, and every string and requirement they refer to lies past
+// them and inside the snapshot (and strings are terminated). Every rule has
+// requirement text; only labels and compiled requirements are optional.
+//
+static bool validString(const PolicySnapshotBlob *snapshot, uint32_t offset, size_t start)
+{
+	if (offset == 0)
+		return true;
+	size_t total = snapshot->length();
+	return offset >= start && offset < total
+		&& memchr(snapshot->at<const char>(offset), 0, total - offset) != NULL;
+}
+
+bool PolicySnapshotBlob::validateSnapshot(size_t length) const
+{
+	if (!validateBlob(length) || this->length() < sizeof(PolicySnapshotBlob))
+		return false;
+	if (version >> 16 != currentVersion >> 16)	// incompatible format
+		return false;
+	size_t total = this->length();
+	uint32_t rcount = ruleCount, ocount = objectCount;
+	if (rcount > (total - sizeof(PolicySnapshotBlob)) / sizeof(Rule))
+		return false;
+	size_t objectStart = sizeof(PolicySnapshotBlob) + rcount * sizeof(Rule);
+	if (ocount > (total - objectStart) / sizeof(Object))
+		return false;
+	size_t start = objectStart + ocount * sizeof(Object);
+	
+	const Rule *rule = rules();
+	for (uint32_t n = 0; n < rcount; n++) {
+		if (rule[n].requirement == 0)
+			return false;
+		if (!validString(this, rule[n].requirement, start) || !validString(this, rule[n].label, start))
+			return false;
+		if (uint32_t offset = rule[n].reqblob) {
+			if (offset < start || offset > total - sizeof(BlobCore))
+				return false;
+			const Requirement *req = Requirement::specific(at<const BlobCore>(offset));
+			if (!req || !req->validateBlob(total - offset))
+				return false;
+		}
+	}
+	const Object *object = objects();
+	for (uint32_t n = 0; n < ocount; n++)
+		if (!validString(this, object[n].label, start))
+			return false;
+	return true;
+}
+
+
+//
+// Binary search for a cache entry. Only call this on a validated snapshot.
+//
+const PolicySnapshotBlob::Object *PolicySnapshotBlob::find(AuthorityType type, const SHA1::Digest hash) const
+{
+	const Object *object = objects();
+	uint32_t low = 0, high = objectCount;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		uint32_t midType = object[mid].type;
+		int cmp = (midType == type) ? memcmp(object[mid].hash, hash, sizeof(SHA1::Digest))
+			: (midType < type) ? -1 : 1;
+		if (cmp == 0)
+			return &object[mid];
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+
+//
+// Snapshot construction.
+// Offsets are collected relative to the pool and fixed up once we know where it goes.
+//
+uint32_t PolicySnapshotBlob::Maker::add(const void *data, size_t length)
+{
+	mPool.resize((mPool.size() + 3) & ~3);	// keep blobs aligned
+	uint32_t offset = mPool.size();
+	mPool.append((const char *)data, length);
+	return offset;
+}
+
+void PolicySnapshotBlob::Maker::rule(const AuthorityRule &rule, AuthorityType type)
+{
+	Rule r;
+	r.type = type;
+	r.allow = rule.allow;
+	r.id = rule.id;
+	r.expires = dateBits(rule.expires);
+	r.disabled = rule.disabled;
+	r.flags = uint32_t(rule.flags);
+	r.requirement = add(rule.requirement.c_str());
+	r.label = add(rule.labelText());
+	r.reqblob = rule.reqblob ? add(CFDataGetBytePtr(rule.reqblob), CFDataGetLength(rule.reqblob)) : 0;
+	mRules.push_back(r);
+}
+
+void PolicySnapshotBlob::Maker::object(AuthorityType type, CFDataRef hash, bool allow, double expires,
+	SQLite::int64 authority, const char *label)
+{
+	if (!hash || CFDataGetLength(hash) != sizeof(SHA1::Digest))
+		return;		// not a cdhash we can look up
+	Object o;
+	memcpy(o.hash, CFDataGetBytePtr(hash), sizeof(SHA1::Digest));
+	o.label = add(label);
+	o.type = type;
+	o.allow = allow;
+	o.authority = authority;
+	o.expires = dateBits(expires);
+	mObjects.push_back(o);
+}
+
+PolicySnapshotBlob *PolicySnapshotBlob::Maker::make(uint32_t changeCounter, uint64_t generation)
+{
+	size_t poolStart = sizeof(PolicySnapshotBlob) + mRules.size() * sizeof(Rule) + mObjects.size() * sizeof(Object);
+	size_t total = poolStart + mPool.size();
+	PolicySnapshotBlob *snapshot = (PolicySnapshotBlob *)calloc(1, total);
+	if (!snapshot)
+		UnixError::throwMe(ENOMEM);
+	snapshot->initialize(total);
+	snapshot->version = currentVersion;
+	snapshot->changeCounter = changeCounter;
+	snapshot->generation = generation;
+	snapshot->ruleCount = mRules.size();
+	snapshot->objectCount = mObjects.size();
+	
+	#define FIXUP(field) if (uint32_t offset = field) field = uint32_t(poolStart + offset)
+	Rule *rule = const_cast<Rule *>(snapshot->rules());
+	for (std::vector<Rule>::const_iterator it = mRules.begin(); it != mRules.end(); ++it, ++rule) {
+		*rule = *it;
+		FIXUP(rule->requirement);
+		FIXUP(rule->label);
+		FIXUP(rule->reqblob);
+	}
+	Object *object = const_cast<Object *>(snapshot->objects());
+	for (std::vector<Object>::const_iterator it = mObjects.begin(); it != mObjects.end(); ++it, ++object) {
+		*object = *it;
+		FIXUP(object->label);
+	}
+	#undef FIXUP
+	memcpy(snapshot->at<char>(poolStart), mPool.data(), mPool.size());
+	return snapshot;
+}
+
+
+//
+// The SQLite file change counter (big-endian, at offset 24 of the database header)
+// changes with every committed write to the database. A snapshot is current if it
+// was made from the database with the counter the database file has now.
+//
+// We read the header through one descriptor per database, opened on first use and
+// never closed. Closing any descriptor on a file drops all POSIX locks this process
+// holds on it - including those of our own SQLite connections to the database.
+//
+class HeaderReaders : public Mutex {
+public:
+	std::map<std::string, int> fds;		// database path -> read-only descriptor
+};
+static ModuleNexus<HeaderReaders> headerReaders;
+
+bool PolicySnapshot::changeCounter(const char *dbPath, uint32_t &counter)
+{
+	int fd;
+	{
+		HeaderReaders &readers = headerReaders();
+		StLock<Mutex> _(readers);
+		std::map<std::string, int>::const_iterator it = readers.fds.find(dbPath);
+		if (it == readers.fds.end()) {
+			if ((fd = ::open(dbPath, O_RDONLY)) < 0)
+				return false;		// not there (yet); try again next time
+			::fcntl(fd, F_SETFD, FD_CLOEXEC);
+			readers.fds[dbPath] = fd;
+		} else
+			fd = it->second;
+	}
+	uint32_t raw;
+	ssize_t got = ::pread(fd, &raw, sizeof(raw), 24);
+	if (got != sizeof(raw))
+		return false;
+	counter = ntohl(raw);
+	return true;
+}
+
+
+//
+// Write a snapshot next to the database, replacing any previous one.
+// It's written under a temporary name and renamed into place, so readers
+// see either the old snapshot or the new one, never a partial file.
+//
+void PolicySnapshot::publish(const char *dbPath, PolicySnapshotBlob::Maker &maker, uint32_t changeCounter)
+{
+	std::string path = pathFor(dbPath);
+	
+	// next generation
+	uint64_t generation = 1;
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			PolicySnapshotBlob header;
+			if (::pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.validateBlob())
+				generation = header.generation + 1;
+			::close(fd);
+		}
+	}
+	
+	PolicySnapshotBlob *snapshot = maker.make(changeCounter, generation);
+	std::string tempPath = path + ".XXXXXX";
+	int fd = ::mkstemp(&tempPath[0]);
+	if (fd < 0) {
+		::free(snapshot);
+		UnixError::throwMe();
+	}
+	try {
+		AutoFileDesc temp(fd);
+		temp.writeAll(snapshot, snapshot->length());
+		UnixError::check(::fchmod(temp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+		temp.close();
+		UnixError::check(::rename(tempPath.c_str(), path.c_str()));
+	} catch (...) {
+		::unlink(tempPath.c_str());
+		::free(snapshot);
+		throw;
+	}
+	secdebug("policysnapshot", "published %s generation %llu (%d rules, %d objects)", path.c_str(),
+		(unsigned long long)generation, int(snapshot->ruleCount), int(snapshot->objectCount));
+	::free(snapshot);
+}
+
+
+//
+// Map a snapshot file and check its structure.
+//
+PolicySnapshot::PolicySnapshot(const std::string &path)
+	: mBase(NULL), mLength(0), mSnapshot(NULL)
+{
+	AutoFileDesc fd(path, O_RDONLY);
+	size_t length = fd.fileSize();
+	if (length < sizeof(PolicySnapshotBlob) || length > UINT32_MAX)
+		MacOSError::throwMe(errSecCSDbCorrupt);
+	mBase = ::mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mBase == MAP_FAILED) {
+		mBase = NULL;
+		UnixError::throwMe();
+	}
+	mLength = length;
+	mSnapshot = PolicySnapshotBlob::specific((const BlobCore *)mBase);
+	if (!mSnapshot || !mSnapshot->validateSnapshot(mLength)) {
+		::munmap(mBase, mLength);
+		MacOSError::throwMe(errSecCSDbCorrupt);
+	}
+}
+
+PolicySnapshot::~PolicySnapshot()
+{
+	if (mBase)
+		::munmap(mBase, mLength);
+}
+
+
+//
+// The current snapshot, if there is one.
+// We hold on to the snapshot we last found current and switch to a newer one
+// (by mapping the file anew) once the database has moved on. The lock only
+// covers that handoff; callers use what they got without it.
+// A snapshot file we found stale (or unusable) won't get any better, since
+// publishing replaces the file; we remember it and don't look at it again
+// until there's a different file (or the database has changed again, in case
+// we looked just before the database got to where the snapshot already was).
+// Until then, callers go to the database.
+//
+class CurrentSnapshot : public Mutex {
+public:
+	CurrentSnapshot() : rejected(false) { }
+	
+	std::string path;						// database path
+	RefPointer<PolicySnapshot> snapshot;	// last snapshot found current
+	
+	bool rejected;							// a snapshot file was rejected...
+	uint32_t rejectedCounter;				// ... at this database change counter...
+	dev_t rejectedDev;						// ... and this was its identity
+	ino_t rejectedIno;
+	struct timespec rejectedMTime;
+	
+	void reject(const struct stat &st, uint32_t counter)
+	{
+		rejected = true;
+		rejectedCounter = counter;
+		rejectedDev = st.st_dev;
+		rejectedIno = st.st_ino;
+		rejectedMTime = st.st_mtimespec;
+	}
+	
+	bool wasRejected(const struct stat &st, uint32_t counter) const
+	{
+		return rejected && counter == rejectedCounter && st.st_dev == rejectedDev && st.st_ino == rejectedIno
+			&& st.st_mtimespec.tv_sec == rejectedMTime.tv_sec && st.st_mtimespec.tv_nsec == rejectedMTime.tv_nsec;
+	}
+};
+static ModuleNexus<CurrentSnapshot> currentSnapshot;
+
+RefPointer<PolicySnapshot> PolicySnapshot::current(const char *dbPath)
+{
+	uint32_t counter;
+	if (!changeCounter(dbPath, counter))
+		return NULL;
+	CurrentSnapshot &cur = currentSnapshot();
+	StLock<Mutex> _(cur);
+	if (cur.path != dbPath) {
+		cur.path = dbPath;
+		cur.snapshot = NULL;
+		cur.rejected = false;
+	}
+	if (cur.snapshot && cur.snapshot->snapshot()->changeCounter == counter)
+		return cur.snapshot;
+	cur.snapshot = NULL;
+	std::string path = pathFor(dbPath);
+	struct stat st;
+	if (::stat(path.c_str(), &st) || cur.wasRejected(st, counter))
+		return NULL;		// none, or no better than last time; the database it is
+	try {
+		RefPointer<PolicySnapshot> fresh = new PolicySnapshot(path);
+		if (fresh->snapshot()->changeCounter != counter) {
+			cur.reject(st, counter);
+			return NULL;	// not (yet) published for this state of the database
+		}
+		cur.snapshot = fresh;
+		return fresh;
+	} catch (...) {
+		cur.reject(st, counter);
+		return NULL;		// unusable; the database it is
+	}
+}
+
+
+//
+// The rules of one type, in evaluation order, as PolicyDatabase::scanRules would get them.
+//
+void PolicySnapshot::rules(AuthorityType type, AuthorityRules &rules) const
+{
+	double now = CFAbsoluteTimeGetCurrent() / 86400.0 + julianBase;
+	const PolicySnapshotBlob::Rule *rule = mSnapshot->rules();
+	for (uint32_t n = 0; n < mSnapshot->ruleCount; n++, rule++) {
+		double expires = PolicySnapshotBlob::date(rule->expires);
+		if (rule->type != type || !(now < expires))
+			continue;
+		AuthorityRule r;
+		r.allow = rule->allow;
+		r.requirement = mSnapshot->string(rule->requirement);
+		if (uint32_t offset = rule->reqblob) {
+			const Requirement *req = mSnapshot->at<const Requirement>(offset);
+			r.reqblob.take(makeCFData(req, req->length()));
+		}
+		r.id = rule->id;
+		if (const char *label = mSnapshot->string(rule->label)) {
+			r.hasLabel = true;
+			r.label = label;
+		}
+		r.expires = expires;
+		r.flags = rule->flags;
+		r.disabled = rule->disabled;
+		rules.push_back(r);
+	}
+}
+
+
+//
+// Quick-check the object cache, as PolicyDatabase::checkCache does.
+//
+bool PolicySnapshot::checkCache(CFURLRef path, AuthorityType type, CFMutableDictionaryRef result) const
+{
+	CFRef<SecStaticCodeRef> code;
+	CFRef<CFDictionaryRef> info;
+	if (!PolicyDatabase::cacheCandidate(path, type, code, info))
+		return false;
+	CFDataRef cdHash = CFDataRef(CFDictionaryGetValue(info, kSecCodeInfoUnique));
+	if (!cdHash || CFDataGetLength(cdHash) != sizeof(SHA1::Digest))
+		return false;
+	const PolicySnapshotBlob::Object *object = mSnapshot->find(type, CFDataGetBytePtr(cdHash));
+	if (!object || !(CFAbsoluteTimeGetCurrent() / 86400.0 + julianBase < PolicySnapshotBlob::date(object->expires)))
+		return false;
+	PolicyDatabase::cacheHit(code, info, object->allow, mSnapshot->string(object->label), object->authority, result);
+	return true;
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
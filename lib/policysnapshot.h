@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// policysnapshot - memory-mapped image of the policy database for assessment clients
+//
+#ifndef _H_POLICYSNAPSHOT
+#define _H_POLICYSNAPSHOT
+
+#include "policydb.h"
+#include <security_utilities/blob.h>
+#include <security_utilities/endian.h>
+#include <security_utilities/refcount.h>
+#include <security_utilities/hashing.h>
+#include <string>
+#include <vector>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A PolicySnapshotBlob is what the database writer publishes after each change:
+// the unexpired authority rules (in evaluation order) with their compiled requirements,
+// and the object cache entries of enabled rules. It records the SQLite file change
+// counter of the database state it was made from; a snapshot whose counter doesn't
+// match the database file's is stale and must not be used.
+//
+// Layout: this header, Rule[ruleCount], Object[objectCount], then the strings
+// (NUL-terminated) and requirement blobs they refer to by offset.
+// Rules are ordered by type, then descending priority. Objects are ordered by
+// type, then cdhash, for binary search. Julian dates are kept as IEEE double bits.
+//
+class PolicySnapshotBlob : public Blob<PolicySnapshotBlob, 0xfade0c05> {
+public:
+	struct Rule {
+		Endian<uint32_t> type;			// AuthorityType
+		Endian<uint32_t> allow;			// allow (1) or deny (0)
+		Endian<uint64_t> id;			// authority row id
+		Endian<uint64_t> expires;		// expiration (Julian date)
+		Endian<uint64_t> disabled;		// disable count
+		Endian<uint32_t> flags;			// authority flags
+		Endian<uint32_t> requirement;	// offset of requirement text (0 => none)
+		Endian<uint32_t> label;			// offset of label text (0 => none)
+		Endian<uint32_t> reqblob;		// offset of compiled Requirement (0 => none)
+	};
+	struct Object {
+		SHA1::Digest hash;				// cdhash
+		Endian<uint32_t> label;			// offset of authority label text (0 => none)
+		Endian<uint32_t> type;			// AuthorityType
+		Endian<uint32_t> allow;			// cached verdict
+		Endian<uint64_t> authority;		// governing authority row id
+		Endian<uint64_t> expires;		// expiration (Julian date)
+	};
+	
+	Endian<uint32_t> version;			// format version
+	Endian<uint32_t> changeCounter;		// SQLite file change counter of the source database
+	Endian<uint64_t> generation;		// increases with each snapshot published
+	Endian<uint32_t> ruleCount;			// number of Rules
+	Endian<uint32_t> objectCount;		// number of Objects
+	
+	static const uint32_t currentVersion = 0x10000;
+	
+	const Rule *rules() const { return at<const Rule>(sizeof(PolicySnapshotBlob)); }
+	const Object *objects() const { return at<const Object>(sizeof(PolicySnapshotBlob) + ruleCount * sizeof(Rule)); }
+	const char *string(uint32_t offset) const { return offset ? at<const char>(offset) : NULL; }
+	
+	bool validateSnapshot(size_t length) const;	// full structural check
+	const Object *find(AuthorityType type, const SHA1::Digest hash) const;
+	
+	static double date(uint64_t bits) { double d; memcpy(&d, &bits, sizeof(d)); return d; }
+	static uint64_t dateBits(double date) { uint64_t b; memcpy(&b, &date, sizeof(b)); return b; }
+	
+	class Maker;
+};
+
+
+//
+// Assemble a PolicySnapshotBlob
+//
+class PolicySnapshotBlob::Maker {
+public:
+	Maker() : mPool(1, '\0') { }	// (pool offset zero means "none")
+	
+	void rule(const AuthorityRule &rule, AuthorityType type);		// in evaluation order
+	void object(AuthorityType type, CFDataRef hash, bool allow, double expires,
+		SQLite::int64 authority, const char *label);				// in (type, hash) order
+	PolicySnapshotBlob *make(uint32_t changeCounter, uint64_t generation); // malloc'ed
+
+private:
+	uint32_t add(const void *data, size_t length);		// add to string/blob pool
+	uint32_t add(const char *text) { return text ? add(text, strlen(text) + 1) : 0; }
+
+private:
+	std::vector<Rule> mRules;			// rules (offsets relative to mPool)
+	std::vector<Object> mObjects;		// objects (ditto)
+	std::string mPool;					// strings and blobs
+};
+
+
+//
+// A published snapshot, mapped read-only. Assessment clients use the current one
+// (if there is one) instead of opening and querying the database. The mapping is
+// immutable, so lookups take no locks; a newer snapshot replaces the file by rename,
+// and clients switch to it when they notice the database has changed. Anyone still
+// holding the old one keeps a valid mapping until they let go.
+//
+class PolicySnapshot : public RefCount {
+	NOCOPY(PolicySnapshot)
+public:
+	static RefPointer<PolicySnapshot> current(const char *dbPath = defaultDatabase); // NULL => ask the database
+	~PolicySnapshot();
+	
+	const PolicySnapshotBlob *snapshot() const { return mSnapshot; }
+	
+	void rules(AuthorityType type, AuthorityRules &rules) const;	// unexpired rules, in evaluation order
+	bool checkCache(CFURLRef path, AuthorityType type, CFMutableDictionaryRef result) const; // as PolicyDatabase
+	
+	static std::string pathFor(const char *dbPath) { return std::string(dbPath) + ".snapshot"; }
+	static bool changeCounter(const char *dbPath, uint32_t &counter);	// read from database file header
+	static void publish(const char *dbPath, PolicySnapshotBlob::Maker &maker, uint32_t changeCounter);
+
+private:
+	PolicySnapshot(const std::string &path);
+
+private:
+	void *mBase;						// mapped file
+	size_t mLength;						// length of mapping
+	const PolicySnapshotBlob *mSnapshot; // (in mapping)
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif //_H_POLICYSNAPSHOT
@@ -58,6 +58,11 @@ FTSENT *ResourceEnumerator::next(string &path)
 			path = ent->fts_path + mPath.size() + 1;	// skip prefix + "/"
 			return ent;
 		case FTS_D:
+			if (ent->fts_level > FTS_ROOTLEVEL && !enter(ent->fts_path + mPath.size() + 1)) {
+				secdebug("rdirenum", "skipping %s", ent->fts_path);
+				fts_set(mFTS, ent, FTS_SKIP);
+				break;
+			}
 			secdebug("rdirenum", "entering %s", ent->fts_path);
 			break;
 		case FTS_DP:
@@ -75,6 +80,15 @@ FTSENT *ResourceEnumerator::next(string &path)
 	return NULL;
 }
 
+bool ResourceEnumerator::enter(const string &)
+{
+	return true;
+}
+
+
+ResourceStore::~ResourceStore()
+{ }
+
 
 } // end namespace CodeSigning
 } // end namespace Security
@@ -27,8 +27,11 @@
 #ifndef _H_RENUM
 #define _H_RENUM
 
+#include <security_utilities/hashing.h>
+#include <CoreFoundation/CoreFoundation.h>
 #include <fts.h>
 #include <string>
+#include <vector>
 
 namespace Security {
 namespace CodeSigning {
@@ -38,13 +41,17 @@ namespace CodeSigning {
 // A ResourceEnumerator front-ends FTS to scan out relevant resource
 // directory entries (ignoring irrelevant ones).
 // It also returns canonical resource paths (relative to the resource directory).
+// Subclasses can keep it out of whole subdirectories by overriding enter().
 //
 class ResourceEnumerator {
 public:
 	ResourceEnumerator(std::string path);
-	~ResourceEnumerator();
+	virtual ~ResourceEnumerator();
 	
 	FTSENT *next(std::string &path);
+
+protected:
+	virtual bool enter(const std::string &dir);	// descend into this directory? [true]
 	
 private:
 	std::string mPath;
@@ -52,6 +59,22 @@ private:
 };
 
 
+//
+// A ResourceStore supplies resources that are not files in the file system
+// (for example, members of an archive). A DiskRep that keeps its resources in
+// one returns it from DiskRep::resourceStore(); the ResourceStore lives as long
+// as its DiskRep. All paths are canonical resource paths (relative to the resource root).
+//
+class ResourceStore {
+public:
+	virtual ~ResourceStore();
+	
+	virtual void resourcePaths(std::vector<std::string> &paths) = 0; // all plain files, in storage order
+	virtual bool hashResource(const std::string &path, DynamicHash *hasher, size_t &size) = 0; // false if absent
+	virtual CFDataRef loadResource(const std::string &path) = 0; // NULL if absent
+};
+
+
 } // end namespace CodeSigning
 } // end namespace Security
 
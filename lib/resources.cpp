@@ -26,9 +26,11 @@
 //
 #include "resources.h"
 #include "csutilities.h"
+#include "xmlplist.h"
 #include <Security/CSCommon.h>
 #include <security_utilities/unix++.h>
 #include <security_utilities/cfmunge.h>
+#include <algorithm>
 
 namespace Security {
 namespace CodeSigning {
@@ -37,25 +39,32 @@ namespace CodeSigning {
 //
 // Construction and maintainance
 //
-ResourceBuilder::ResourceBuilder(const std::string &root, CFDictionaryRef rulesDict, CodeDirectory::HashAlgorithm hashType)
-	: ResourceEnumerator(root), mHashType(hashType)
+ResourceRules::ResourceRules(CFDictionaryRef rulesDict)
 {
 	CFDictionary rules(rulesDict, errSecCSResourceRulesInvalid);
-	rules.apply(this, &ResourceBuilder::addRule);
+	rules.apply(this, &ResourceRules::addRule);
 	mRawRules = rules;
 }
 
-ResourceBuilder::~ResourceBuilder()
+ResourceRules::~ResourceRules()
 {
 	for (Rules::iterator it = mRules.begin(); it != mRules.end(); ++it)
 		delete *it;
 }
 
+const size_t ResourceBuilder::matchContentsSize;
+
+ResourceBuilder::ResourceBuilder(const std::string &root, CFDictionaryRef rulesDict, CodeDirectory::HashAlgorithm hashType)
+	: ResourceEnumerator(root), ResourceRules(rulesDict), mHashType(hashType),
+	  mSchedule(scheduleInode), mDigests(matchContentsSize)
+{
+}
+
 
 //
 // Parse and add one matching rule
 //
-void ResourceBuilder::addRule(CFTypeRef key, CFTypeRef value)
+void ResourceRules::addRule(CFTypeRef key, CFTypeRef value)
 {
 	string pattern = cfString(key, errSecCSResourceRulesInvalid);
 	unsigned weight = 1;
@@ -79,96 +88,202 @@ void ResourceBuilder::addRule(CFTypeRef key, CFTypeRef value)
 
 
 //
-// Locate the next non-ignored file, look up its rule, and return it.
-// Returns NULL when we're out of files.
+// Find the rule that governs a resource path.
+// Returns NULL if the resource is excluded, omitted, or not covered by any rule.
 //
-FTSENT *ResourceBuilder::next(string &path, Rule * &rule)
+ResourceRules::Rule *ResourceRules::findRule(const string &path) const
 {
-	while (FTSENT *ent = ResourceEnumerator::next(path)) {
-		// find best matching rule
-		Rule *bestRule = NULL;
-		for (Rules::const_iterator it = mRules.begin(); it != mRules.end(); ++it) {
-			Rule *rule = *it;
-			if (rule->match(path.c_str())) {
-				if (rule->flags & exclusion) {
-					bestRule = NULL;
-					break;
-				}
-				if (!bestRule || rule->weight > bestRule->weight)
-					bestRule = rule;
+	Rule *bestRule = NULL;
+	for (Rules::const_iterator it = mRules.begin(); it != mRules.end(); ++it) {
+		Rule *rule = *it;
+		if (rule->match(path.c_str())) {
+			if (rule->flags & exclusion)
+				return NULL;
+			if (!bestRule || rule->weight > bestRule->weight)
+				bestRule = rule;
 		}
+	}
+	if (bestRule && (bestRule->flags & omitted))
+		return NULL;
+	return bestRule;
+}
+
+
+//
+// Determine whether a directory can be skipped entirely, because no file
+// below it could be sealed. This is the case if
+//	- an exclusion rule matches everything in it, or
+//	- an omission rule matches everything in it, and outweighs every rule that could seal in it, or
+//	- no rule could seal anything in it at all.
+// We have to be sure; when in doubt, we don't prune.
+//
+bool ResourceRules::prunable(const string &dir) const
+{
+	string base = dir + "/";
+	bool omitAll = false;
+	Weight omitWeight = 0;
+	for (Rules::const_iterator it = mRules.begin(); it != mRules.end(); ++it) {
+		Rule *rule = *it;
+		if ((rule->flags & (exclusion | omitted)) && rule->matchesAllBelow(base)) {
+			if (rule->flags & exclusion)
+				return true;
+			if (!omitAll || rule->weight > omitWeight)
+				omitWeight = rule->weight;
+			omitAll = true;
 		}
-		if (!bestRule || (bestRule->flags & omitted))
-			continue;
-		rule = bestRule;
-		return ent;
 	}
+	for (Rules::const_iterator it = mRules.begin(); it != mRules.end(); ++it) {
+		Rule *rule = *it;
+		if (!(rule->flags & (exclusion | omitted)) && rule->mayMatchBelow(base))
+			if (!omitAll || rule->weight >= omitWeight)
+				return false;
+	}
+	return true;
+}
+
+
+//
+// Locate the next non-ignored file, look up its rule, and return it.
+// Returns NULL when we're out of files.
+//
+FTSENT *ResourceBuilder::next(string &path, Rule * &rule)
+{
+	while (FTSENT *ent = ResourceEnumerator::next(path))
+		if ((rule = findRule(path)))
+			return ent;
 	return NULL;
 }
 
+bool ResourceBuilder::enter(const string &dir)
+{
+	return !prunable(dir);
+}
+
 
 //
-// Build the ResourceDirectory given the currently established rule set.
+// Build the ResourceDirectory given the currently established rule set,
+// and return it in XML form.
+// We enumerate everything first, and then hash the files in the order given by
+// our Schedule. On a cold cache, reading files in disk order saves a lot of seeking.
+// The result is written straight from our list of files, without making CF objects
+// for them; it comes out just as CFPropertyListCreateXMLData would have made it.
 //
-CFDictionaryRef ResourceBuilder::build()
+namespace {
+	struct Work {
+		std::string path;				// resource path
+		std::string file;				// file system path
+		ResourceRules::Rule *rule;		// governing rule
+		uint64_t position;				// physical offset (0 if unknown/unused)
+		ino_t inode;					// inode number
+		std::string digest;				// resource hash (once computed)
+		int64_t size;					// resource size (once computed)
+	};
+	
+	bool layoutOrder(const Work &a, const Work &b)
+	{
+		if (a.position != b.position)
+			return a.position < b.position;
+		return a.inode < b.inode;
+	}
+	
+	bool plistOrder(const Work &a, const Work &b)
+	{
+		return XMLPlistWriter::keyLess(a.path, b.path);
+	}
+}
+
+CFDataRef ResourceBuilder::build()
 {
 	secdebug("codesign", "start building resource directory");
-	CFRef<CFMutableDictionaryRef> files = makeCFMutableDictionary();
-
+	std::vector<Work> work;
 	string path;
 	Rule *rule;
 	while (FTSENT *ent = next(path, rule)) {
 		assert(rule);
-		CFRef<CFDataRef> hash = hashFile(ent->fts_accpath);
-		if (rule->flags == 0) {	// default case - plain hash
-			cfadd(files, "{%s=%O}", path.c_str(), hash.get());
-			secdebug("csresource", "%s added simple (rule %p)", path.c_str(), rule);
-		} else {	// more complicated - use a sub-dictionary
-			cfadd(files, "{%s={hash=%O,optional=%B}}",
-				path.c_str(), hash.get(), rule->flags & optional);
-			secdebug("csresource", "%s added complex (rule %p)", path.c_str(), rule);
-		}
+		Work item;
+		item.path = path;
+		item.file = ent->fts_accpath;
+		item.rule = rule;
+		item.position = (mSchedule == schedulePhysical) ? physicalOffset(ent->fts_accpath) : 0;
+		item.inode = ent->fts_statp->st_ino;
+		work.push_back(item);
 	}
-	secdebug("codesign", "finished code directory with %d entries",
-		int(CFDictionaryGetCount(files)));
+	if (mSchedule != scheduleTraversal)
+		std::stable_sort(work.begin(), work.end(), layoutOrder);
+	for (std::vector<Work>::iterator it = work.begin(); it != work.end(); ++it)
+		hashFile(it->file.c_str(), it->digest, it->size);
 	
-	return cfmake<CFDictionaryRef>("{rules=%O,files=%O}", mRawRules.get(), files.get());
+	std::sort(work.begin(), work.end(), plistOrder);
+	CFRef<CFMutableDataRef> xml = CFDataCreateMutable(NULL, 0);
+	XMLPlistWriter::DataSink sink(xml);
+	XMLPlistWriter writer(sink);
+	writer.beginDict();
+	writer.key("files");
+	writer.beginDict();
+	for (std::vector<Work>::const_iterator it = work.begin(); it != work.end(); ++it) {
+		// the size lets verifiers spot altered files without reading them
+		writer.key(it->path);
+		writer.beginDict();
+		writer.key("hash");
+		writer.data(it->digest.data(), it->digest.size());
+		if (it->rule->flags) {	// more complicated - add flags
+			writer.key("optional");
+			writer.boolean(it->rule->flags & optional);
+		}
+		writer.key("size");
+		writer.integer(it->size);
+		writer.endDict();
+	}
+	writer.endDict();
+	writer.key("rules");
+	writer.value(rawRules());
+	writer.endDict();
+	writer.finish();
+	secdebug("codesign", "finished code directory with %d entries", int(work.size()));
+	return xml.yield();
 }
 
 
 //
-// Hash a file and return a CFDataRef with the hash
+// Hash a file, returning its hash and size (the number of bytes hashed).
 //
-CFDataRef ResourceBuilder::hashFile(const char *path)
+void ResourceBuilder::hashFile(const char *path, std::string &digest, int64_t &size)
 {
 	UnixPlusPlus::AutoFileDesc fd(path);
 	fd.fcntl(F_NOCACHE, true);		// turn off page caching (one-pass)
+	struct stat st;
+	UnixError::check(::fstat(fd, &st));
+	if (mDigests.find(fd, st, mHashType, digest)) {	// seen it before
+		size = st.st_size;
+		return;
+	}
 	MakeHash<ResourceBuilder> hasher(this);
-	hashFileData(fd, hasher.get());
-	Hashing::Byte digest[hasher->digestLength()];
-	hasher->finish(digest);
-	return CFDataCreate(NULL, digest, sizeof(digest));
+	size = hashFileData(fd, hasher.get());
+	digest.resize(hasher->digestLength());
+	hasher->finish((Hashing::Byte *)&digest[0]);
+	mDigests.add(st, mHashType, digest.data(), digest.size(), path);
 }
 
 
 //
 // Regex matching objects
 //
-ResourceBuilder::Rule::Rule(const std::string &pattern, unsigned w, uint32_t f)
+ResourceRules::Rule::Rule(const std::string &pattern, unsigned w, uint32_t f)
 	: weight(w), flags(f)
 {
 	if (::regcomp(this, pattern.c_str(), REG_EXTENDED | REG_NOSUB))	//@@@ REG_ICASE?
 		MacOSError::throwMe(errSecCSResourceRulesInvalid);
+	analyze(pattern);
 	secdebug("csresource", "%p rule %s added (weight %d, flags 0x%x)",
 		this, pattern.c_str(), w, f);
 }
 
-ResourceBuilder::Rule::~Rule()
+ResourceRules::Rule::~Rule()
 {
 	::regfree(this);
 }
 
-bool ResourceBuilder::Rule::match(const char *s) const
+bool ResourceRules::Rule::match(const char *s) const
 {
 	switch (::regexec(this, s, 0, NULL, 0)) {
 	case 0:
@@ -181,7 +296,46 @@ bool ResourceBuilder::Rule::match(const char *s) const
 }
 
 
-std::string ResourceBuilder::escapeRE(const std::string &s)
+//
+// Take a pattern apart (just enough) for subtree pruning.
+// An anchored pattern can only match paths that start with the literal text at its
+// beginning. A pattern without end anchors (or end-of-word tests) is open-ended: when
+// it matches a path, it matches any extension of that path as well, since a match need
+// not extend to the end. We err on the side of caution; a shorter prefix or a pattern
+// deemed not open-ended just means less pruning.
+//
+void ResourceRules::Rule::analyze(const string &pattern)
+{
+	mOpenEnded = pattern.find('$') == string::npos && pattern.find("[[:") == string::npos;
+	mAnchored = pattern[0] == '^' && pattern.find('|') == string::npos;
+	if (mAnchored)
+		for (string::size_type n = 1; n < pattern.size(); n++) {
+			char c = pattern[n];
+			if (c == '\\' && n + 1 < pattern.size() && ispunct(pattern[n + 1]))
+				c = pattern[++n];			// escaped literal
+			else if (strchr("\\.[](){}*+?|^$", c))
+				break;						// that's all the literal text there is
+			if (n + 1 < pattern.size() && strchr("*+?{", pattern[n + 1]))
+				break;						// quantified; may not be there
+			mPrefix.push_back(c);
+		}
+}
+
+bool ResourceRules::Rule::mayMatchBelow(const string &dir) const
+{
+	if (!mAnchored)
+		return true;
+	string::size_type common = std::min(mPrefix.size(), dir.size());
+	return mPrefix.compare(0, common, dir, 0, common) == 0;
+}
+
+bool ResourceRules::Rule::matchesAllBelow(const string &dir) const
+{
+	return mOpenEnded && match(dir.c_str());
+}
+
+
+std::string ResourceRules::escapeRE(const std::string &s)
 {
 	string r;
 	for (string::const_iterator it = s.begin(); it != s.end(); ++it) {
@@ -201,13 +355,19 @@ ResourceSeal::ResourceSeal(CFTypeRef it)
 {
 	if (it == NULL)
 		MacOSError::throwMe(errSecCSResourcesInvalid);
+	mOptional = false;
+	mSize = -1;
 	if (CFGetTypeID(it) == CFDataGetTypeID()) {
 		mHash = CFDataRef(it);
-		mOptional = false;
 	} else {
-		mOptional = false;
 		if (!cfscan(it, "{hash=%XO,?optional=%B}", &mHash, &mOptional))
 			MacOSError::throwMe(errSecCSResourcesInvalid);
+		if (CFTypeRef size = CFDictionaryGetValue(CFDictionaryRef(it), CFSTR("size"))) {
+			if (CFGetTypeID(size) != CFNumberGetTypeID()
+					|| !CFNumberGetValue(CFNumberRef(size), kCFNumberSInt64Type, &mSize)
+					|| mSize < 0)
+				MacOSError::throwMe(errSecCSResourcesInvalid);
+		}
 	}
 }
 
@@ -29,6 +29,7 @@
 
 #include "renum.h"
 #include "codedirectory.h"
+#include "digestmemo.h"
 #include <security_utilities/utilities.h>
 #include <security_utilities/cfutilities.h>
 #include <security_utilities/hashing.h>
@@ -41,17 +42,14 @@ namespace CodeSigning {
 
 
 //
-// The builder of ResourceDirectories.
-//
-// Note that this *is* a ResourceEnumerate, which can enumerate
-// its source directory once (only).
+// A set of resource rules, as kept in a ResourceDirectory.
+// Each rule is a regular expression matched against resource paths (relative to
+// the resource root). Of all matching rules, the one of highest weight decides.
 //
-class ResourceBuilder : public ResourceEnumerator {
+class ResourceRules {
 public:
-	ResourceBuilder(const std::string &root, CFDictionaryRef rules, CodeDirectory::HashAlgorithm hashType);
-	~ResourceBuilder();
-
-	CFDictionaryRef build();
+	ResourceRules(CFDictionaryRef rules);
+	~ResourceRules();
 
 	enum Action {
 		optional = 0x01,				// may be absent at runtime
@@ -68,27 +66,71 @@ public:
 		~Rule();
 		
 		bool match(const char *s) const;
+		bool mayMatchBelow(const std::string &dir) const;	// might match some path in dir/?
+		bool matchesAllBelow(const std::string &dir) const;	// certainly matches all paths in dir/?
 		
 		const Weight weight;
 		const uint32_t flags;
+	
+	private:
+		void analyze(const std::string &pattern);
+		
+		bool mAnchored;					// pattern starts with (unalternated) ^
+		std::string mPrefix;			// literal text any match starts with (if mAnchored)
+		bool mOpenEnded;				// matching s implies matching any extension of s
 	};
 	void addRule(Rule *rule) { mRules.push_back(rule); }
 	void addExclusion(const std::string &pattern) { mRules.insert(mRules.begin(), new Rule(pattern, 0, exclusion)); }
 
 	static std::string escapeRE(const std::string &s);
 	
-	FTSENT *next(std::string &path, Rule * &rule);	// enumerate next file and match rule
+	Rule *findRule(const std::string &path) const;	// governing rule (NULL if none, excluded, or omitted)
+	bool prunable(const std::string &dir) const;	// no file below dir can be sealed
+	CFDictionaryRef rawRules() const { return mRawRules; }
 
 protected:
 	void addRule(CFTypeRef key, CFTypeRef value);
-	CFDataRef hashFile(const char *path);
-	DynamicHash *getHash() const { return CodeDirectory::hashFor(this->mHashType); }
 	
 private:
 	CFCopyRef<CFDictionaryRef> mRawRules;
 	typedef std::vector<Rule *> Rules;
 	Rules mRules;
+};
+
+
+//
+// The builder of ResourceDirectories.
+//
+// Note that this *is* a ResourceEnumerate, which can enumerate
+// its source directory once (only).
+//
+class ResourceBuilder : public ResourceEnumerator, public ResourceRules {
+public:
+	ResourceBuilder(const std::string &root, CFDictionaryRef rules, CodeDirectory::HashAlgorithm hashType);
+
+	// order in which build() reads files (the result is the same regardless)
+	enum Schedule {
+		scheduleTraversal,				// as enumerated
+		scheduleInode,					// by inode number (roughly allocation order; free)
+		schedulePhysical				// by position on disk, where the file system will say
+	};
+	void schedule(Schedule s) { mSchedule = s; }
+
+	CFDataRef build();					// ResourceDirectory, in XML form
+
+	FTSENT *next(std::string &path, Rule * &rule);	// enumerate next file and match rule
+
+protected:
+	bool enter(const std::string &dir);
+	void hashFile(const char *path, std::string &digest, int64_t &size);
+	DynamicHash *getHash() const { return CodeDirectory::hashFor(this->mHashType); }
+	
+private:
 	CodeDirectory::HashAlgorithm mHashType;
+	Schedule mSchedule;
+	DigestMemo mDigests;				// hard links and identical copies get hashed once
+	
+	static const size_t matchContentsSize = 16 * 1024; // compare contents of files this large
 };
 
 
@@ -105,10 +147,13 @@ public:
 	
 	const SHA1::Byte *hash() const { return CFDataGetBytePtr(mHash); }
 	bool optional() const { return mOptional; }
+	bool hasSize() const { return mSize >= 0; }		// older seals don't record sizes
+	int64_t size() const { return mSize; }
 
 private:
 	CFDataRef mHash;
 	int mOptional;
+	int64_t mSize;					// file length (-1 if not recorded)
 };
 
 
@@ -26,11 +26,67 @@
 //
 #include "sigblob.h"
 #include "CSCommon.h"
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <vector>
 
 
 namespace Security {
 namespace CodeSigning {
 
+using namespace UnixPlusPlus;
+
+
+//
+// Gathered SuperBlob output.
+// The layout matches SuperBlobCore::Maker::make(): header (magic, length, count),
+// then the index of (type, offset) pairs in type order, then the pieces in the same
+// order, back to back. writev(2) may write less than asked for, and takes at most
+// IOV_MAX buffers per call, so we keep going until it's all out.
+//
+size_t writeSuperBlob(FileDesc fd, uint32_t magic, const std::map<uint32_t, BlobCore *> &pieces)
+{
+	typedef std::map<uint32_t, BlobCore *> Pieces;
+	std::vector<uint32_t> head(3 + 2 * pieces.size());	// header and index (big-endian)
+	std::vector<struct iovec> iov(1 + pieces.size());
+	size_t offset = head.size() * sizeof(uint32_t);
+	iov[0].iov_base = &head[0];
+	iov[0].iov_len = offset;
+	unsigned n = 1;
+	for (Pieces::const_iterator it = pieces.begin(); it != pieces.end(); ++it, ++n) {
+		head[1 + 2 * n] = htonl(it->first);
+		head[2 + 2 * n] = htonl(uint32_t(offset));
+		iov[n].iov_base = it->second;
+		iov[n].iov_len = it->second->length();
+		offset += it->second->length();
+	}
+	head[0] = htonl(magic);
+	head[1] = htonl(uint32_t(offset));
+	head[2] = htonl(uint32_t(pieces.size()));
+
+	struct iovec *next = &iov[0];
+	size_t left = iov.size();
+	while (left > 0) {
+		ssize_t rc = ::writev(fd, next, int(std::min(left, size_t(IOV_MAX))));
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			UnixError::throwMe();
+		}
+		size_t done = rc;
+		while (left > 0 && done >= next->iov_len) {	// skip completed buffers
+			done -= next->iov_len;
+			next++; left--;
+		}
+		if (done) {		// partially written buffer
+			next->iov_base = (char *)next->iov_base + done;
+			next->iov_len -= done;
+		}
+	}
+	return offset;
+}
+
 
 CFDataRef EmbeddedSignatureBlob::component(CodeDirectory::SpecialSlot slot) const
 {
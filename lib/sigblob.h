@@ -29,12 +29,35 @@
 
 #include "codedirectory.h"
 #include <security_utilities/superblob.h>
+#include <security_utilities/unix++.h>
 #include <CoreFoundation/CFData.h>
+#include <map>
 
 namespace Security {
 namespace CodeSigning {
 
 
+//
+// Write a SuperBlob to a file, at its current position, without assembling it in memory.
+// The header and index are computed from the sizes of the pieces, and header, index, and
+// pieces are handed to the kernel in one gathered write. The result is byte-for-byte what
+// the corresponding SuperBlob Maker would make(). Returns the length written.
+//
+size_t writeSuperBlob(UnixPlusPlus::FileDesc fd, uint32_t magic,
+	const std::map<uint32_t, BlobCore *> &pieces);
+
+
+//
+// A SuperBlob Maker that can write() its SuperBlob directly to a file
+//
+template <class _Maker, uint32_t _magic>
+class GatherMaker : public _Maker {
+public:
+	size_t write(UnixPlusPlus::FileDesc fd) const
+		{ return writeSuperBlob(fd, _magic, this->mPieces); }
+};
+
+
 //
 // An EmbeddedSignatureBlob is a SuperBlob indexed by component slot number.
 // This is what we embed in Mach-O images. It is also what we use for detached
@@ -45,7 +68,7 @@ class EmbeddedSignatureBlob : public SuperBlobCore<EmbeddedSignatureBlob, 0xfade
 public:
 	CFDataRef component(CodeDirectory::SpecialSlot slot) const;
 	
-	class Maker : public _Core::Maker {
+	class Maker : public GatherMaker<_Core::Maker, 0xfade0cc0> {
 	public:
 		void component(CodeDirectory::SpecialSlot type, CFDataRef data);
 	};
@@ -58,6 +81,7 @@ public:
 // This is what we use for Mach-O detached signatures.
 //
 typedef SuperBlob<0xfade0cc1> DetachedSignatureBlob;	// indexed by main architecture
+typedef GatherMaker<DetachedSignatureBlob::Maker, 0xfade0cc1> DetachedSignatureMaker;
 
 
 //
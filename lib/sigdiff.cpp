@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// sigdiff - differences between two versions of code, as told by their signatures
+//
+#include "sigdiff.h"
+#include <Security/SecStaticCodePriv.h>
+#include <security_utilities/cfmunge.h>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// Build the whole answer
+//
+CFDictionaryRef SignatureDiff::differences()
+{
+	CFRef<CFMutableDictionaryRef> result = makeCFMutableDictionary();
+	CFDictionaryAddValue(result, kSecCodeDifferencePages, CFRef<CFDictionaryRef>(pages()));
+	resources(result);
+	return result.yield();
+}
+
+
+//
+// Page ranges, per architecture of the newer code.
+// Code without architectures is listed under the empty string.
+//
+CFDictionaryRef SignatureDiff::pages()
+{
+	CFRef<CFMutableDictionaryRef> pages = makeCFMutableDictionary();
+	if (Universal *fat = mNewer->diskRep()->mainExecutableImage()) {
+		Universal::Architectures newArchs, oldArchs;
+		fat->architectures(newArchs);
+		if (Universal *oldFat = mOlder->diskRep()->mainExecutableImage())
+			oldFat->architectures(oldArchs);
+		for (Universal::Architectures::const_iterator it = newArchs.begin(); it != newArchs.end(); ++it) {
+			SecPointer<SecStaticCode> newer = forArchitecture(mNewer, *it);
+			SecPointer<SecStaticCode> older;
+			if (oldArchs.find(*it) != oldArchs.end())
+				older = forArchitecture(mOlder, *it);
+			CFRef<CFArrayRef> ranges = pageDifferences(
+				older ? older->codeDirectory() : NULL, newer->codeDirectory());
+			CFDictionaryAddValue(pages, CFTempString(it->name()), ranges);
+		}
+	} else {
+		CFRef<CFArrayRef> ranges = pageDifferences(mOlder->codeDirectory(), mNewer->codeDirectory());
+		CFDictionaryAddValue(pages, CFSTR(""), ranges);
+	}
+	return pages.yield();
+}
+
+SecStaticCode *SignatureDiff::forArchitecture(SecStaticCode *code, const Architecture &arch)
+{
+	if (arch == code->diskRep()->mainExecutableImage()->bestNativeArch())
+		return code;
+	DiskRep::Context ctx;
+	ctx.arch = arch;
+	return new SecStaticCode(DiskRep::bestGuess(code->mainExecutablePath(), &ctx));
+}
+
+
+//
+// Compare the page hash arrays of two CodeDirectories, returning the byte ranges
+// (within the newer code) whose pages differ, coalesced, as {offset=, length=} dictionaries.
+// If the arrays can't be compared page for page (no older version, different hash type or
+// page size, or scattered hashes), everything the newer version signs is different.
+//
+static void addRange(CFMutableArrayRef ranges, size_t offset, size_t length)
+{
+	CFArrayAppendValue(ranges, CFRef<CFDictionaryRef>(cfmake<CFDictionaryRef>("{%O=%O,%O=%O}",
+		kSecCodeDifferenceOffset, CFTempNumber(uint64_t(offset)).get(),
+		kSecCodeDifferenceLength, CFTempNumber(uint64_t(length)).get())));
+}
+
+CFArrayRef SignatureDiff::pageDifferences(const CodeDirectory *older, const CodeDirectory *newer)
+{
+	CFRef<CFMutableArrayRef> ranges = makeCFMutableArray(0);
+	size_t limit = newer->codeLimit;
+	if (limit == 0)
+		return ranges.yield();
+	if (!older || older->hashType != newer->hashType || older->hashSize != newer->hashSize
+			|| older->pageSize != newer->pageSize || newer->pageSize == 0
+			|| older->scatterVector() || newer->scatterVector()) {
+		addRange(ranges, 0, limit);
+		return ranges.yield();
+	}
+	
+	size_t pageSize = size_t(1) << newer->pageSize;
+	uint32_t oldSlots = older->nCodeSlots, newSlots = newer->nCodeSlots;
+	bool changing = false;
+	size_t start = 0;
+	for (uint32_t slot = 0; slot < newSlots; slot++) {
+		bool same = slot < oldSlots
+			&& !memcmp((*older)[slot], (*newer)[slot], newer->hashSize);
+		if (!same && !changing) {
+			start = slot * pageSize;
+			changing = true;
+		} else if (same && changing) {
+			addRange(ranges, start, slot * pageSize - start);
+			changing = false;
+		}
+	}
+	if (changing)
+		addRange(ranges, start, limit - start);
+	return ranges.yield();
+}
+
+
+//
+// Resource differences, from the "files" sections of the two resource directories.
+// An entry is changed if its hash changed; entries without hashes are compared whole.
+//
+static CFDataRef resourceHash(CFTypeRef entry)
+{
+	if (CFGetTypeID(entry) == CFDataGetTypeID())
+		return CFDataRef(entry);
+	if (CFGetTypeID(entry) == CFDictionaryGetTypeID())
+		if (CFTypeRef hash = CFDictionaryGetValue(CFDictionaryRef(entry), CFSTR("hash")))
+			if (CFGetTypeID(hash) == CFDataGetTypeID())
+				return CFDataRef(hash);
+	return NULL;
+}
+
+static CFDictionaryRef resourceFiles(SecStaticCode *code)
+{
+	if (CFDictionaryRef resources = code->resourceDictionary())
+		return cfget<CFDictionaryRef>(resources, "files");
+	return NULL;
+}
+
+static void sortPaths(CFMutableArrayRef paths)
+{
+	CFArraySortValues(paths, CFRangeMake(0, CFArrayGetCount(paths)),
+		(CFComparatorFunction)CFStringCompare, NULL);
+}
+
+void SignatureDiff::resources(CFMutableDictionaryRef result)
+{
+	CFRef<CFMutableArrayRef> added = makeCFMutableArray(0);
+	CFRef<CFMutableArrayRef> removed = makeCFMutableArray(0);
+	CFRef<CFMutableArrayRef> changed = makeCFMutableArray(0);
+	CFDictionaryRef oldFiles = resourceFiles(mOlder);
+	CFDictionaryRef newFiles = resourceFiles(mNewer);
+	
+	if (newFiles) {
+		CFIndex count = CFDictionaryGetCount(newFiles);
+		std::vector<const void *> keys(count), values(count);
+		if (count)
+			CFDictionaryGetKeysAndValues(newFiles, &keys[0], &values[0]);
+		for (CFIndex n = 0; n < count; n++) {
+			CFTypeRef old = oldFiles ? CFDictionaryGetValue(oldFiles, keys[n]) : NULL;
+			if (!old) {
+				CFArrayAppendValue(added, keys[n]);
+			} else {
+				CFDataRef oldHash = resourceHash(old), newHash = resourceHash(values[n]);
+				if (oldHash && newHash ? !CFEqual(oldHash, newHash) : !CFEqual(old, values[n]))
+					CFArrayAppendValue(changed, keys[n]);
+			}
+		}
+	}
+	if (oldFiles) {
+		CFIndex count = CFDictionaryGetCount(oldFiles);
+		std::vector<const void *> keys(count);
+		if (count)
+			CFDictionaryGetKeysAndValues(oldFiles, &keys[0], NULL);
+		for (CFIndex n = 0; n < count; n++)
+			if (!newFiles || !CFDictionaryContainsKey(newFiles, keys[n]))
+				CFArrayAppendValue(removed, keys[n]);
+	}
+	
+	sortPaths(added);
+	sortPaths(removed);
+	sortPaths(changed);
+	CFDictionaryAddValue(result, kSecCodeDifferenceResourcesAdded, added);
+	CFDictionaryAddValue(result, kSecCodeDifferenceResourcesRemoved, removed);
+	CFDictionaryAddValue(result, kSecCodeDifferenceResourcesChanged, changed);
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// sigdiff - differences between two versions of code, as told by their signatures
+//
+#ifndef _H_SIGDIFF
+#define _H_SIGDIFF
+
+#include "StaticCode.h"
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A SignatureDiff compares the signatures of two versions of (presumably) the same code.
+// Page hashes tell which page ranges of each architecture differ; the sealed resource
+// directories tell which resources were added, removed, or changed. Nothing but the
+// signatures is read, and the signatures are not validated; validate the code first
+// if you need to trust the answer.
+//
+class SignatureDiff {
+public:
+	SignatureDiff(SecStaticCode *older, SecStaticCode *newer) : mOlder(older), mNewer(newer) { }
+	
+	CFDictionaryRef differences();		// see SecStaticCodeCopyDifferences (caller owns)
+	
+	static CFArrayRef pageDifferences(const CodeDirectory *older, const CodeDirectory *newer);
+	
+private:
+	CFDictionaryRef pages();
+	void resources(CFMutableDictionaryRef result);
+	static SecStaticCode *forArchitecture(SecStaticCode *code, const Architecture &arch);
+
+private:
+	SecPointer<SecStaticCode> mOlder;
+	SecPointer<SecStaticCode> mNewer;
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_SIGDIFF
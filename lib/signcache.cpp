@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// signcache - content-addressed cache of signing results
+//
+#include "signcache.h"
+#include "csutilities.h"
+#include <security_utilities/unix++.h>
+#include <security_utilities/debugging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+//
+// Key accumulation
+//
+void SigningCache::Key::add(const void *data, size_t length)
+{
+	uint64_t size = length;
+	mHash.update(&size, sizeof(size));
+	mHash.update(data, length);
+}
+
+void SigningCache::Key::add(CFDataRef data)
+{
+	if (data)
+		add(CFDataGetBytePtr(data), CFDataGetLength(data));
+	else
+		add(uint64_t(-1));		// not a valid length-plus-data sequence
+}
+
+void SigningCache::Key::add(uint64_t value)
+{
+	mHash.update(&value, sizeof(value));
+}
+
+void SigningCache::Key::addFile(const std::string &path)
+{
+	SHA1 file;
+	size_t length = hashFileData(path.c_str(), &file);
+	SHA1::Digest digest;
+	file.finish(digest);
+	add(length);
+	add(digest, sizeof(digest));
+}
+
+std::string SigningCache::Key::name()
+{
+	SHA1::Digest digest;
+	mHash.finish(digest);
+	char hex[2 * SHA1::digestLength + 1];
+	for (size_t n = 0; n < SHA1::digestLength; n++)
+		snprintf(hex + 2 * n, 3, "%02x", digest[n]);
+	return hex;
+}
+
+
+//
+// Look up a cache entry.
+// Anything we can't read or parse is simply a miss.
+//
+CFDictionaryRef SigningCache::find(const std::string &key)
+{
+	if (CFRef<CFDataRef> data = cfLoadFile(path(key)))
+		if (CFDictionaryRef entry = makeCFDictionaryFrom(data)) {
+			secdebug("signcache", "%s: hit %s", mDirectory.c_str(), key.c_str());
+			return entry;
+		}
+	secdebug("signcache", "%s: miss %s", mDirectory.c_str(), key.c_str());
+	return NULL;
+}
+
+
+//
+// Store a cache entry.
+// The entry is written to a temporary file that is then renamed into place, so readers
+// never see a partial entry. Failure to store is not an error; the signature is fine
+// either way.
+//
+void SigningCache::store(const std::string &key, CFDictionaryRef entry)
+{
+	std::string tempPath = path(key) + ".XXXXXX";
+	int fd = ::mkstemp(&tempPath[0]);
+	if (fd < 0) {
+		secdebug("signcache", "%s: cannot create entry (errno=%d)", mDirectory.c_str(), errno);
+		return;
+	}
+	try {
+		CFRef<CFDataRef> data = makeCFData(entry);
+		AutoFileDesc file(fd);
+		file.writeAll(CFDataGetBytePtr(data), CFDataGetLength(data));
+		file.close();
+		UnixError::check(::rename(tempPath.c_str(), path(key).c_str()));
+		secdebug("signcache", "%s: stored %s", mDirectory.c_str(), key.c_str());
+	} catch (...) {
+		::unlink(tempPath.c_str());
+		secdebug("signcache", "%s: failed to store %s", mDirectory.c_str(), key.c_str());
+	}
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// signcache - content-addressed cache of signing results
+//
+#ifndef _H_SIGNCACHE
+#define _H_SIGNCACHE
+
+#include <security_utilities/hashing.h>
+#include <security_utilities/cfutilities.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <string>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// A SigningCache remembers the results of signing operations in a directory,
+// keyed by a digest of everything that went into them: the contents of the code
+// and its resource seal, and all signing parameters that affect the output.
+// Signing the same thing the same way again can then skip straight to writing
+// out the signature. Entries are property lists, one file per key; they are
+// written atomically, so any number of signers can share a cache directory.
+// The cache never expires anything; that's up to whoever owns the directory.
+//
+// A signature taken from the cache carries the signing time (and any timestamp)
+// of the operation that made it, unless an explicit signing time was part of the key.
+//
+class SigningCache {
+public:
+	SigningCache(const std::string &directory) : mDirectory(directory) { }
+	
+	//
+	// A Key accumulates the identity of a signing request.
+	// Each item is framed by its length, so different sequences of items can't collide.
+	//
+	class Key {
+	public:
+		void add(const void *data, size_t length);
+		void add(CFDataRef data);			// NULL is distinct from empty
+		void add(const std::string &s)		{ add(s.data(), s.size()); }
+		void add(uint64_t value);
+		void addFile(const std::string &path);	// contents of file
+		
+		std::string name();					// finish and return in hex form
+	
+	private:
+		SHA1 mHash;
+	};
+	
+	CFDictionaryRef find(const std::string &key);	// entry or NULL
+	void store(const std::string &key, CFDictionaryRef entry);
+
+private:
+	std::string path(const std::string &key) const { return mDirectory + "/" + key; }
+
+private:
+	std::string mDirectory;
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_SIGNCACHE
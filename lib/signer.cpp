@@ -32,13 +32,17 @@
 #include <Security/CMSEncoder.h>
 #include <Security/CMSPrivate.h>
 #include <Security/CSCommonPriv.h>
+#include <Security/SecStaticCodePriv.h>
 #include <CoreFoundation/CFBundlePriv.h>
 #include "renum.h"
 #include "machorep.h"
+#include "detachedrep.h"
 #include "csutilities.h"
+#include <mach-o/loader.h>
 #include <security_utilities/unix++.h>
 #include <security_utilities/unixchild.h>
 #include <security_utilities/cfmunge.h>
+#include <dispatch/dispatch.h>
 
 namespace Security {
 namespace CodeSigning {
@@ -50,9 +54,13 @@ namespace CodeSigning {
 void SecCodeSigner::Signer::sign(SecCSFlags flags)
 {
 	rep = code->diskRep()->base();
+	if (rep->resourceStore())		// can't write into archives and such
+		MacOSError::throwMe(errSecCSNotSupported);
 	this->prepare(flags);
 	PreSigningContext context(*this);
 	if (Universal *fat = state.mNoMachO ? NULL : rep->mainExecutableImage()) {
+		if (state.mCatalog)		// catalogs hold single-architecture signatures only
+			MacOSError::throwMe(errSecCSNotSupported);
 		signMachO(fat, context);
 	} else {
 		signArchitectureAgnostic(context);
@@ -151,11 +159,24 @@ void SecCodeSigner::Signer::prepare(SecCSFlags flags)
 		// build the resource directory
 		ResourceBuilder resources(rpath, cfget<CFDictionaryRef>(resourceRules, "rules"), digestAlgorithm());
 		rep->adjustResources(resources);	// DiskRep-specific adjustments
-		CFRef<CFDictionaryRef> rdir = resources.build();
-		resourceDirectory.take(CFPropertyListCreateXMLData(NULL, rdir));
+		resources.schedule(ResourceBuilder::schedulePhysical);	// signing is mostly cold-cache reading
+		resourceDirectory.take(resources.build());
 	}
 	
-	// screen and set the signing time
+	prepareSigningTime();
+	
+	pagesize = state.mPageSize ? cfNumber<size_t>(state.mPageSize) : rep->pageSize(state);
+    
+    // Timestamping setup
+    CFRef<SecIdentityRef> mTSAuth;	// identity for client-side authentication to the Timestamp server
+}
+
+
+//
+// Screen and set the signing time
+//
+void SecCodeSigner::Signer::prepareSigningTime()
+{
 	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
 	if (state.mSigningTime == CFDateRef(kCFNull)) {
 		signingTime = 0;		// no time at all
@@ -167,14 +188,36 @@ void SecCodeSigner::Signer::prepare(SecCSFlags flags)
 			MacOSError::throwMe(errSecCSBadDictionaryFormat);
 		signingTime = time;
 	}
-	
-	pagesize = state.mPageSize ? cfNumber<size_t>(state.mPageSize) : rep->pageSize(state);
-    
-    // Timestamping setup
-    CFRef<SecIdentityRef> mTSAuth;	// identity for client-side authentication to the Timestamp server
 }
 
 
+//
+// One architecture's share of the concurrent part of Mach-O signing.
+// The CodeDirectory is owned here until it's handed to the Arch.
+// A failure is kept (with any CSError details) to be rethrown by the caller.
+//
+struct Finish {
+	Finish(ArchEditor::Arch *a) : arch(a), cd(NULL), status(noErr) { }
+	ArchEditor::Arch *arch;			// architecture being finished
+	CodeDirectory *cd;				// its CodeDirectory (malloc'ed)
+	CFRef<CFDataRef> signature;		// its CMS signature
+	OSStatus status;				// failure code, or noErr
+	CFRef<CFDictionaryRef> info;	// failure details, if any
+};
+
+//
+// All the Finishes of one signing pass. Any CodeDirectory not yet
+// handed to its Arch is freed when this goes away, however we leave.
+//
+struct FinishList : public std::vector<Finish> {
+	~FinishList()
+	{
+		for (iterator it = begin(); it != end(); ++it)
+			::free(it->cd);
+	}
+};
+
+
 //
 // Sign a Mach-O binary, using liberal dollops of that special Mach-O magic sauce.
 // Note that this will deal just fine with non-fat Mach-O binaries, but it will
@@ -200,6 +243,13 @@ void SecCodeSigner::Signer::signMachO(Universal *fat, const Requirement::Context
 			populate(arch);
 		populate(arch.cdbuilder, arch, arch.ireqs,
 			arch.source->offset(), arch.source->signingExtent());
+		if (state.mDirtyRanges) {	// header and load commands get rewritten, so they're always dirty
+			size_t header = (arch.source->is64() ? sizeof(mach_header_64) : sizeof(mach_header))
+				+ arch.source->commandLength();
+			if (!arch.source->signingOffset())	// signing adds LC_CODE_SIGNATURE
+				header += sizeof(linkedit_data_command);
+			reuse(arch.cdbuilder, &arch.architecture, header);
+		}
 	
 		// add identification blob (made from this architecture) only if we're making a detached signature
 		if (state.mDetached) {
@@ -213,30 +263,146 @@ void SecCodeSigner::Signer::signMachO(Universal *fat, const Requirement::Context
 		arch.blobSize = arch.size(cdSize, state.mCMSSize, 0);
 	}
 	
+	// a signing cache may already have the answer
+	std::string cacheName;
+	CFRef<CFMutableArrayRef> cacheEntry;
+	if (cacheable()) {
+		SigningCache::Key key;
+		cacheKey(key);
+		for (MachOEditor::Iterator it = editor->begin(); it != editor->end(); ++it) {
+			MachOEditor::Arch &arch = *it->second;
+			key.add(uint64_t(arch.architecture.cpuType()));
+			key.add(uint64_t(arch.architecture.cpuSubtype()));
+			if (const Requirements *reqs = arch.ireqs)
+				key.add(reqs, reqs->length());
+			else
+				key.add(CFDataRef(NULL));
+			key.add(uint64_t(arch.blobSize));	// same allocation => same binary to be signed
+		}
+		cacheName = key.name();
+		if (CFRef<CFDictionaryRef> entry = SigningCache(cfString(state.mCache)).find(cacheName))
+			if (cachedMachO(*editor, entry))
+				return;
+		cacheEntry.take(makeCFMutableArray(0));
+	}
+	
 	editor->allocate();
 	
-	// pass 2: Finish and generate signatures, and write them
+	// pass 2: Finish and generate signatures, and write them.
+	// Each architecture hashes its own region of the new binary through its own file
+	// descriptor and gets its own CMS signature, so these are done concurrently.
+	// Only the writes into the edit copy are made one at a time (in architecture order).
+	FinishList finish;
 	for (MachOEditor::Iterator it = editor->begin(); it != editor->end(); ++it) {
-		MachOEditor::Arch &arch = *it->second;
-		editor->reset(arch);
-
-		// finish CodeDirectory (off new binary) and sign it
-		CodeDirectory *cd = arch.cdbuilder.build();
-		CFRef<CFDataRef> signature = signCodeDirectory(cd);
+		editor->reset(*it->second);
+		finish.push_back(Finish(it->second));
+	}
+	Finish *work = &finish[0];
+	dispatch_apply(finish.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t n) {
+		Finish &item = work[n];
+		try {
+			// finish CodeDirectory (off new binary) and sign it
+			item.cd = item.arch->cdbuilder.build();
+			item.signature.take(signCodeDirectory(item.cd));
+		} catch (const CSError &err) {
+			item.status = err.osStatus();
+			item.info = err.infoDict();
+		} catch (const CommonError &err) {
+			item.status = err.osStatus();
+		} catch (...) {
+			item.status = errSecCSInternalError;
+		}
+	});
+	for (FinishList::iterator it = finish.begin(); it != finish.end(); ++it)
+		if (it->status != noErr)
+			CSError::throwMe(it->status, it->info.yield());
+	
+	for (FinishList::iterator it = finish.begin(); it != finish.end(); ++it) {
+		MachOEditor::Arch &arch = *it->arch;
 		
 		// complete the SuperBlob
-		arch.add(cdCodeDirectorySlot, cd);	// takes ownership
+		arch.add(cdCodeDirectorySlot, it->cd);	// takes ownership
+		it->cd = NULL;
 		arch.add(cdSignatureSlot, BlobWrapper::alloc(
-			CFDataGetBytePtr(signature), CFDataGetLength(signature)));
+			CFDataGetBytePtr(it->signature), CFDataGetLength(it->signature)));
 		if (!state.mDryRun) {
-			EmbeddedSignatureBlob *blob = arch.make();
-			editor->write(arch, blob);	// takes ownership of blob
+			if (cacheEntry) {	// need the SuperBlob in memory to remember it
+				EmbeddedSignatureBlob *blob = arch.make();
+				CFArrayAppendValue(cacheEntry, CFTempData(blob, blob->length()));
+				editor->write(arch, blob);	// takes ownership of blob
+			} else
+				editor->emit(arch);
 		}
 	}
 	
 	// done: write edit copy back over the original
-	if (!state.mDryRun)
+	if (!state.mDryRun) {
 		editor->commit();
+		if (cacheEntry)
+			SigningCache(cfString(state.mCache)).store(cacheName,
+				CFRef<CFDictionaryRef>(cfmake<CFDictionaryRef>("{architectures=%O}", cacheEntry.get())));
+	}
+}
+
+
+//
+// A cached CodeDirectory is only used if it's intact and describes the code
+// we're about to sign; anything else means the cache is stale (or damaged).
+//
+static bool cachedDirectoryMatches(const CodeDirectory::Builder &builder, const void *data, size_t length)
+{
+	const CodeDirectory *cd = (const CodeDirectory *)data;
+	if (length < sizeof(BlobCore) || cd->length() != length)
+		return false;
+	try {
+		cd->checkIntegrity();
+	} catch (...) {
+		return false;
+	}
+	return builder.matches(cd);
+}
+
+
+//
+// Apply a cached Mach-O signature through the editor, instead of signing anew.
+// The entry holds the SuperBlob written for each architecture, in editor order.
+// Since the cache key covers the input binary and the space allocated for each signature,
+// the editor makes the very same binary the cached CodeDirectories were computed from.
+// Returns false (having changed nothing) if the entry doesn't fit the editor.
+//
+bool SecCodeSigner::Signer::cachedMachO(ArchEditor &editor, CFDictionaryRef entry)
+{
+	CFArrayRef archs = CFArrayRef(CFDictionaryGetValue(entry, CFSTR("architectures")));
+	if (!archs || CFGetTypeID(archs) != CFArrayGetTypeID() || size_t(CFArrayGetCount(archs)) != editor.count())
+		return false;
+	std::vector<const EmbeddedSignatureBlob *> blobs;
+	CFIndex n = 0;
+	for (ArchEditor::Iterator it = editor.begin(); it != editor.end(); ++it, ++n) {
+		CFDataRef data = CFDataRef(CFArrayGetValueAtIndex(archs, n));
+		if (CFGetTypeID(data) != CFDataGetTypeID() || size_t(CFDataGetLength(data)) < sizeof(BlobCore))
+			return false;
+		const EmbeddedSignatureBlob *blob = EmbeddedSignatureBlob::specific((const BlobCore *)CFDataGetBytePtr(data));
+		if (!blob || blob->length() != size_t(CFDataGetLength(data)))
+			return false;
+		const BlobCore *cd = blob->find(cdCodeDirectorySlot);
+		if (!cd || (const char *)cd + sizeof(BlobCore) > (const char *)blob + blob->length()
+				|| (const char *)cd + cd->length() > (const char *)blob + blob->length()
+				|| !cachedDirectoryMatches(it->second->cdbuilder, cd, cd->length()))
+			return false;
+		blobs.push_back(blob);
+	}
+	
+	secdebug("signer", "%p using cached signature", this);
+	editor.allocate();
+	std::vector<const EmbeddedSignatureBlob *>::const_iterator blob = blobs.begin();
+	for (ArchEditor::Iterator it = editor.begin(); it != editor.end(); ++it, ++blob) {
+		editor.reset(*it->second);
+		if (!state.mDryRun)
+			editor.write(*it->second, (*blob)->clone());	// takes ownership of copy
+	}
+	if (!state.mDryRun)
+		editor.commit();
+	return true;
 }
 
 
@@ -247,13 +413,15 @@ void SecCodeSigner::Signer::signMachO(Universal *fat, const Requirement::Context
 void SecCodeSigner::Signer::signArchitectureAgnostic(const Requirement::Context &context)
 {
 	// non-Mach-O executable - single-instance signing
-	RefPointer<DiskRep::Writer> writer = state.mDetached ?
-		(new DetachedBlobWriter(*this)) : rep->writer();
+	RefPointer<DiskRep::Writer> writer = state.mCatalog ? (new CatalogBlobWriter(*this))
+		: state.mDetached ? (new DetachedBlobWriter(*this)) : rep->writer();
 	CodeDirectory::Builder builder(state.mDigestAlgorithm);
 	InternalRequirements ireqs;
 	ireqs(state.mRequirements, rep->defaultRequirements(NULL, state), context);
 	populate(*writer);
 	populate(builder, *writer, ireqs, rep->signingBase(), rep->signingLimit());
+	if (state.mDirtyRanges)
+		reuse(builder, NULL);
 	
 	// add identification blob (made from this architecture) only if we're making a detached signature
 	if (state.mDetached) {
@@ -261,17 +429,104 @@ void SecCodeSigner::Signer::signArchitectureAgnostic(const Requirement::Context
 		writer->component(cdIdentificationSlot, identification);
 	}
 	
+	// a signing cache may already have the CodeDirectory and signature
+	std::string cacheName;
+	if (cacheable() && !state.mCatalog) {
+		SigningCache::Key key;
+		cacheKey(key);
+		if (const Requirements *reqs = ireqs)
+			key.add(reqs, reqs->length());
+		else
+			key.add(CFDataRef(NULL));
+		cacheName = key.name();
+		if (CFRef<CFDictionaryRef> entry = SigningCache(cfString(state.mCache)).find(cacheName)) {
+			CFDataRef cdData = CFDataRef(CFDictionaryGetValue(entry, CFSTR("codedirectory")));
+			CFDataRef signature = CFDataRef(CFDictionaryGetValue(entry, CFSTR("signature")));
+			if (cdData && CFGetTypeID(cdData) == CFDataGetTypeID()
+					&& signature && CFGetTypeID(signature) == CFDataGetTypeID()
+					&& cachedDirectoryMatches(builder, CFDataGetBytePtr(cdData), CFDataGetLength(cdData))) {
+				secdebug("signer", "%p using cached signature", this);
+				if (!state.mDryRun) {
+					writer->component(cdCodeDirectorySlot, cdData);
+					writer->signature(signature);
+					writer->flush();
+				}
+				return;
+			}
+		}
+	}
+	
 	CodeDirectory *cd = builder.build();
-	CFRef<CFDataRef> signature = signCodeDirectory(cd);
+	CFRef<CFDataRef> signature;
+	if (!state.mCatalog)	// catalog entries are signed together, as the catalog
+		signature.take(signCodeDirectory(cd));
 	if (!state.mDryRun) {
 		writer->codeDirectory(cd);
-		writer->signature(signature);
+		if (signature)
+			writer->signature(signature);
 		writer->flush();
+		if (!cacheName.empty())
+			SigningCache(cfString(state.mCache)).store(cacheName,
+				CFRef<CFDictionaryRef>(cfmake<CFDictionaryRef>("{codedirectory=%O,signature=%O}",
+					CFTempData(cd->data(), cd->length()).get(), signature.get())));
 	}
 	::free(cd);
 }
 
 
+//
+// A cached signature carries the signing time and timestamp of the day it was made.
+// That's only right if the signing time is pinned (or absent) and no timestamp is wanted;
+// "now" and a fresh timestamp can't be had from the cache.
+//
+bool SecCodeSigner::Signer::cacheable() const
+{
+	return state.mCache && state.mSigningTime && !state.mWantTimeStamp;
+}
+
+
+//
+// Add everything that goes into a signature, other than the per-architecture
+// internal requirements, to a signing cache key. The main executable is digested
+// whole; the resource directory stands for the contents of all resources (and the
+// rules that selected them). Anything in the key that differs makes a different signature.
+//
+void SecCodeSigner::Signer::cacheKey(SigningCache::Key &key)
+{
+	key.add(std::string("signing cache version 2"));
+	key.add(rep->format());
+	key.addFile(rep->mainExecutablePath());
+	key.add(CFRef<CFDataRef>(rep->component(cdInfoSlot)));
+	key.add(resourceDirectory);
+	key.add(state.mResourceRules ? CFRef<CFDataRef>(makeCFData(state.mResourceRules.get())) : CFRef<CFDataRef>());
+	key.add(identifier);
+	key.add(uint64_t(cdFlags));
+	key.add(uint64_t(state.mDigestAlgorithm));
+	key.add(uint64_t(pagesize));
+	key.add(state.mEntitlementData);
+	key.add(state.mApplicationData);
+
+	// who signs, when, and where to
+	if (state.isAdhoc()) {
+		key.add(std::string("adhoc"));
+	} else {
+		SHA1::Digest digest;
+		hashOfCertificate(state.mCMSSigner->leaf(), digest);
+		key.add(digest, sizeof(digest));
+	}
+	assert(cacheable());
+	if (state.mSigningTime == CFDateRef(kCFNull)) {
+		key.add(std::string("no signing time"));
+	} else {
+		CFAbsoluteTime time = CFDateGetAbsoluteTime(state.mSigningTime);
+		key.add(&time, sizeof(time));
+	}
+	key.add(uint64_t(state.mCMSSize));
+	key.add(uint64_t(state.mDetached ? 1 : 0));
+	key.add(uint64_t(state.mNoMachO));
+}
+
+
 //
 // Global populate - send components to destination buffers ONCE
 //
@@ -317,57 +572,122 @@ void SecCodeSigner::Signer::populate(CodeDirectory::Builder &builder, DiskRep::W
 	writer.addDiscretionary(builder);
 }
 
-#include <Security/tsaSupport.h>
+
+//
+// One (64-bit, non-negative) number of a dirty range
+//
+static int64_t rangeValue(CFDictionaryRef range, CFStringRef key)
+{
+	CFNumberRef number = CFNumberRef(CFDictionaryGetValue(range, key));
+	int64_t value;
+	if (!number || CFGetTypeID(number) != CFNumberGetTypeID()
+			|| !CFNumberGetValue(number, kCFNumberSInt64Type, &value) || value < 0)
+		MacOSError::throwMe(errSecCSInvalidObjectRef);
+	return value;
+}
+
+
+//
+// Seed a CodeDirectory builder from the code's existing signature, so that only
+// the changed pages are hashed again. The caller describes the changes in the
+// dirty-ranges parameter, keyed by architecture name ("" for non-Mach-O code);
+// an architecture it doesn't mention is hashed in full. The existing CodeDirectory
+// must pass validation (short of checking its page hashes, which are out of date by design).
+//
+void SecCodeSigner::Signer::reuse(CodeDirectory::Builder &builder, const Architecture *arch, size_t header)
+{
+	CFArrayRef ranges = CFArrayRef(CFDictionaryGetValue(state.mDirtyRanges,
+		arch ? CFTempString(arch->name()).get() : CFSTR("")));
+	if (!ranges)
+		return;
+	if (CFGetTypeID(ranges) != CFArrayGetTypeID())
+		MacOSError::throwMe(errSecCSInvalidObjectRef);
+	
+	CodeDirectory::Builder::Ranges dirty;
+	if (header)
+		dirty.push_back(CodeDirectory::Builder::Range(0, header));
+	uint64_t limit = builder.execLength();
+	CFIndex count = CFArrayGetCount(ranges);
+	for (CFIndex n = 0; n < count; n++) {
+		CFDictionaryRef range = CFDictionaryRef(CFArrayGetValueAtIndex(ranges, n));
+		if (CFGetTypeID(range) != CFDictionaryGetTypeID())
+			MacOSError::throwMe(errSecCSInvalidObjectRef);
+		int64_t offset = rangeValue(range, kSecCodeDifferenceOffset);
+		int64_t length = rangeValue(range, kSecCodeDifferenceLength);
+		if (uint64_t(offset) > limit || uint64_t(length) > limit - uint64_t(offset))
+			MacOSError::throwMe(errSecCSInvalidObjectRef);	// not within the code we're signing
+		dirty.push_back(CodeDirectory::Builder::Range(size_t(offset), size_t(length)));
+	}
+	
+	// the existing signature of this architecture (as AllArchitectures would find it),
+	// from wherever the code's signature came from
+	SecPointer<SecStaticCode> original = code;
+	if (arch && !(*arch == code->diskRep()->mainExecutableImage()->bestNativeArch())) {
+		DiskRep::Context ctx;
+		ctx.arch = *arch;
+		original = new SecStaticCode(DiskRep::bestGuess(code->mainExecutablePath(), &ctx));
+		DiskRep *rep = code->diskRep();
+		if (DetachedRep *detached = dynamic_cast<DetachedRep *>(rep)) {
+			CFDataRef sig = detached->signature();
+			if (reinterpret_cast<const BlobCore *>(CFDataGetBytePtr(sig))->is<DetachedSignatureBlob>())
+				original->detachedSignature(sig);	// has all architectures
+			else
+				original->checkForSystemSignature();	// one architecture's, from the database
+		} else if (CatalogRep *catalog = dynamic_cast<CatalogRep *>(rep))
+			original->catalogSignature(catalog->catalog());
+	}
+	original->validateDirectory();
+	builder.reuse(original->codeDirectory(), dirty);
+}
+
 
 //
 // Generate the CMS signature for a (finished) CodeDirectory.
 //
 CFDataRef SecCodeSigner::Signer::signCodeDirectory(const CodeDirectory *cd)
 {
-	assert(state.mSigner);
-	CFRef<CFMutableDictionaryRef> defaultTSContext = NULL;
-    
+	return signData(cd, cd->length());
+}
+
+
+//
+// Generate the CMS signature for a signature catalog.
+// There's no code here, so the signing time is all we need to prepare.
+//
+CFDataRef SecCodeSigner::Signer::signCatalog(const CatalogTable *table)
+{
+	prepareSigningTime();
+	return signData(table, table->length());
+}
+
+
+//
+// Generate a CMS signature over detached content
+//
+CFDataRef SecCodeSigner::Signer::signData(const void *data, size_t length)
+{
+	assert(state.mCMSSigner || state.isAdhoc());
+	
 	// a null signer generates a null signature blob
-	if (state.mSigner == SecIdentityRef(kCFNull))
+	if (state.isAdhoc())
 		return CFDataCreate(NULL, NULL, 0);
 	
-	// generate CMS signature
-	CFRef<CMSEncoderRef> cms;
-	MacOSError::check(CMSEncoderCreate(&cms.aref()));
-	MacOSError::check(CMSEncoderSetCertificateChainMode(cms, kCMSCertificateChainWithRoot));
-	CMSEncoderAddSigners(cms, state.mSigner);
-	MacOSError::check(CMSEncoderSetHasDetachedContent(cms, true));
-	
-	if (signingTime) {
-		MacOSError::check(CMSEncoderAddSignedAttributes(cms, kCMSAttrSigningTime));
-		MacOSError::check(CMSEncoderSetSigningTime(cms, signingTime));
+	// everything the CMSSigner needs besides the content
+	CFRef<CFMutableDictionaryRef> options = makeCFMutableDictionary();
+	if (signingTime)
+		CFDictionarySetValue(options, CMSSigner::signingTimeKey,
+			CFRef<CFDateRef>(CFDateCreate(NULL, signingTime)));
+	if (state.mWantTimeStamp) {
+		CFDictionarySetValue(options, CMSSigner::timestampKey, kCFBooleanTrue);
+		if (state.mTimestampService)
+			CFDictionarySetValue(options, CMSSigner::timestampServerKey,
+				CFURLGetString(state.mTimestampService));
+		if (state.mNoTimeStampCerts)
+			CFDictionarySetValue(options, CMSSigner::timestampNoCertsKey, kCFBooleanTrue);
 	}
 	
-	MacOSError::check(CMSEncoderUpdateContent(cms, cd, cd->length()));
-    
-    // Set up to call Timestamp server if requested
-    
-    if (state.mWantTimeStamp)
-    {
-        CFRef<CFErrorRef> error = NULL;
-        defaultTSContext = SecCmsTSAGetDefaultContext(&error.aref());
-        if (error)
-            MacOSError::throwMe(errSecDataNotAvailable);
-            
-        if (state.mNoTimeStampCerts || state.mTimestampService) {
-            if (state.mTimestampService)
-                CFDictionarySetValue(defaultTSContext, kTSAContextKeyURL, state.mTimestampService);
-            if (state.mNoTimeStampCerts)
-                CFDictionarySetValue(defaultTSContext, kTSAContextKeyNoCerts, kCFBooleanTrue);
-       }
-            
-        CmsMessageSetTSAContext(cms, defaultTSContext);
-    }
-    
-	CFDataRef signature;
-	MacOSError::check(CMSEncoderCopyEncodedContent(cms, &signature));
-
-	return signature;
+	// generate CMS signature (here, or wherever the signing key is)
+	return state.mCMSSigner->sign(CFTempData(data, length), options);
 }
 
 
@@ -30,6 +30,8 @@
 #include "CodeSigner.h"
 #include "cdbuilder.h"
 #include "signerutils.h"
+#include "signcache.h"
+#include "catalog.h"
 #include "StaticCode.h"
 #include <security_utilities/utilities.h>
 
@@ -56,8 +58,11 @@ public:
 	
 	std::string path() const { return cfString(rep->canonicalPath()); }
 	SecIdentityRef signingIdentity() const { return state.mSigner; }
+	CMSSigner *cmsSigner() const { return state.mCMSSigner; }	// NULL if ad-hoc
 	std::string signingIdentifier() const { return identifier; }
 	
+	CFDataRef signCatalog(const CatalogTable *table);	// CMS for a signature catalog
+	
 protected:
 	void prepare(SecCSFlags flags);				// set up signing parameters
 	void signMachO(Universal *fat, const Requirement::Context &context); // sign a Mach-O binary
@@ -67,6 +72,13 @@ protected:
 	void populate(CodeDirectory::Builder &builder, DiskRep::Writer &writer,
 		InternalRequirements &ireqs, size_t offset = 0, size_t length = 0);	// per-architecture
 	CFDataRef signCodeDirectory(const CodeDirectory *cd);
+	CFDataRef signData(const void *data, size_t length);	// CMS over detached content
+	void prepareSigningTime();
+	void reuse(CodeDirectory::Builder &builder, const Architecture *arch, size_t header = 0); // incremental re-signing
+	
+	bool cacheable() const;						// signing cache may be used for this signature
+	void cacheKey(SigningCache::Key &key);		// common signing cache key material
+	bool cachedMachO(ArchEditor &editor, CFDictionaryRef entry); // apply cached Mach-O signature
 
 	uint32_t cdTextFlags(std::string text);		// convert text CodeDirectory flags
 	std::string uniqueName() const;				// derive unique string from rep
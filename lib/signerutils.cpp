@@ -73,6 +73,14 @@ void DetachedBlobWriter::flush()
 }
 
 
+void CatalogBlobWriter::flush()
+{
+	EmbeddedSignatureBlob *blob = this->make();
+	signer.state.addCatalogEntry(blob, signer);
+	::free(blob);
+}
+
+
 //
 // ArchEditor
 //
@@ -119,9 +127,7 @@ void BlobEditor::commit()
 	mMaker.add(0, mGlobal.make());	// takes ownership of blob
 
 	// finish up the superblob and deliver it
-	DetachedSignatureBlob *blob = mMaker.make();
-	signer.state.returnDetachedSignature(blob, signer);
-	::free(blob);
+	signer.state.returnDetachedSignature(mMaker, signer);
 }
 
 
@@ -270,6 +276,28 @@ void MachOEditor::write(Arch &arch, EmbeddedSignatureBlob *blob)
 }
 
 
+//
+// Write an architecture's SuperBlob straight out of its Maker.
+// The pieces are gathered into the file where they lie; the SuperBlob is
+// never assembled in memory.
+//
+void MachOEditor::emit(Arch &arch)
+{
+	if (size_t offset = arch.source->signingOffset()) {
+		size_t signingLength = arch.source->signingLength();
+		size_t length = arch.size();
+		CODESIGN_ALLOCATE_WRITE((char*)arch.architecture.name(), offset, length, signingLength);
+		if (signingLength < length)
+			MacOSError::throwMe(errSecCSCMSTooLarge);
+		arch.source->seek(offset);
+		arch.write(*arch.source);
+	} else {
+		secdebug("signer", "%p cannot find CODESIGNING section", this);
+		MacOSError::throwMe(errSecCSInternalError);
+	}
+}
+
+
 //
 // Commit the edit.
 // This moves the temporary editor copy over the source image file.
@@ -340,17 +368,9 @@ void InternalRequirements::operator () (const Requirements *given, const Require
 //
 PreSigningContext::PreSigningContext(const SecCodeSigner::Signer &signer)
 {
-	// construct a cert chain
-	if (signer.signingIdentity() != SecIdentityRef(kCFNull)) {
-		CFRef<SecCertificateRef> signingCert;
-		MacOSError::check(SecIdentityCopyCertificate(signer.signingIdentity(), &signingCert.aref()));
-		CFRef<SecPolicyRef> policy = SecPolicyCreateWithOID(kSecPolicyAppleCodeSigning);
-		CFRef<SecTrustRef> trust;
-		MacOSError::check(SecTrustCreateWithCertificates(CFArrayRef(signingCert.get()), policy, &trust.aref()));
-		SecTrustResultType result;
-		MacOSError::check(SecTrustEvaluate(trust, &result));
-		CSSM_TP_APPLE_EVIDENCE_INFO *info;
-		MacOSError::check(SecTrustGetResult(trust, &result, &mCerts.aref(), &info));
+	// the cert chain is whatever makes our CMS signatures (local identity or signing service)
+	if (CMSSigner *cms = signer.cmsSigner()) {
+		mCerts = cms->certificates();
 		this->certs = mCerts;
 	}
 	
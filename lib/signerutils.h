@@ -73,6 +73,19 @@ public:
 };
 
 
+//
+// A BlobWriter that contributes its SuperBlob to the signature catalog being made
+//
+class CatalogBlobWriter : public BlobWriter {
+public:
+	CatalogBlobWriter(SecCodeSigner::Signer &s) : signer(s) { }
+
+	SecCodeSigner::Signer &signer;
+	
+	void flush();
+};
+
+
 //
 // A multi-architecture editing assistant.
 // ArchEditor collects (Mach-O) architectures in use, and maintains per-archtitecture
@@ -115,6 +128,8 @@ public:
 	virtual void allocate() = 0;			// interpass allocations
 	virtual void reset(Arch &arch) = 0;		// pass 2 prep
 	virtual void write(Arch &arch, EmbeddedSignatureBlob *blob) = 0; // takes ownership of blob
+	virtual void emit(Arch &arch)			// write arch's completed SuperBlob
+		{ write(arch, arch.make()); }
 	virtual void commit() = 0;				// write/flush result
 	
 protected:
@@ -139,7 +154,7 @@ public:
 	void commit();
 	
 private:
-	DetachedSignatureBlob::Maker mMaker;
+	DetachedSignatureMaker mMaker;
 	EmbeddedSignatureBlob::Maker mGlobal;
 };
 
@@ -162,6 +177,7 @@ public:
 	void allocate();
 	void reset(Arch &arch);
 	void write(Arch &arch, EmbeddedSignatureBlob *blob);
+	void emit(Arch &arch);
 	void commit();
 	
 private:
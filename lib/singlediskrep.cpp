@@ -26,6 +26,7 @@
 //
 #include "singlediskrep.h"
 #include "csutilities.h"
+#include "hwhash.h"
 #include <security_utilities/cfutilities.h>
 
 namespace Security {
@@ -49,7 +50,7 @@ SingleDiskRep::SingleDiskRep(const std::string &path)
 //
 CFDataRef SingleDiskRep::identification()
 {
-	SHA1 hash;
+	FastSHA1 hash;
 	this->fd().seek(0);
 	hashFileData(this->fd(), &hash);
 	SHA1::Digest digest;
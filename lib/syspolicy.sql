@@ -29,7 +29,10 @@
 -- Dates are uniformly in julian form. We use 5000000 as the canonical "never" expiration
 -- value; that's a day in the year 8977.
 --
-PRAGMA user_version = 1;
+-- The user_version is the schema level (see policydb.h); a database at the current
+-- level needs no upgrade processing.
+--
+PRAGMA user_version = 2;
 PRAGMA foreign_keys = true;
 PRAGMA legacy_file_format = false;
 PRAGMA recursive_triggers = true;
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// treehash - tree-structured digests that can be computed in parallel
+//
+#include "treehash.h"
+#include "codedirectory.h"
+#include <dispatch/dispatch.h>
+#include <libkern/OSAtomic.h>
+#include <algorithm>
+
+namespace Security {
+namespace CodeSigning {
+
+using namespace UnixPlusPlus;
+
+
+enum {
+	nodeLeaf = 0x00,
+	nodeParent = 0x01,
+	nodeResult = 0x02
+};
+
+const size_t TreeHash::chunkSize;
+const unsigned TreeHash::spanShift;
+const size_t TreeHash::spanSize;
+const size_t TreeHash::minParallelSpans;
+
+
+TreeHash::TreeHash(uint32_t nodeHashType)
+	: mNodeType(nodeHashType), mLeafBytes(0), mTotal(0), mChunks(0)
+{
+	mLeaf.reset(nodeHash(nodeLeaf));
+	mDigestLength = mLeaf->digestLength();
+	assert(mDigestLength <= sizeof(ChainValue));
+}
+
+TreeHash::~TreeHash()
+{ }
+
+
+//
+// Node hashing primitives
+//
+DynamicHash *TreeHash::nodeHash(Byte kind) const
+{
+	DynamicHash *hash = CodeDirectory::hashFor(mNodeType);
+	hash->update(&kind, 1);
+	return hash;
+}
+
+void TreeHash::leaf(const void *data, size_t length, ChainValue &cv) const
+{
+	std::auto_ptr<DynamicHash> hash(nodeHash(nodeLeaf));
+	hash->update(data, length);
+	hash->finish(cv.bytes);
+}
+
+void TreeHash::parent(const ChainValue &left, const ChainValue &right, ChainValue &cv) const
+{
+	std::auto_ptr<DynamicHash> hash(nodeHash(nodeParent));
+	hash->update(left.bytes, mDigestLength);
+	hash->update(right.bytes, mDigestLength);
+	hash->finish(cv.bytes);
+}
+
+
+//
+// Sequential operation.
+// A full leaf is not closed until more data arrives, so that finish() can
+// tell whether the input ended exactly on a chunk boundary.
+//
+void TreeHash::update(const void *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	mTotal += length;
+	while (length > 0) {
+		if (mLeafBytes == chunkSize)
+			closeLeaf();
+		size_t slice = std::min(length, chunkSize - mLeafBytes);
+		mLeaf->update(p, slice);
+		mLeafBytes += slice;
+		p += slice;
+		length -= slice;
+	}
+}
+
+void TreeHash::finish(Byte *digest)
+{
+	// the open leaf counts unless the input ended on a boundary we already closed
+	if (mLeafBytes > 0 || mChunks == 0)
+		closeLeaf();
+
+	// fold the stack of subtrees, smallest (rightmost) first
+	ChainValue top = mStack.back();
+	mStack.pop_back();
+	while (!mStack.empty()) {
+		parent(mStack.back(), top, top);
+		mStack.pop_back();
+	}
+
+	std::auto_ptr<DynamicHash> result(nodeHash(nodeResult));
+	result->update(top.bytes, mDigestLength);
+	Byte length[8];
+	for (unsigned n = 0; n < 8; n++)
+		length[n] = Byte(mTotal >> (56 - 8 * n));
+	result->update(length, sizeof(length));
+	result->finish(digest);
+}
+
+void TreeHash::closeLeaf()
+{
+	ChainValue cv;
+	mLeaf->finish(cv.bytes);
+	addSubtree(cv, 0);
+	mLeaf.reset(nodeHash(nodeLeaf));
+	mLeafBytes = 0;
+}
+
+
+//
+// Add a complete subtree of (1 << level) chunks.
+// Its position must be aligned to its size. The stack holds one subtree for each
+// bit set in mChunks; adding carries into (merges with) equal-size neighbors.
+//
+void TreeHash::addSubtree(const ChainValue &subtree, unsigned level)
+{
+	assert((mChunks & ((uint64_t(1) << level) - 1)) == 0);
+	mChunks += uint64_t(1) << level;
+	ChainValue cv = subtree;
+	for (uint64_t bits = mChunks >> level; !(bits & 1); bits >>= 1) {
+		parent(mStack.back(), cv, cv);
+		mStack.pop_back();
+	}
+	mStack.push_back(cv);
+}
+
+
+//
+// Hash one span of the file (all full chunks) into the root of its subtree.
+// Safe to call concurrently; it only reads our constant configuration.
+//
+void TreeHash::hashSpan(FileDesc fd, size_t offset, ChainValue &cv) const
+{
+	std::vector<Byte> buffer(chunkSize);
+	ChainValue level[spanShift + 1];		// pending subtree root at each level
+	for (unsigned chunk = 0; chunk < (1u << spanShift); chunk++) {
+		if (fd.read(&buffer[0], chunkSize, offset + chunk * chunkSize) != chunkSize)
+			UnixError::throwMe(EIO);		// file changed under us
+		ChainValue node;
+		leaf(&buffer[0], chunkSize, node);
+		unsigned height = 0;
+		for (unsigned bits = chunk + 1; !(bits & 1); bits >>= 1, height++)
+			parent(level[height], node, node);
+		level[height] = node;
+	}
+	cv = level[spanShift];
+}
+
+
+//
+// Hash file contents, starting at the current position, for limit bytes or to
+// end of file. Whole spans are farmed out to concurrent workers; the uneven
+// bits at the start and end are done here, sequentially.
+// Returns the number of bytes hashed, and leaves the file positioned after them.
+//
+size_t TreeHash::updateFile(FileDesc fd, size_t limit)
+{
+	size_t start = fd.position();
+	size_t fileSize = fd.fileSize();
+	size_t available = (fileSize > start) ? fileSize - start : 0;
+	if (limit && limit < available)
+		available = limit;
+
+	// sequential lead-in up to the next span boundary
+	size_t lead = (spanSize - mTotal % spanSize) % spanSize;
+	size_t spans = (available > lead) ? (available - lead) / spanSize : 0;
+	if (spans < minParallelSpans)
+		spans = 0;		// not worth it; do it all sequentially
+	size_t total = 0;
+	if (spans) {
+		std::vector<Byte> buffer(chunkSize);
+		while (total < lead) {
+			size_t got = fd.read(&buffer[0], std::min(chunkSize, lead - total));
+			if (got == 0)
+				UnixError::throwMe(EIO);
+			update(&buffer[0], got);
+			total += got;
+		}
+		if (mLeafBytes == chunkSize)	// more is coming, so this leaf is done
+			closeLeaf();
+		assert(mLeafBytes == 0);
+
+		// the parallel middle
+		std::vector<ChainValue> results(spans);
+		ChainValue *result = &results[0];
+		size_t base = start + lead;
+		__block int32_t error = 0;		// first worker failure (errno) wins
+		dispatch_apply(spans, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t n) {
+			try {
+				hashSpan(fd, base + n * spanSize, result[n]);
+			} catch (const UnixError &err) {
+				OSAtomicCompareAndSwap32Barrier(0, err.error, &error);
+			} catch (...) {
+				OSAtomicCompareAndSwap32Barrier(0, EIO, &error);
+			}
+		});
+		if (error)
+			UnixError::throwMe(error);
+		for (size_t n = 0; n < spans; n++)
+			addSubtree(results[n], spanShift);
+		mTotal += spans * spanSize;
+		total += spans * spanSize;
+		fd.seek(start + total);
+	}
+
+	// sequential remainder
+	Byte buffer[4096];
+	while (!limit || total < limit) {
+		size_t size = sizeof(buffer);
+		if (limit && limit - total < size)
+			size = limit - total;
+		size_t got = fd.read(buffer, size);
+		if (got == 0)
+			break;
+		update(buffer, got);
+		total += got;
+	}
+	return total;
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
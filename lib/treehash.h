@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+//
+// treehash - tree-structured digests that can be computed in parallel
+//
+// A plain digest is inherently sequential: every byte depends on the state left
+// by all bytes before it. A tree hash cuts its input into fixed-size chunks, digests
+// each chunk separately, and then digests pairs of those digests up a binary tree.
+// Any number of chunks can thus be hashed at the same time.
+//
+// The tree has the same shape as BLAKE3's: the left subtree of any node holds the
+// largest power-of-two number of chunks that leaves something for the right.
+// All nodes use the same underlying digest, with a leading byte to keep the
+// node kinds apart:
+//	leaf	= H(0x00 || chunk)
+//	parent	= H(0x01 || left || right)
+//	result	= H(0x02 || top || length as 64-bit big-endian)
+// Empty input is a single empty chunk.
+//
+// Used through the DynamicHash interface, a TreeHash works sequentially like any
+// other hash. Use updateFile() (or hashFileData(), which calls it) to have file
+// contents hashed concurrently.
+//
+#ifndef _H_TREEHASH
+#define _H_TREEHASH
+
+#include <security_utilities/hashing.h>
+#include <security_utilities/unix++.h>
+#include <memory>
+#include <vector>
+
+namespace Security {
+namespace CodeSigning {
+
+
+class TreeHash : public DynamicHash {
+public:
+	TreeHash(uint32_t nodeHashType);		// kSecCodeSignatureHash* type for the nodes
+	~TreeHash();
+
+	size_t digestLength() const { return mDigestLength; }
+	void update(const void *data, size_t length);
+	void finish(Byte *digest);
+
+	// like hashFileData(): from current position, to limit bytes or end of file
+	size_t updateFile(UnixPlusPlus::FileDesc fd, size_t limit = 0);
+
+	static const size_t chunkSize = 64 * 1024;		// leaf size
+	static const unsigned spanShift = 4;			// concurrent work unit is (1 << spanShift) chunks
+	static const size_t spanSize = chunkSize << spanShift;
+	static const size_t minParallelSpans = 4;		// don't bother below this
+
+private:
+	struct ChainValue {
+		Byte bytes[32];						// big enough for any node hash we take
+	};
+
+	DynamicHash *nodeHash(Byte kind) const;	// make a node hasher primed with its kind byte
+	void leaf(const void *data, size_t length, ChainValue &cv) const;
+	void parent(const ChainValue &left, const ChainValue &right, ChainValue &cv) const;
+	void hashSpan(UnixPlusPlus::FileDesc fd, size_t offset, ChainValue &cv) const;
+
+	void closeLeaf();
+	void addSubtree(const ChainValue &cv, unsigned level);
+
+private:
+	uint32_t mNodeType;						// hash type for all nodes
+	size_t mDigestLength;					// digest length of mNodeType
+	std::auto_ptr<DynamicHash> mLeaf;		// hasher for the current (open) leaf
+	size_t mLeafBytes;						// bytes in current leaf
+	uint64_t mTotal;						// bytes hashed so far
+	uint64_t mChunks;						// chunks closed so far
+	std::vector<ChainValue> mStack;			// roots of complete subtrees, largest first
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_TREEHASH
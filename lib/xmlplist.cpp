@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// xmlplist - incremental writer for XML property lists
+//
+#include "xmlplist.h"
+#include <security_utilities/cfutilities.h>
+#include <security_utilities/errors.h>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cassert>
+
+namespace Security {
+namespace CodeSigning {
+
+
+static const char prologue[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+	"<plist version=\"1.0\">\n";
+static const char epilogue[] = "</plist>\n";
+
+
+XMLPlistWriter::Sink::~Sink()
+{ }
+
+void XMLPlistWriter::DataSink::write(const void *data, size_t length)
+{
+	CFDataAppendBytes(mData, (const UInt8 *)data, length);
+}
+
+
+XMLPlistWriter::XMLPlistWriter(Sink &sink)
+	: mSink(sink), mLevel(0), mPending(NULL)
+{
+	put(prologue);
+}
+
+void XMLPlistWriter::finish()
+{
+	assert(mLevel == 0 && !mPending);
+	put(epilogue);
+}
+
+
+//
+// Containers.
+// CF writes empty containers as <dict/> and <array/>, so we hold back the
+// opening tag until we know whether anything goes inside.
+//
+void XMLPlistWriter::open()
+{
+	if (mPending) {
+		put("<"); put(mPending); put(">\n");
+		mPending = NULL;
+	}
+}
+
+void XMLPlistWriter::indent()
+{
+	open();
+	static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	for (unsigned n = mLevel; n > 0; n -= std::min(n, 16u))
+		mSink.write(tabs, std::min(n, 16u));
+}
+
+void XMLPlistWriter::beginDict()
+{
+	indent();
+	mPending = "dict";
+	mLevel++;
+}
+
+void XMLPlistWriter::key(const std::string &key)
+{
+	indent();
+	put("<key>"); escaped(key); put("</key>\n");
+}
+
+void XMLPlistWriter::endDict()
+{
+	mLevel--;
+	if (mPending) {
+		put("<dict/>\n");
+		mPending = NULL;
+	} else {
+		indent();
+		put("</dict>\n");
+	}
+}
+
+void XMLPlistWriter::beginArray()
+{
+	indent();
+	mPending = "array";
+	mLevel++;
+}
+
+void XMLPlistWriter::endArray()
+{
+	mLevel--;
+	if (mPending) {
+		put("<array/>\n");
+		mPending = NULL;
+	} else {
+		indent();
+		put("</array>\n");
+	}
+}
+
+
+//
+// Scalars
+//
+void XMLPlistWriter::text(const std::string &s)
+{
+	indent();
+	put("<string>"); escaped(s); put("</string>\n");
+}
+
+void XMLPlistWriter::integer(int64_t value)
+{
+	indent();
+	char buffer[40];
+	snprintf(buffer, sizeof(buffer), "<integer>%lld</integer>\n", (long long)value);
+	put(buffer);
+}
+
+void XMLPlistWriter::boolean(bool value)
+{
+	indent();
+	put(value ? "<true/>\n" : "<false/>\n");
+}
+
+
+//
+// Data is written in base64, in lines of at most 76 characters - counting
+// indentation tabs as 8 characters each, and indenting at most 8 levels.
+//
+void XMLPlistWriter::data(const void *bytes, size_t length)
+{
+	static const char encode[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const unsigned maxLine = 76;
+	static const char tabs[] = "\t\t\t\t\t\t\t\t";
+	unsigned depth = std::min(mLevel, 8u);
+	const unsigned lineLength = maxLine - 8 * depth;
+	
+	indent();
+	put("<data>\n");
+	const uint8_t *p = (const uint8_t *)bytes;
+	char line[maxLine + 4];
+	unsigned pos = 0;
+	for (size_t n = 0; n < length; n++, p++) {
+		switch (n % 3) {
+		case 0:
+			line[pos++] = encode[(p[0] >> 2) & 0x3f];
+			break;
+		case 1:
+			line[pos++] = encode[(((p[-1] << 8) | p[0]) >> 4) & 0x3f];
+			break;
+		case 2:
+			line[pos++] = encode[(((p[-1] << 8) | p[0]) >> 6) & 0x3f];
+			line[pos++] = encode[p[0] & 0x3f];
+			break;
+		}
+		if (pos >= lineLength) {
+			line[pos++] = '\n';
+			mSink.write(tabs, depth);
+			mSink.write(line, pos);
+			pos = 0;
+		}
+	}
+	switch (length % 3) {
+	case 0:
+		break;
+	case 1:
+		line[pos++] = encode[(p[-1] << 4) & 0x30];
+		line[pos++] = '=';
+		line[pos++] = '=';
+		break;
+	case 2:
+		line[pos++] = encode[(p[-1] << 2) & 0x3c];
+		line[pos++] = '=';
+		break;
+	}
+	if (pos > 0) {
+		line[pos++] = '\n';
+		mSink.write(tabs, depth);
+		mSink.write(line, pos);
+	}
+	indent();
+	put("</data>\n");
+}
+
+
+//
+// CF escapes only these three characters (in keys and strings alike)
+//
+void XMLPlistWriter::escaped(const std::string &s)
+{
+	std::string::size_type start = 0;
+	for (std::string::size_type n = 0; n < s.size(); n++) {
+		const char *entity;
+		switch (s[n]) {
+		case '<':	entity = "&lt;"; break;
+		case '>':	entity = "&gt;"; break;
+		case '&':	entity = "&amp;"; break;
+		default:	continue;
+		}
+		mSink.write(s.data() + start, n - start);
+		put(entity);
+		start = n + 1;
+	}
+	mSink.write(s.data() + start, s.size() - start);
+}
+
+
+//
+// Write an arbitrary property list object.
+// Dictionaries are written with keys sorted by CFStringCompare, like CF does.
+// Scalars we don't format ourselves (reals and dates) are formatted by CF.
+//
+void XMLPlistWriter::value(CFTypeRef value)
+{
+	CFTypeID type = CFGetTypeID(value);
+	if (type == CFDictionaryGetTypeID()) {
+		CFDictionaryRef dict = CFDictionaryRef(value);
+		CFIndex count = CFDictionaryGetCount(dict);
+		std::vector<const void *> keys(count), values(count);
+		if (count)
+			CFDictionaryGetKeysAndValues(dict, &keys[0], &values[0]);
+		std::vector<CFStringRef> sorted(count);
+		for (CFIndex n = 0; n < count; n++)
+			sorted[n] = CFStringRef(keys[n]);
+		std::sort(sorted.begin(), sorted.end(), cfKeyLess);
+		beginDict();
+		for (CFIndex n = 0; n < count; n++) {
+			key(cfString(sorted[n]));
+			this->value(CFDictionaryGetValue(dict, sorted[n]));
+		}
+		endDict();
+	} else if (type == CFArrayGetTypeID()) {
+		CFArrayRef array = CFArrayRef(value);
+		beginArray();
+		for (CFIndex n = 0; n < CFArrayGetCount(array); n++)
+			this->value(CFArrayGetValueAtIndex(array, n));
+		endArray();
+	} else if (type == CFStringGetTypeID()) {
+		text(cfString(CFStringRef(value)));
+	} else if (type == CFDataGetTypeID()) {
+		data(CFDataGetBytePtr(CFDataRef(value)), CFDataGetLength(CFDataRef(value)));
+	} else if (type == CFBooleanGetTypeID()) {
+		boolean(value == kCFBooleanTrue);
+	} else if (type == CFNumberGetTypeID() && !CFNumberIsFloatType(CFNumberRef(value))
+			&& CFNumberGetType(CFNumberRef(value)) != kCFNumberSInt128Type) {
+		int64_t n;
+		CFNumberGetValue(CFNumberRef(value), kCFNumberSInt64Type, &n);
+		integer(n);
+	} else
+		leaf(value);
+}
+
+bool XMLPlistWriter::cfKeyLess(CFStringRef a, CFStringRef b)
+{
+	return CFStringCompare(a, b, 0) == kCFCompareLessThan;
+}
+
+void XMLPlistWriter::leaf(CFTypeRef value)
+{
+	CFRef<CFDataRef> xml = CFPropertyListCreateXMLData(NULL, value);
+	if (!xml)
+		MacOSError::throwMe(errSecCSInternalError);
+	const char *text = (const char *)CFDataGetBytePtr(xml);
+	size_t length = CFDataGetLength(xml);
+	const size_t skip = sizeof(prologue) - 1, trim = sizeof(epilogue) - 1;
+	if (length < skip + trim)
+		MacOSError::throwMe(errSecCSInternalError);
+	indent();
+	mSink.write(text + skip, length - skip - trim);	// one line, with its newline
+}
+
+
+//
+// CF sorts dictionary keys with CFStringCompare, which (without options) compares
+// UTF-16 code units. For UTF-8 strings that's the same as comparing bytes, except
+// that characters beyond U+FFFF (surrogate pairs in UTF-16) sort before U+E000-U+FFFF.
+//
+static uint32_t firstUnit(const std::string &s, std::string::size_type pos)
+{
+	unsigned char c = s[pos];
+	uint32_t cp;
+	if (c < 0x80)
+		return c;
+	else if (c >= 0xF0)
+		return 0xD800;		// any high surrogate; ties are resolved bytewise below
+	else if (c >= 0xE0)
+		cp = c & 0x0F;
+	else
+		cp = c & 0x1F;
+	for (unsigned n = (c >= 0xE0) ? 2 : 1; n > 0 && ++pos < s.size(); n--)
+		cp = (cp << 6) | (s[pos] & 0x3F);
+	return cp;
+}
+
+bool XMLPlistWriter::keyLess(const std::string &a, const std::string &b)
+{
+	std::string::size_type diff = 0;
+	while (diff < a.size() && diff < b.size() && a[diff] == b[diff])
+		diff++;
+	if (diff == a.size() || diff == b.size())
+		return a.size() < b.size();
+	std::string::size_type start = diff;
+	while (start > 0 && (a[start] & 0xC0) == 0x80)	// back up to start of character
+		start--;
+	uint32_t ua = firstUnit(a, start), ub = firstUnit(b, start);
+	if (ua != ub)
+		return ua < ub;
+	return (unsigned char)a[diff] < (unsigned char)b[diff];	// both beyond U+FFFF; bytes order them right
+}
+
+
+} // end namespace CodeSigning
+} // end namespace Security
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All Rights Reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//
+// xmlplist - incremental writer for XML property lists
+//
+#ifndef _H_XMLPLIST
+#define _H_XMLPLIST
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <string>
+#include <cstring>
+
+namespace Security {
+namespace CodeSigning {
+
+
+//
+// An XMLPlistWriter produces an XML property list piece by piece, straight from
+// the caller's data, without first building a graph of CF objects. The output is
+// byte for byte what CFPropertyListCreateXMLData would produce for the equivalent
+// graph, as long as the caller presents dictionary keys in the order CF sorts
+// them in (see keyLess). Anything that already is a CF object can be written
+// with value(), which recurses as needed.
+//
+class XMLPlistWriter {
+public:
+	class Sink {
+	public:
+		virtual ~Sink();
+		virtual void write(const void *data, size_t length) = 0;
+	};
+	
+	class DataSink : public Sink {		// append to a CFMutableData
+	public:
+		DataSink(CFMutableDataRef data) : mData(data) { }
+		void write(const void *data, size_t length);
+	private:
+		CFMutableDataRef mData;
+	};
+
+public:
+	XMLPlistWriter(Sink &sink);			// writes the prologue
+	void finish();						// writes the epilogue; call after the root object
+	
+	void beginDict();
+	void key(const std::string &key);	// UTF-8; keys in keyLess order, please
+	void endDict();
+	void beginArray();
+	void endArray();
+	
+	void text(const std::string &s);	// <string>, UTF-8
+	void data(const void *bytes, size_t length);
+	void integer(int64_t value);
+	void boolean(bool value);
+	void value(CFTypeRef value);		// any property list object
+
+	static bool keyLess(const std::string &a, const std::string &b); // CF's key order for UTF-8 keys
+
+private:
+	void open();						// write a pending container opening
+	void indent();
+	void put(const char *s) { mSink.write(s, strlen(s)); }
+	void put(const std::string &s) { mSink.write(s.data(), s.size()); }
+	void escaped(const std::string &s);
+	void leaf(CFTypeRef value);			// let CF format a scalar
+	static bool cfKeyLess(CFStringRef a, CFStringRef b);
+
+private:
+	Sink &mSink;
+	unsigned mLevel;					// nesting depth
+	const char *mPending;				// container tag not yet written (NULL if none)
+};
+
+
+} // end namespace CodeSigning
+} // end namespace Security
+
+#endif // !_H_XMLPLIST